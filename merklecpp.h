@@ -5,21 +5,35 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cerrno>
 #include <cmath>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <format>
 #include <functional>
 #include <iterator>
 #include <limits>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <span>
 #include <sstream>
 #include <stack>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -27,6 +41,30 @@
 #  include <openssl/evp.h>
 #endif
 
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+// Hardware-accelerated hash kernels are compiled in on x86-64 and selected at
+// runtime from the CPU's feature flags. Define MERKLECPP_NO_SIMD to build only
+// the portable kernels.
+#if !defined(MERKLECPP_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#  define MERKLECPP_X86_64
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <cpuid.h>
+#  endif
+#  if defined(__GNUC__) || defined(__clang__)
+#    define MERKLECPP_TARGET(X) __attribute__((target(X)))
+#  else
+#    define MERKLECPP_TARGET(X)
+#  endif
+#endif
+
 #ifdef MERKLECPP_TRACE_ENABLED
 // Hashes in the trace output are truncated to TRACE_HASH_SIZE bytes.
 #  define TRACE_HASH_SIZE 3
@@ -300,15 +338,551 @@ namespace merkle
     }
   };
 
+  /// @brief Template for node hashes computed as part of a batch
+  /// @tparam SIZE Size of the hash in number of bytes
+  /// @note A batch hash function sets *out to the hash of *l and *r for each
+  /// pair. @p out may alias an input of the same pair or of an earlier pair in
+  /// the batch.
+  template <size_t SIZE>
+  struct HashPairT
+  {
+    /// @brief The left node hash
+    const HashT<SIZE>* l;
+
+    /// @brief The right node hash
+    const HashT<SIZE>* r;
+
+    /// @brief The output node hash
+    HashT<SIZE>* out;
+  };
+
+  namespace detail
+  {
+    template <typename H, size_t SIZE>
+    concept NodeHashFunction = std::is_pointer_v<H> &&
+      std::is_invocable_r_v<
+        void,
+        H,
+        const HashT<SIZE>&,
+        const HashT<SIZE>&,
+        HashT<SIZE>&>;
+
+    template <typename H, size_t SIZE>
+    concept StaticHasherPolicy = requires(
+      const HashT<SIZE>& l, const HashT<SIZE>& r, HashT<SIZE>& out) {
+      H::hash(l, r, out);
+    };
+
+    template <typename H, size_t SIZE>
+    concept ThreadHasherPolicy = requires(
+      typename H::thread_state& state,
+      const HashT<SIZE>& l,
+      const HashT<SIZE>& r,
+      HashT<SIZE>& out) { state.hash(l, r, out); };
+  }
+
+  /// @brief Node hashers accepted as HASH_FUNCTION template arguments
+  /// @details A node hasher is either a function
+  /// `void f(const HashT<SIZE>& l, const HashT<SIZE>& r, HashT<SIZE>& out)`,
+  /// or a hasher policy object such as `MyHasher{}`. A policy type has
+  /// - a static `hash(l, r, out)`, or
+  /// - a nested `thread_state` type with a member `hash(l, r, out)`; one
+  ///   default-constructed instance is kept per thread, for example for
+  ///   library contexts or precomputed key schedules.
+  ///
+  /// Either kind of policy may also provide `hash_batch(pairs)`, taking a
+  /// `std::span<const HashPairT<SIZE>>`, to compute many independent node
+  /// hashes at once; see hash_batch(). Policy types must be usable as
+  /// template arguments, which empty structs are.
+  template <typename H, size_t SIZE>
+  concept NodeHasher = detail::NodeHashFunction<H, SIZE> ||
+    detail::StaticHasherPolicy<H, SIZE> || detail::ThreadHasherPolicy<H, SIZE>;
+
+  template <size_t HASH_SIZE, NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
+  static inline void hash_batch(std::span<const HashPairT<HASH_SIZE>> pairs);
+
+  namespace detail
+  {
+    /// @brief The calling thread's state of a hasher policy
+    /// @note Not static, so that all translation units share one state per
+    /// thread.
+    template <typename POLICY>
+    inline typename POLICY::thread_state& hasher_thread_state()
+    {
+      thread_local typename POLICY::thread_state state;
+      return state;
+    }
+
+    /// @brief Computes a node hash with a node hasher
+    template <size_t SIZE, auto HASH_FUNCTION>
+    static inline void hash_node(
+      const HashT<SIZE>& l, const HashT<SIZE>& r, HashT<SIZE>& out)
+    {
+      using H = std::remove_cvref_t<decltype(HASH_FUNCTION)>;
+      if constexpr (ThreadHasherPolicy<H, SIZE>)
+      {
+        hasher_thread_state<H>().hash(l, r, out);
+      }
+      else if constexpr (StaticHasherPolicy<H, SIZE>)
+      {
+        H::hash(l, r, out);
+      }
+      else
+      {
+        HASH_FUNCTION(l, r, out);
+      }
+    }
+
+    template <auto A>
+    struct HasherTag
+    {};
+
+    /// @brief Whether two node hashers are the same function or policy
+    template <auto A, auto B>
+    static constexpr bool same_hasher =
+      std::is_same_v<HasherTag<A>, HasherTag<B>>;
+  }
+
+  namespace detail
+  {
+    /// @brief Slab allocator for the nodes of a tree
+    /// @tparam T Type of the objects to allocate
+    /// @details Objects are carved out of slabs of slab_size() bytes that are
+    /// aligned to their size, so that the slab of an object is found from its
+    /// address. Freed objects are reused, and a slab is released as soon as
+    /// none of its objects are in use.
+    template <typename T>
+    class SlabAllocator
+    {
+    public:
+      /// @brief Default slab size in bytes
+      static constexpr size_t default_slab_size = size_t{256} * 1024;
+
+      /// @brief Slab size in bytes with huge pages
+      static constexpr size_t huge_slab_size = size_t{2} * 1024 * 1024;
+
+      SlabAllocator() = default;
+      SlabAllocator(const SlabAllocator&) = delete;
+      SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+      SlabAllocator(SlabAllocator&& other) noexcept
+      {
+        *this = std::move(other);
+      }
+
+      SlabAllocator& operator=(SlabAllocator&& other) noexcept
+      {
+        if (this != &other)
+        {
+          release();
+          close_file();
+          size = other.size;
+          huge_pages = other.huge_pages;
+          file = std::exchange(other.file, -1);
+          file_size = std::exchange(other.file_size, 0);
+          free_file_offsets = std::exchange(other.free_file_offsets, {});
+          slabs = std::exchange(other.slabs, nullptr);
+          current = std::exchange(other.current, nullptr);
+          partial = std::exchange(other.partial, nullptr);
+          num_slabs = std::exchange(other.num_slabs, 0);
+        }
+        return *this;
+      }
+
+      ~SlabAllocator()
+      {
+        release();
+        close_file();
+      }
+
+      /// @brief Allocates memory for one object
+      void* allocate()
+      {
+        if (current != nullptr)
+        {
+          if (void* p = take(current))
+          {
+            return p;
+          }
+          current = nullptr;
+        }
+        if (partial != nullptr)
+        {
+          current = partial;
+          unlink_partial(current);
+          return take(current);
+        }
+        current = new_slab();
+        return take(current);
+      }
+
+      /// @brief Frees the memory of an object
+      /// @param p The object's memory, as returned by allocate()
+      void deallocate(void* p) noexcept
+      {
+        Slab* slab = slab_of(p);
+        auto* object = static_cast<FreeObject*>(p);
+        object->next = slab->free;
+        slab->free = object;
+        slab->live--;
+        if (slab == current)
+        {
+          return;
+        }
+        if (slab->live == 0)
+        {
+          if (slab->in_partial)
+          {
+            unlink_partial(slab);
+          }
+          free_slab(slab);
+        }
+        else if (!slab->in_partial)
+        {
+          link_partial(slab);
+        }
+      }
+
+      /// @brief Releases all slabs, freeing all objects at once
+      void release() noexcept
+      {
+        while (slabs != nullptr)
+        {
+          free_slab(slabs);
+        }
+        current = partial = nullptr;
+#ifndef _WIN32
+        if (file >= 0)
+        {
+          (void)::ftruncate(file, 0);
+          file_size = 0;
+          free_file_offsets.clear();
+        }
+#endif
+      }
+
+      /// @brief Allocates future slabs with transparent huge pages, where
+      /// supported
+      /// @note Only possible while no slabs are allocated.
+      void use_huge_pages()
+      {
+        if (num_slabs != 0)
+        {
+          throw std::runtime_error("nodes already allocated");
+        }
+        if (file >= 0)
+        {
+          throw std::runtime_error("huge pages are not used for node files");
+        }
+        size = huge_slab_size;
+        huge_pages = true;
+      }
+
+      /// @brief Maps future slabs from an unnamed file, so that the operating
+      /// system can page them out to it instead of keeping them in memory
+      /// @param directory The directory of the file
+      /// @note Only possible while no slabs are allocated. The file grows by
+      /// one slab at a time, is not a persistent format, and is removed when
+      /// the allocator is destroyed. Not supported on Windows.
+      void use_file(const std::string& directory)
+      {
+        if (num_slabs != 0)
+        {
+          throw std::runtime_error("nodes already allocated");
+        }
+        if (huge_pages)
+        {
+          throw std::runtime_error("huge pages are not used for node files");
+        }
+#ifdef _WIN32
+        (void)directory;
+        throw std::runtime_error("node files are not supported on Windows");
+#else
+        std::string name = directory + "/merklecpp-nodes-XXXXXX";
+        const int fd = ::mkstemp(name.data());
+        if (fd < 0)
+        {
+          throw std::runtime_error(std::format(
+            "cannot create node file in {}: {}",
+            directory,
+            std::strerror(errno)));
+        }
+        ::unlink(name.c_str());
+        close_file();
+        file = fd;
+#endif
+      }
+
+      /// @brief The size of each slab in bytes
+      [[nodiscard]] size_t slab_size() const
+      {
+        return size;
+      }
+
+      /// @brief The number of slabs currently allocated
+      [[nodiscard]] size_t slab_count() const
+      {
+        return num_slabs;
+      }
+
+    protected:
+      struct FreeObject
+      {
+        FreeObject* next;
+      };
+
+      /// @brief The header at the start of each slab
+      struct alignas(std::max(alignof(T), size_t{64})) Slab
+      {
+        Slab* prev;
+        Slab* next;
+        Slab* prev_partial;
+        Slab* next_partial;
+        FreeObject* free;
+        size_t live;
+        size_t used;
+        size_t capacity;
+        size_t file_offset;
+        bool in_partial;
+      };
+
+      static constexpr size_t object_size =
+        (std::max(sizeof(T), sizeof(FreeObject)) + alignof(T) - 1) /
+        alignof(T) * alignof(T);
+
+      size_t size = default_slab_size;
+      bool huge_pages = false;
+      int file = -1;
+      size_t file_size = 0;
+      std::vector<size_t> free_file_offsets;
+      Slab* slabs = nullptr;
+      Slab* current = nullptr;
+      Slab* partial = nullptr;
+      size_t num_slabs = 0;
+
+      Slab* slab_of(void* p) const
+      {
+        return reinterpret_cast<Slab*>(
+          reinterpret_cast<uintptr_t>(p) & ~(uintptr_t{size} - 1));
+      }
+
+      static void* take(Slab* slab)
+      {
+        void* r = nullptr;
+        if (slab->free != nullptr)
+        {
+          r = slab->free;
+          slab->free = slab->free->next;
+        }
+        else if (slab->used < slab->capacity)
+        {
+          r = reinterpret_cast<uint8_t*>(slab + 1) + slab->used * object_size;
+          slab->used++;
+        }
+        else
+        {
+          return nullptr;
+        }
+        slab->live++;
+        return r;
+      }
+
+      void close_file() noexcept
+      {
+#ifndef _WIN32
+        if (file >= 0)
+        {
+          ::close(file);
+          file = -1;
+        }
+#endif
+      }
+
+      /// @brief Maps an aligned slab, so that releasing it returns its memory
+      /// to the operating system
+      /// @param file_offset The offset of the slab in the node file, if any
+      void* map_slab(size_t file_offset) const
+      {
+#ifdef _WIN32
+        (void)file_offset;
+        return ::operator new(size, std::align_val_t{size});
+#else
+        // Reserve twice the size, to place the slab at an aligned address.
+        void* memory = ::mmap(
+          nullptr,
+          2 * size,
+          file >= 0 ? PROT_NONE : PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS,
+          -1,
+          0);
+        if (memory == MAP_FAILED)
+        {
+          throw std::bad_alloc();
+        }
+        auto* begin = static_cast<uint8_t*>(memory);
+        auto* aligned = reinterpret_cast<uint8_t*>(
+          (reinterpret_cast<uintptr_t>(begin) + size - 1) &
+          ~(uintptr_t{size} - 1));
+        if (
+          file >= 0 &&
+          ::mmap(
+            aligned,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED,
+            file,
+            static_cast<off_t>(file_offset)) == MAP_FAILED)
+        {
+          ::munmap(begin, 2 * size);
+          throw std::bad_alloc();
+        }
+        if (aligned != begin)
+        {
+          ::munmap(begin, aligned - begin);
+        }
+        ::munmap(aligned + size, begin + 2 * size - (aligned + size));
+#  ifdef MADV_HUGEPAGE
+        if (huge_pages)
+        {
+          // Only a hint; slabs work without huge pages.
+          ::madvise(aligned, size, MADV_HUGEPAGE);
+        }
+#  endif
+        return aligned;
+#endif
+      }
+
+      void unmap_slab(void* slab) const noexcept
+      {
+#ifdef _WIN32
+        ::operator delete(slab, size, std::align_val_t{size});
+#else
+#  ifdef MADV_REMOVE
+        if (file >= 0)
+        {
+          // Frees the slab's blocks in the node file.
+          ::madvise(slab, size, MADV_REMOVE);
+        }
+#  endif
+        ::munmap(slab, size);
+#endif
+      }
+
+      /// @brief Finds a free slab-sized range in the node file, growing the
+      /// file if there is none
+      size_t take_file_offset()
+      {
+#ifndef _WIN32
+        if (!free_file_offsets.empty())
+        {
+          const size_t offset = free_file_offsets.back();
+          free_file_offsets.pop_back();
+          return offset;
+        }
+        if (::ftruncate(file, static_cast<off_t>(file_size + size)) != 0)
+        {
+          throw std::bad_alloc();
+        }
+        file_size += size;
+        return file_size - size;
+#else
+        return 0;
+#endif
+      }
+
+      Slab* new_slab()
+      {
+        const size_t file_offset = file >= 0 ? take_file_offset() : 0;
+        Slab* slab = nullptr;
+        try
+        {
+          slab = static_cast<Slab*>(map_slab(file_offset));
+        }
+        catch (...)
+        {
+          if (file >= 0)
+          {
+            free_file_offsets.push_back(file_offset);
+          }
+          throw;
+        }
+        slab->file_offset = file_offset;
+        slab->prev = nullptr;
+        slab->next = slabs;
+        if (slabs != nullptr)
+        {
+          slabs->prev = slab;
+        }
+        slabs = slab;
+        slab->prev_partial = slab->next_partial = nullptr;
+        slab->free = nullptr;
+        slab->live = slab->used = 0;
+        slab->capacity = (size - sizeof(Slab)) / object_size;
+        slab->in_partial = false;
+        num_slabs++;
+        return slab;
+      }
+
+      void free_slab(Slab* slab) noexcept
+      {
+        if (slab->prev != nullptr)
+        {
+          slab->prev->next = slab->next;
+        }
+        else
+        {
+          slabs = slab->next;
+        }
+        if (slab->next != nullptr)
+        {
+          slab->next->prev = slab->prev;
+        }
+        num_slabs--;
+        if (file >= 0)
+        {
+          free_file_offsets.push_back(slab->file_offset);
+        }
+        unmap_slab(slab);
+      }
+
+      void link_partial(Slab* slab) noexcept
+      {
+        slab->prev_partial = nullptr;
+        slab->next_partial = partial;
+        if (partial != nullptr)
+        {
+          partial->prev_partial = slab;
+        }
+        partial = slab;
+        slab->in_partial = true;
+      }
+
+      void unlink_partial(Slab* slab) noexcept
+      {
+        if (slab->prev_partial != nullptr)
+        {
+          slab->prev_partial->next_partial = slab->next_partial;
+        }
+        else
+        {
+          partial = slab->next_partial;
+        }
+        if (slab->next_partial != nullptr)
+        {
+          slab->next_partial->prev_partial = slab->prev_partial;
+        }
+        slab->in_partial = false;
+      }
+    };
+  }
+
   /// @brief Template for Merkle paths
   /// @tparam HASH_SIZE Size of each hash in number of bytes
-  /// @tparam HASH_FUNCTION The hash function
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
   template <
     size_t HASH_SIZE,
-    void HASH_FUNCTION(
-      const HashT<HASH_SIZE>& l,
-      const HashT<HASH_SIZE>& r,
-      HashT<HASH_SIZE>& out)>
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
   class PathT
   {
   public:
@@ -384,7 +958,7 @@ namespace merkle
             MERKLECPP_TOUT << " - " << e.hash.to_string(TRACE_HASH_SIZE)
                            << " x " << result->to_string(TRACE_HASH_SIZE)
                            << std::endl);
-          HASH_FUNCTION(e.hash, *result, *result);
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(e.hash, *result, *result);
         }
         else
         {
@@ -392,7 +966,7 @@ namespace merkle
             MERKLECPP_TOUT << " - " << result->to_string(TRACE_HASH_SIZE)
                            << " x " << e.hash.to_string(TRACE_HASH_SIZE)
                            << std::endl);
-          HASH_FUNCTION(*result, e.hash, *result);
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(*result, e.hash, *result);
         }
       }
       MERKLECPP_TRACE(
@@ -584,48 +1158,79 @@ namespace merkle
 
   /// @brief Template for Merkle trees
   /// @tparam HASH_SIZE Size of each hash in number of bytes
-  /// @tparam HASH_FUNCTION The hash function
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
   template <
     size_t HASH_SIZE,
-    void HASH_FUNCTION(
-      const HashT<HASH_SIZE>& l,
-      const HashT<HASH_SIZE>& r,
-      HashT<HASH_SIZE>& out)>
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
   class TreeT
   {
   protected:
+    struct Node;
+
+    /// @brief The allocator of tree nodes
+    using NodeAllocator = detail::SlabAllocator<Node>;
+
     /// @brief The structure of tree nodes
     struct Node
     {
       /// @brief Constructs a new tree node
+      /// @param allocator The allocator of the tree
+      /// @param hash The hash of the node
+      static Node* make(NodeAllocator& allocator, const HashT<HASH_SIZE>& hash)
+      {
+        return make(allocator, hash.bytes);
+      }
+
+      /// @brief Constructs a new tree node
+      /// @param allocator The allocator of the tree
       /// @param hash The hash of the node
-      static Node* make(const HashT<HASH_SIZE>& hash)
+      static Node* make(NodeAllocator& allocator, const uint8_t* hash)
       {
-        auto r = new Node();
+        auto r = new (allocator.allocate()) Node();
         r->left = r->right = nullptr;
-        r->hash = hash;
+        std::copy(hash, hash + HASH_SIZE, r->hash.bytes);
         r->dirty = false;
+        r->frozen = false;
         r->update_sizes();
         assert(r->invariant());
         return r;
       }
 
       /// @brief Constructs a new tree node
+      /// @param allocator The allocator of the tree
       /// @param left The left child of the new node
       /// @param right The right child of the new node
-      static Node* make(Node* left, Node* right)
+      static Node* make(NodeAllocator& allocator, Node* left, Node* right)
       {
         assert(left && right);
-        auto r = new Node();
+        auto r = new (allocator.allocate()) Node();
         r->left = left;
         r->right = right;
         r->dirty = true;
+        r->frozen = false;
         r->update_sizes();
         assert(r->invariant());
         return r;
       }
 
+      /// @brief Frees a tree node and its subtree
+      /// @param allocator The allocator of the tree
+      /// @param n The tree node, or nullptr
+      static void free(NodeAllocator& allocator, Node* n)
+      {
+        if (n == nullptr)
+        {
+          return;
+        }
+        free(allocator, n->left);
+        free(allocator, n->right);
+        n->~Node();
+        allocator.deallocate(n);
+      }
+
       /// @brief Copies a tree node
+      /// @param allocator The allocator of the tree
       /// @param from Node to copy
       /// @param leaf_nodes Current leaf nodes of the tree
       /// @param num_flushed Number of flushed nodes of the tree
@@ -633,6 +1238,7 @@ namespace merkle
       /// @param max_index Maximum leaf index of the tree
       /// @param indent Indentation of trace output
       static Node* copy_node(
+        NodeAllocator& allocator,
         const Node* from,
         std::vector<Node*>* leaf_nodes = nullptr,
         size_t* num_flushed = nullptr,
@@ -645,11 +1251,13 @@ namespace merkle
           return nullptr;
         }
 
-        Node* r = make(from->hash);
+        Node* r = make(allocator, from->hash);
         r->size = from->size;
         r->height = from->height;
         r->dirty = from->dirty;
+        r->frozen = from->frozen;
         r->left = copy_node(
+          allocator,
           from->left,
           leaf_nodes,
           num_flushed,
@@ -657,6 +1265,7 @@ namespace merkle
           max_index,
           indent + 1);
         r->right = copy_node(
+          allocator,
           from->right,
           leaf_nodes,
           num_flushed,
@@ -674,13 +1283,21 @@ namespace merkle
             *num_flushed = *num_flushed - 1;
           }
         }
+        else if (leaf_nodes && r->frozen)
+        {
+          // The leaves of frozen blocks have no nodes.
+          const size_t num_leaves = (r->size + 1) / 2;
+          const size_t num_skipped = std::min(*num_flushed, num_leaves);
+          leaf_nodes->resize(leaf_nodes->size() + num_leaves - num_skipped);
+          *num_flushed = *num_flushed - num_skipped;
+        }
         return r;
       }
 
       /// @brief Checks invariant of a tree node
       /// @note This indicates whether some basic properties of the tree
       /// construction are violated.
-      bool invariant()
+      bool invariant() const
       {
         bool c1 = (left && right) || (!left && !right);
         bool c2 = !left || !right || (size == left->size + right->size + 1);
@@ -691,15 +1308,6 @@ namespace merkle
         return r;
       }
 
-      ~Node()
-      {
-        assert(invariant());
-        // Potential future improvement: remove recursion and keep nodes for
-        // future insertions
-        delete (left);
-        delete (right);
-      }
-
       /// @brief Indicates whether a subtree is full
       /// @note A subtree is full if the number of nodes under a tree is
       /// 2**height-1.
@@ -725,7 +1333,7 @@ namespace merkle
           size = left->size + right->size + 1;
           height = std::max(left->height, right->height) + 1;
         }
-        else
+        else if (!frozen)
         {
           size = height = 1;
         }
@@ -750,23 +1358,273 @@ namespace merkle
       /// @note The @p hash is only correct if this flag is false, otherwise
       /// it needs to be computed by calling hash() on the node.
       bool dirty;
+
+      /// @brief Frozen flag
+      /// @note Frozen nodes are full subtrees without child nodes; the hashes
+      /// below them are kept in a FrozenBlock, see TreeT::freeze_to().
+      bool frozen;
     };
 
-  public:
-    /// @brief Hash function used to combine tree nodes.
-    static constexpr auto hash_function = HASH_FUNCTION;
+    /// @brief The structure of frozen blocks
+    /// @note A frozen block holds the hashes of a full subtree by their
+    /// position in heap order: the root at position 1 and the children of
+    /// position i at positions 2i and 2i+1, so that the leaves are at the
+    /// positions from 2**(height-1). It keeps the leaves, the root and every
+    /// stride-th level in between, level by level from the leaves up; the
+    /// other hashes are recomputed from the kept level below them when
+    /// needed, and cached.
+    struct FrozenBlock
+    {
+      /// @brief Maximum distance between kept levels
+      static constexpr uint8_t max_stride = 8;
+
+      /// @brief Constructs a frozen block
+      /// @param height The height of the subtree
+      /// @param stride The distance between kept levels
+      /// @param cache_size The number of recomputed hashes to cache
+      FrozenBlock(uint8_t height, uint8_t stride, size_t cache_size) :
+        height(height),
+        stride(stride),
+        cache_size(cache_size)
+      {
+        if (stride == 0 || stride > max_stride)
+        {
+          throw std::runtime_error("invalid frozen block stride");
+        }
+        size_t num_hashes = 0;
+        offsets.resize(height);
+        for (uint8_t level = 0; level < height; level++)
+        {
+          offsets[level] = num_hashes;
+          if (is_kept(level))
+          {
+            num_hashes += size_t{1} << (height - 1 - level);
+          }
+        }
+        hashes.resize(num_hashes);
+      }
 
-    /// @brief The type of hashes in the tree
-    using Hash = HashT<HASH_SIZE>;
+      /// @brief The level of a position, counting the leaves as level 0
+      [[nodiscard]] uint8_t level(size_t position) const
+      {
+        return static_cast<uint8_t>(height - std::bit_width(position));
+      }
 
-    /// @brief The type of paths in the tree
-    using Path = PathT<HASH_SIZE, HASH_FUNCTION>;
+      /// @brief Indicates whether the hashes of a level are kept
+      [[nodiscard]] bool is_kept(uint8_t level) const
+      {
+        return level % stride == 0 || level == height - 1;
+      }
 
-    /// @brief The type of the tree
-    using Tree = TreeT<HASH_SIZE, HASH_FUNCTION>;
+      /// @brief The kept hash at a position
+      [[nodiscard]] HashT<HASH_SIZE>& at(size_t position)
+      {
+        const uint8_t l = level(position);
+        assert(is_kept(l));
+        return hashes[offsets[l] + position - (size_t{1} << (height - 1 - l))];
+      }
 
-    /// @brief Constructs an empty tree
-    TreeT() = default;
+      /// @brief The kept hash at a position
+      [[nodiscard]] const HashT<HASH_SIZE>& at(size_t position) const
+      {
+        return const_cast<FrozenBlock*>(this)->at(position);
+      }
+
+      /// @brief The hash at a position, recomputed if it is not kept
+      /// @param position The position
+      /// @param cached Indicates whether to look up and cache recomputed
+      /// hashes; snapshots do not, because several threads may read them.
+      [[nodiscard]] HashT<HASH_SIZE> hash(
+        size_t position, bool cached = true) const
+      {
+        const uint8_t l = level(position);
+        if (is_kept(l))
+        {
+          return at(position);
+        }
+
+        if (cached && cache.size() != cache_size)
+        {
+          cache.assign(cache_size, {0, {}});
+        }
+        auto* entry = cached && cache_size > 0 ?
+          &cache[position % cache_size] :
+          nullptr;
+        if (entry && entry->first == position)
+        {
+          return entry->second;
+        }
+
+        // Hash the subtree up from the kept level below.
+        const uint8_t r = l % stride;
+        std::array<HashT<HASH_SIZE>, (size_t{1} << (max_stride - 1))> scratch;
+        std::array<HashPairT<HASH_SIZE>, (size_t{1} << (max_stride - 2))>
+          pairs;
+        const size_t first = position << r;
+        for (size_t i = 0; i < (size_t{1} << r); i++)
+        {
+          scratch[i] = at(first + i);
+        }
+        for (size_t w = size_t{1} << (r - 1); w > 0; w /= 2)
+        {
+          for (size_t j = 0; j < w; j++)
+          {
+            pairs[j] = {&scratch[2 * j], &scratch[2 * j + 1], &scratch[j]};
+          }
+          hash_batch<HASH_SIZE, HASH_FUNCTION>(std::span(pairs.data(), w));
+        }
+
+        if (entry)
+        {
+          *entry = {position, scratch[0]};
+        }
+        return scratch[0];
+      }
+
+      /// @brief The position of a leaf in the block
+      /// @param offset The offset of the leaf from the first leaf of the block
+      [[nodiscard]] size_t leaf_position(size_t offset) const
+      {
+        return (size_t{1} << (height - 1)) + offset;
+      }
+
+      /// @brief The height of the subtree
+      uint8_t height;
+
+      /// @brief The distance between kept levels
+      uint8_t stride;
+
+      /// @brief The kept hashes, level by level from the leaves up
+      std::vector<HashT<HASH_SIZE>> hashes;
+
+      /// @brief The offset of each level in @p hashes
+      std::vector<size_t> offsets;
+
+      /// @brief The number of recomputed hashes to cache
+      size_t cache_size;
+
+      /// @brief Recently recomputed hashes by position, direct-mapped
+      mutable std::vector<std::pair<size_t, HashT<HASH_SIZE>>> cache;
+    };
+
+    /// @brief A position on a walk down the tree
+    /// @note This is a tree node, or a position in the frozen block of a
+    /// frozen node.
+    struct Cursor
+    {
+      /// @brief The tree node, if not in a frozen block
+      const Node* node = nullptr;
+
+      /// @brief The frozen block
+      const FrozenBlock* block = nullptr;
+
+      /// @brief The position in the frozen block
+      size_t position = 0;
+
+      /// @brief The height of the subtree at the cursor
+      [[nodiscard]] uint8_t height() const
+      {
+        return block ?
+          static_cast<uint8_t>(block->height + 1 - std::bit_width(position)) :
+          node->height;
+      }
+
+      /// @brief The hash at the cursor
+      /// @param cached Indicates whether frozen blocks may look up and cache
+      /// recomputed hashes; see FrozenBlock::hash()
+      [[nodiscard]] HashT<HASH_SIZE> hash(bool cached = true) const
+      {
+        return block ? block->hash(position, cached) : node->hash;
+      }
+
+      /// @brief The hash of a child of the cursor
+      /// @param right Indicates whether to get the hash of the right child
+      [[nodiscard]] HashT<HASH_SIZE> child_hash(bool right) const
+      {
+        if (block)
+        {
+          return block->hash(2 * position + (right ? 1 : 0));
+        }
+        return (right ? node->right : node->left)->hash;
+      }
+
+      bool operator==(const Cursor& other) const = default;
+    };
+
+    /// @brief A period in which snapshots are taken, and the nodes and
+    /// frozen blocks retired after them
+    /// @note Snapshots refer to nodes and frozen blocks that existed when they
+    /// were taken, so those retired in an epoch are freed once that epoch and
+    /// all earlier ones have no snapshots left.
+    struct Epoch
+    {
+      /// @brief The number of live snapshots taken in the epoch
+      std::atomic<size_t> num_snapshots = 0;
+
+      /// @brief The retired nodes, with an indication of whether the subtree
+      /// under each is retired too
+      std::vector<std::pair<Node*, bool>> retired;
+
+      /// @brief The retired frozen blocks, still at their addresses
+      std::vector<typename std::map<size_t, FrozenBlock>::node_type>
+        retired_blocks;
+    };
+
+    /// @brief A counted reference to an epoch, held by snapshots
+    class EpochRef
+    {
+    public:
+      EpochRef() = default;
+
+      explicit EpochRef(Epoch* epoch) : epoch(epoch)
+      {
+        if (epoch)
+        {
+          epoch->num_snapshots.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+
+      EpochRef(const EpochRef& other) : EpochRef(other.epoch) {}
+
+      EpochRef(EpochRef&& other) noexcept :
+        epoch(std::exchange(other.epoch, nullptr))
+      {}
+
+      EpochRef& operator=(EpochRef other) noexcept
+      {
+        std::swap(epoch, other.epoch);
+        return *this;
+      }
+
+      ~EpochRef()
+      {
+        if (epoch)
+        {
+          // Pairs with the acquire in num_snapshots(), before the tree
+          // changes or frees nodes that the snapshot may have read.
+          epoch->num_snapshots.fetch_sub(1, std::memory_order_release);
+        }
+      }
+
+    private:
+      Epoch* epoch = nullptr;
+    };
+
+  public:
+    /// @brief Hash function used to combine tree nodes.
+    static constexpr auto hash_function = HASH_FUNCTION;
+
+    /// @brief The type of hashes in the tree
+    using Hash = HashT<HASH_SIZE>;
+
+    /// @brief The type of paths in the tree
+    using Path = PathT<HASH_SIZE, HASH_FUNCTION>;
+
+    /// @brief The type of the tree
+    using Tree = TreeT<HASH_SIZE, HASH_FUNCTION>;
+
+    /// @brief Constructs an empty tree
+    TreeT() = default;
 
     /// @brief Copies a tree
     TreeT(const TreeT& other)
@@ -776,8 +1634,12 @@ namespace merkle
 
     /// @brief Moves a tree
     /// @param other Tree to move
-    TreeT(TreeT&& other) noexcept
+    /// @note Readers of @p other move with it, but this throws if @p other
+    /// has live snapshots, including a published version; they refer to the
+    /// tree they were taken of.
+    TreeT(TreeT&& other)
     {
+      other.check_no_snapshots();
       move_from(other);
     }
 
@@ -809,6 +1671,66 @@ namespace merkle
       clear();
     }
 
+    /// @brief Allocates the nodes of the tree on transparent huge pages, where
+    /// the platform supports them
+    /// @note Only possible while the tree has no nodes.
+    void use_huge_pages()
+    {
+      node_allocator.use_huge_pages();
+    }
+
+    /// @brief Keeps the nodes of the tree in an unnamed, memory-mapped file
+    /// in @p directory, so that the operating system can page them out when
+    /// the tree outgrows memory
+    /// @note Only possible while the tree has no nodes. The leaf index (8
+    /// bytes per leaf) and frozen blocks remain in memory; freeze_to() and
+    /// flush_to() still bound those. Not supported on Windows.
+    void use_node_file(const std::string& directory)
+    {
+      node_allocator.use_file(directory);
+    }
+
+    /// @brief The number of memory slabs holding the nodes of the tree
+    [[nodiscard]] size_t num_node_slabs() const
+    {
+      return node_allocator.slab_count();
+    }
+
+    /// @brief The number of frozen blocks of the tree; see freeze_to()
+    [[nodiscard]] size_t num_frozen_blocks() const
+    {
+      return frozen_blocks.size();
+    }
+
+    /// @brief Starts hashing full subtrees on a background thread
+    /// @param height The height of the subtrees to hash, counting leaves as
+    /// 0; each covers 2**height leaves
+    /// @note Whenever insert() completes a full subtree of 2**height leaves,
+    /// the new leaves are inserted into the tree structure and the subtree is
+    /// handed to the background thread. Nothing else changes inside full
+    /// subtrees until they are flushed or retracted, so insertion carries on
+    /// while they are hashed. Operations that read node hashes or remove
+    /// nodes, such as root(), path() or flush_to(), first wait for the
+    /// handed-over subtrees, and then only hash the nodes above them. Copies
+    /// of the tree do not hash in the background.
+    void start_background_hashing(uint8_t height = 10)
+    {
+      if (height == 0 || height >= std::numeric_limits<size_t>::digits)
+      {
+        throw std::runtime_error("invalid background hashing height");
+      }
+      stop_background_hashing();
+      background = std::make_unique<BackgroundHashing>(height);
+    }
+
+    /// @brief Stops hashing full subtrees on a background thread, after the
+    /// subtrees handed to it are hashed
+    void stop_background_hashing()
+    {
+      sync_background();
+      background.reset();
+    }
+
     /// @brief Invariant of the tree
     bool invariant()
     {
@@ -819,37 +1741,69 @@ namespace merkle
     /// @param hash Hash to insert
     void insert(const uint8_t* hash)
     {
-      insert(Hash(hash));
+      MERKLECPP_TRACE(
+        MERKLECPP_TOUT << "> insert " << Hash(hash).to_string(TRACE_HASH_SIZE)
+                       << std::endl;);
+      uninserted_leaf_nodes.push_back(Node::make(node_allocator, hash));
+      statistics.num_insert++;
+      if (
+        background &&
+        (num_leaves() & ((size_t{1} << background->height) - 1)) == 0)
+      {
+        submit_background();
+      }
     }
 
     /// @brief Inserts a hash into the tree
     /// @param hash Hash to insert
     void insert(const Hash& hash)
     {
-      MERKLECPP_TRACE(
-        MERKLECPP_TOUT << "> insert " << hash.to_string(TRACE_HASH_SIZE)
-                       << std::endl;);
-      uninserted_leaf_nodes.push_back(Node::make(hash));
-      statistics.num_insert++;
+      insert(hash.bytes);
     }
 
     /// @brief Inserts multiple hashes into the tree
-    /// @param hashes Vector of hashes to insert
-    void insert(const std::vector<Hash>& hashes)
+    /// @param hashes Hashes to insert
+    void insert(std::span<const Hash> hashes)
+    {
+      reserve_uninserted(hashes.size());
+      for (const auto& hash : hashes)
+      {
+        insert(hash.bytes);
+      }
+    }
+
+    /// @brief Inserts multiple hashes into the tree
+    /// @param bytes Buffer of concatenated hashes to insert
+    /// @note Each hash is copied once, from @p bytes into its leaf node. This
+    /// is not an overload of insert(), which converts a vector of bytes to
+    /// one hash.
+    void insert_bytes(std::span<const uint8_t> bytes)
     {
-      for (auto hash : hashes)
+      if (bytes.size() % HASH_SIZE != 0)
       {
-        insert(hash);
+        throw std::runtime_error("incomplete hash in buffer");
       }
+      reserve_uninserted(bytes.size() / HASH_SIZE);
+      for (size_t i = 0; i < bytes.size(); i += HASH_SIZE)
+      {
+        insert(bytes.data() + i);
+      }
+    }
+
+    /// @brief Inserts multiple hashes into the tree
+    /// @param hashes Vector of hashes to insert
+    void insert(const std::vector<Hash>& hashes)
+    {
+      insert(std::span<const Hash>(hashes));
     }
 
     /// @brief Inserts multiple hashes into the tree
     /// @param hashes List of hashes to insert
     void insert(const std::list<Hash>& hashes)
     {
-      for (auto hash : hashes)
+      for (const auto& hash : hashes)
       {
-        insert(hash);
+        insert(hash.bytes);
       }
     }
 
@@ -867,6 +1821,14 @@ namespace merkle
         return;
       }
 
+      reclaim();
+      if (shared())
+      {
+        // Copies replace the full subtrees that marks refer to.
+        invalidate_marks();
+        unshare_path(index);
+      }
+
       walk_to(index, false, [this](Node*& n, bool go_right) {
         if (go_right && n->left)
         {
@@ -878,14 +1840,24 @@ namespace merkle
           {
             hash(n->left);
           }
-          delete (n->left->left);
-          n->left->left = nullptr;
-          delete (n->left->right);
-          n->left->right = nullptr;
+          conflate(n->left);
         }
         return true;
       });
 
+      // Frozen blocks are released once all of their leaves are flushed.
+      while (!frozen_blocks.empty())
+      {
+        auto first = frozen_blocks.begin();
+        const size_t num_block_leaves = size_t{1}
+          << (first->second.height - 1);
+        if (first->first + num_block_leaves > index)
+        {
+          break;
+        }
+        retire_block(first);
+      }
+
       size_t num_newly_flushed = index - num_flushed;
       leaf_nodes.erase(
         leaf_nodes.begin(), leaf_nodes.begin() + num_newly_flushed);
@@ -916,12 +1888,27 @@ namespace merkle
         size_t over = index - (num_flushed + leaf_nodes.size()) + 1;
         while (uninserted_leaf_nodes.size() > over)
         {
-          delete (uninserted_leaf_nodes.back());
+          Node::free(node_allocator, uninserted_leaf_nodes.back());
           uninserted_leaf_nodes.pop_back();
         }
         return;
       }
 
+      // Computing the root may freeze subtrees automatically.
+      compute_root();
+      if (index < max_frozen_index())
+      {
+        throw std::runtime_error("cannot retract frozen leaves");
+      }
+
+      // Retraction moves and frees full subtrees that marks refer to.
+      invalidate_marks();
+      reclaim();
+      if (shared())
+      {
+        unshare_path(index);
+      }
+
       Node* new_leaf_node =
         walk_to(index, true, [this](Node*& n, bool go_right) {
           bool go_left = !go_right;
@@ -935,13 +1922,12 @@ namespace merkle
             bool is_root = n == _root;
 
             Node* old_left = n->left;
-            delete (n->right);
+            retire(n->right, true);
             n->right = nullptr;
 
             *n = *old_left;
 
-            old_left->left = old_left->right = nullptr;
-            delete (old_left);
+            retire(old_left, false);
             old_left = nullptr;
 
             if (n->left && n->right)
@@ -969,7 +1955,10 @@ namespace merkle
         });
 
       // The leaf is now elsewhere, save the pointer.
-      leaf_nodes.at(index - num_flushed) = new_leaf_node;
+      if (!new_leaf_node->frozen)
+      {
+        leaf_nodes.at(index - num_flushed) = new_leaf_node;
+      }
 
       size_t num_retracted = num_leaves() - index - 1;
       if (num_retracted < leaf_nodes.size())
@@ -984,6 +1973,197 @@ namespace merkle
       assert(num_leaves() == index + 1);
     }
 
+    /// @brief A checkpoint of a tree to roll back to; see mark()
+    /// @note A mark refers to the full subtrees along the right edge of the
+    /// tree, which appending leaves does not change.
+    class Mark
+    {
+    public:
+      /// @brief The number of leaves of the tree at the time of the mark
+      [[nodiscard]] size_t num_leaves() const
+      {
+        return _num_leaves;
+      }
+
+    protected:
+      friend class TreeT;
+
+      /// @brief The number of leaves
+      size_t _num_leaves = 0;
+
+      /// @brief The structure of the tree at the time of the mark; see
+      /// TreeT::structure
+      uint64_t structure = 0;
+
+      /// @brief The sequence number of the mark among the marks and rollbacks
+      /// of the tree
+      uint64_t sequence = 0;
+
+      /// @brief The full subtrees along the right edge of the tree
+      std::vector<Node*> peaks;
+    };
+
+    /// @brief Marks the current state of the tree
+    /// @return A checkpoint to roll back to with rollback()
+    /// @note This inserts pending leaves into the tree without hashing them,
+    /// and then takes O(log n) time and memory.
+    Mark mark()
+    {
+      MERKLECPP_TRACE(MERKLECPP_TOUT << "> mark" << std::endl;);
+      insert_leaves(true);
+
+      Mark m;
+      m._num_leaves = num_leaves();
+      m.structure = structure;
+      m.sequence = ++sequence;
+      for (Node* n = _root; n != nullptr; n = n->right)
+      {
+        if (n->is_full())
+        {
+          m.peaks.push_back(n);
+          break;
+        }
+        m.peaks.push_back(n->left);
+      }
+      return m;
+    }
+
+    /// @brief Rolls the tree back to a mark
+    /// @param m The mark
+    /// @note This is equivalent to retracting the tree to the last leaf of the
+    /// mark, except that it can also roll back to an empty tree. If, since
+    /// the mark, the tree has only appended and flushed leaves and rolled
+    /// back to marks with at least as many leaves, this joins the full
+    /// subtrees of the mark into a new right edge and frees the nodes of the
+    /// discarded leaves, which takes time proportional to their number and
+    /// does not hash them. Otherwise, for instance after retract_to(), it
+    /// falls back to retract_to(). Rolling back makes marks with more leaves
+    /// fall back to retract_to() as well.
+    void rollback(const Mark& m)
+    {
+      MERKLECPP_TRACE(
+        MERKLECPP_TOUT << "> rollback " << m.num_leaves() << std::endl;);
+      statistics.num_rollback++;
+
+      const size_t num_kept = m.num_leaves();
+      if (num_kept >= num_leaves())
+      {
+        return;
+      }
+
+      if (num_kept < num_flushed || (num_kept == num_flushed && num_kept > 0))
+      {
+        throw std::runtime_error("leaf index out of bounds");
+      }
+
+      if (!frozen_blocks.empty() && num_kept <= max_frozen_index())
+      {
+        throw std::runtime_error("cannot retract frozen leaves");
+      }
+
+      if (num_kept > 0 && !is_current(m))
+      {
+        retract_to(num_kept - 1);
+        return;
+      }
+
+      sync_background();
+      reclaim();
+      for (Node* leaf : uninserted_leaf_nodes)
+      {
+        Node::free(node_allocator, leaf);
+      }
+      uninserted_leaf_nodes.clear();
+      if (!insertion_stack.empty())
+      {
+        _root = process_insertion_stack();
+      }
+
+      // Leaves that were not inserted yet are gone already.
+      if (num_flushed + leaf_nodes.size() > num_kept)
+      {
+        // The nodes with leaves on both sides of the mark form a path from the
+        // root, and the full subtrees of the mark are their left children
+        // before the mark.
+        Node* n = _root;
+        size_t first = 0;
+        [[maybe_unused]] size_t num_peaks = 0;
+        while (first < num_kept)
+        {
+          Node* left = n->left;
+          Node* right = n->right;
+          retire(n, false);
+          const size_t num_left_leaves = (left->size + 1) / 2;
+          if (first + num_left_leaves <= num_kept)
+          {
+            assert(left == m.peaks.at(num_peaks++));
+            first += num_left_leaves;
+            n = right;
+          }
+          else
+          {
+            retire(right, true);
+            n = left;
+          }
+        }
+        retire(n, true);
+
+        Node* root = nullptr;
+        for (auto it = m.peaks.rbegin(); it != m.peaks.rend(); it++)
+        {
+          root = root == nullptr ? *it : Node::make(node_allocator, *it, root);
+        }
+        _root = root;
+      }
+      leaf_nodes.resize(num_kept - num_flushed);
+
+      // Marks with more leaves refer to subtrees that are gone now. Marks of
+      // flushed leaves cannot be rolled back to, so only the last rollback to
+      // flushed leaves matters for the others.
+      while (!rollbacks.empty() && rollbacks.back().second >= num_kept)
+      {
+        rollbacks.pop_back();
+      }
+      auto flushed = std::upper_bound(
+        rollbacks.begin(),
+        rollbacks.end(),
+        num_flushed,
+        [](size_t num, const auto& r) { return num < r.second; });
+      if (flushed - rollbacks.begin() > 1)
+      {
+        rollbacks.erase(rollbacks.begin(), flushed - 1);
+      }
+      rollbacks.emplace_back(++sequence, num_kept);
+    }
+
+    /// @brief Freezes the tree up to some leaf
+    /// @param index Leaf index to freeze the tree to
+    /// @note This moves the hashes of the full subtrees of leaves smaller than
+    /// @p index into frozen blocks, contiguous arrays in which path(),
+    /// past_path() and subtree_root() find hashes by their position instead
+    /// of following pointers. A frozen block takes about half the memory of
+    /// the nodes it replaces. Frozen leaves cannot be retracted anymore, so
+    /// retract_to() throws for all indices smaller than the greatest frozen
+    /// leaf index.
+    void freeze_to(size_t index)
+    {
+      MERKLECPP_TRACE(MERKLECPP_TOUT << "> freeze_to " << index << std::endl;);
+      statistics.num_freeze++;
+
+      if (index > num_leaves())
+      {
+        throw std::runtime_error("invalid leaf index");
+      }
+
+      if (index <= min_index())
+      {
+        return;
+      }
+
+      compute_root();
+      freeze_subtrees(index, min_frozen_height);
+    }
+
     /// @brief Assigns a tree
     /// @param other The tree to assign
     /// @return The tree
@@ -993,10 +2173,24 @@ namespace merkle
       {
         return *this;
       }
+      check_no_snapshots();
       clear();
+      other.sync_background();
 
+      // Flushed leaves may remain in memory as siblings of the first leaf or
+      // in the frozen block of the first leaf; copy_node() skips them.
       size_t to_skip = (other.num_flushed % 2 == 0) ? 0 : 1;
+      if (other.num_flushed > 0)
+      {
+        auto block = other.frozen_block(other.num_flushed);
+        if (block != other.frozen_blocks.end())
+        {
+          to_skip = other.num_flushed - block->first;
+        }
+      }
+      frozen_blocks = other.frozen_blocks;
       _root = Node::copy_node(
+        node_allocator,
         other._root,
         &leaf_nodes,
         &to_skip,
@@ -1004,9 +2198,11 @@ namespace merkle
         other.max_index());
       for (auto n : other.uninserted_leaf_nodes)
       {
-        uninserted_leaf_nodes.push_back(Node::copy_node(n));
+        uninserted_leaf_nodes.push_back(Node::copy_node(node_allocator, n));
       }
       num_flushed = other.num_flushed;
+      parallel_hashing = other.parallel_hashing;
+      freezing = other.freezing;
       assert(min_index() == other.min_index());
       assert(max_index() == other.max_index());
       return *this;
@@ -1015,13 +2211,21 @@ namespace merkle
     /// @brief Assigns a tree by move
     /// @param other The tree to assign
     /// @return The tree
-    Tree& operator=(Tree&& other) noexcept
+    /// @note This throws if either tree has live snapshots, including a
+    /// published version, or if this tree has readers.
+    Tree& operator=(Tree&& other)
     {
       if (this == &other)
       {
         return *this;
       }
 
+      check_no_snapshots();
+      other.check_no_snapshots();
+      if (publication && publication->has_readers())
+      {
+        throw std::runtime_error("tree has readers");
+      }
       clear();
       move_from(other);
       return *this;
@@ -1065,7 +2269,7 @@ namespace merkle
       {
         if (e.direction == Path::Direction::PATH_LEFT)
         {
-          HASH_FUNCTION(e.hash, *result, *result);
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(e.hash, *result, *result);
         }
       }
 
@@ -1078,7 +2282,8 @@ namespace merkle
     /// subtree size) while walking
     /// @param f Function to call for each node on the path; the Boolean
     /// indicates whether the current step is a right or left turn.
-    /// @return The final leaf node in the walk
+    /// @return The final leaf node in the walk, or the frozen node holding
+    /// the leaf; see walk_frozen_block().
     Node* walk_to(
       size_t index, bool update, const std::function<bool(Node*&, bool)>&& f)
     {
@@ -1099,7 +2304,7 @@ namespace merkle
       }
       assert(walk_stack.empty());
 
-      for (uint8_t height = _root->height; height > 1;)
+      for (uint8_t height = _root->height; height > 1 && !cur->frozen;)
       {
         assert(cur->invariant());
         bool go_right = ((it >> (8 * sizeof(it) - 1)) & 0x01) != 0U;
@@ -1137,6 +2342,26 @@ namespace merkle
       return cur;
     }
 
+    /// @brief Walks along the path from a frozen node to a leaf in its frozen
+    /// block
+    /// @param index The leaf index to walk to
+    /// @param f Function to call for each position on the path with the hash
+    /// of the sibling of the next position; the Boolean indicates whether the
+    /// current step is a right or left turn.
+    void walk_frozen_block(
+      size_t index, const std::function<void(const Hash&, bool)>&& f) const
+    {
+      const auto& [first, block] = *frozen_block(index);
+      const size_t offset = index - first;
+      size_t position = 1;
+      for (size_t shift = block.height - 1; shift > 0; shift--)
+      {
+        const bool go_right = ((offset >> (shift - 1)) & 0x01) != 0U;
+        position = 2 * position + (go_right ? 1 : 0);
+        f(block.hash(position ^ 1), go_right);
+      }
+    }
+
     /// @brief Extracts the path from a leaf index to the root of the tree
     /// @param index The leaf index of the path to extract
     /// @return The path
@@ -1146,7 +2371,7 @@ namespace merkle
       statistics.num_paths++;
       std::list<typename Path::Element> elements;
 
-      walk_to(index, false, [&elements](Node* n, bool go_right) {
+      Node* last = walk_to(index, false, [&elements](Node* n, bool go_right) {
         typename Path::Element e;
         e.hash = go_right ? n->left->hash : n->right->hash;
         e.direction = go_right ? Path::PATH_LEFT : Path::PATH_RIGHT;
@@ -1154,8 +2379,18 @@ namespace merkle
         return true;
       });
 
+      if (last->frozen)
+      {
+        walk_frozen_block(index, [&elements](const Hash& h, bool go_right) {
+          typename Path::Element e;
+          e.hash = h;
+          e.direction = go_right ? Path::PATH_LEFT : Path::PATH_RIGHT;
+          elements.push_front(std::move(e));
+        });
+      }
+
       return std::make_shared<Path>(
-        leaf_node(index)->hash, index, std::move(elements), max_index());
+        leaf(index), index, std::move(elements), max_index());
     }
 
     /// @brief Extracts a past path from a leaf index to the root of the tree
@@ -1190,10 +2425,10 @@ namespace merkle
       std::list<typename Path::Element> root_to_fork;
       std::list<typename Path::Element> fork_to_index;
       std::list<typename Path::Element> fork_to_as_of;
-      Node* fork_node = nullptr;
+      std::optional<Cursor> fork_node;
 
-      Node* cur_i = _root;
-      Node* cur_a = _root;
+      Cursor cur_i = cursor(_root, index);
+      Cursor cur_a = cur_i;
       size_t it_i = 0;
       size_t it_a = 0;
       if (_root->height > 1)
@@ -1204,18 +2439,18 @@ namespace merkle
 
       for (uint8_t height = _root->height; height > 1;)
       {
-        assert(cur_i->invariant() && cur_a->invariant());
+        assert(cur_i.block || cur_i.node->invariant());
+        assert(cur_a.block || cur_a.node->invariant());
         bool const go_right_i = ((it_i >> (8 * sizeof(it_i) - 1)) & 0x01) != 0U;
         bool const go_right_a = ((it_a >> (8 * sizeof(it_a) - 1)) & 0x01) != 0U;
 
         MERKLECPP_TRACE(
           MERKLECPP_TOUT << " - at " << (unsigned)height << ": "
-                         << cur_i->hash.to_string(TRACE_HASH_SIZE) << " ("
-                         << cur_i->size << "/" << (unsigned)cur_i->height << "/"
+                         << cur_i.hash().to_string(TRACE_HASH_SIZE) << " ("
+                         << (unsigned)cur_i.height() << "/"
                          << (go_right_i ? "R" : "L") << ")"
-                         << " / " << cur_a->hash.to_string(TRACE_HASH_SIZE)
-                         << " (" << cur_a->size << "/"
-                         << (unsigned)cur_a->height << "/"
+                         << " / " << cur_a.hash().to_string(TRACE_HASH_SIZE)
+                         << " (" << (unsigned)cur_a.height() << "/"
                          << (go_right_a ? "R" : "L") << ")" << std::endl;);
 
         if (!fork_node && go_right_i != go_right_a)
@@ -1224,7 +2459,7 @@ namespace merkle
           assert(!go_right_i && go_right_a);
           MERKLECPP_TRACE(
             MERKLECPP_TOUT << " - split at "
-                           << cur_i->hash.to_string(TRACE_HASH_SIZE)
+                           << cur_i.hash().to_string(TRACE_HASH_SIZE)
                            << std::endl;);
           fork_node = cur_i;
         }
@@ -1233,30 +2468,30 @@ namespace merkle
         {
           // Still on the path to the fork
           assert(cur_i == cur_a);
-          if (cur_i->height == height)
+          if (cur_i.height() == height)
           {
             if (go_right_i)
             {
               typename Path::Element e;
-              e.hash = go_right_i ? cur_i->left->hash : cur_i->right->hash;
+              e.hash = cur_i.child_hash(!go_right_i);
               e.direction = go_right_i ? Path::PATH_LEFT : Path::PATH_RIGHT;
               root_to_fork.push_back(std::move(e));
             }
-            cur_i = cur_a = (go_right_i ? cur_i->right : cur_i->left);
+            cur_i = cur_a = child(cur_i, go_right_i, index);
           }
         }
         else
         {
           // After the fork, record paths to `index` and `as_of`.
-          if (cur_i->height == height)
+          if (cur_i.height() == height)
           {
             typename Path::Element e;
-            e.hash = go_right_i ? cur_i->left->hash : cur_i->right->hash;
+            e.hash = cur_i.child_hash(!go_right_i);
             e.direction = go_right_i ? Path::PATH_LEFT : Path::PATH_RIGHT;
             fork_to_index.push_back(std::move(e));
-            cur_i = (go_right_i ? cur_i->right : cur_i->left);
+            cur_i = child(cur_i, go_right_i, index);
           }
-          if (cur_a->height == height)
+          if (cur_a.height() == height)
           {
             // The right path does not take into account anything to the right
             // of `as_of`, as those nodes were inserted into the tree after
@@ -1264,11 +2499,11 @@ namespace merkle
             if (go_right_a)
             {
               typename Path::Element e;
-              e.hash = go_right_a ? cur_a->left->hash : cur_a->right->hash;
+              e.hash = cur_a.child_hash(!go_right_a);
               e.direction = go_right_a ? Path::PATH_LEFT : Path::PATH_RIGHT;
               fork_to_as_of.push_back(std::move(e));
             }
-            cur_a = (go_right_a ? cur_a->right : cur_a->left);
+            cur_a = child(cur_a, go_right_a, as_of);
           }
         }
 
@@ -1313,14 +2548,15 @@ namespace merkle
         // The final hash of the path from the fork to `as_of` needs to be
         // computed because that path skipped past tree nodes younger than
         // `as_of`.
-        Hash as_of_hash = cur_a->hash;
+        Hash as_of_hash = cur_a.hash();
         if (!fork_to_as_of.empty())
         {
           fork_to_as_of.pop_front();
         }
         for (auto it = fork_to_as_of.rbegin(); it != fork_to_as_of.rend(); it++)
         {
-          HASH_FUNCTION(it->hash, as_of_hash, as_of_hash);
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(
+            it->hash, as_of_hash, as_of_hash);
         }
 
         MERKLECPP_TRACE({
@@ -1341,8 +2577,7 @@ namespace merkle
         path.push_back(std::move(*it));
       }
 
-      return std::make_shared<Path>(
-        leaf_node(index)->hash, index, std::move(path), as_of);
+      return std::make_shared<Path>(leaf(index), index, std::move(path), as_of);
     }
 
     /// @brief Extracts the root hash of a complete subtree resident in memory
@@ -1394,6 +2629,14 @@ namespace merkle
       size_t it = lo << (sizeof(lo) * 8 - _root->height + 1);
       for (uint8_t height = _root->height; height > target_height;)
       {
+        if (cur->frozen)
+        {
+          // Full subtrees inside a frozen block are at known positions.
+          const auto& [first, block] = *frozen_block(lo);
+          const size_t offset = (lo - first) >> level;
+          return block.hash(
+            (size_t{1} << (block.height - target_height)) + offset);
+        }
         const bool go_right = ((it >> (8 * sizeof(it) - 1)) & 0x01) != 0U;
         if (cur->height == height)
         {
@@ -1419,18 +2662,606 @@ namespace merkle
       return cur->hash;
     }
 
-    /// @brief Serialises the tree
-    /// @param bytes The vector of bytes to serialise to
-    void serialise(std::vector<uint8_t>& bytes)
+    /// @brief A read-only view of a tree at the time it was taken; see
+    /// snapshot()
+    /// @note A snapshot refers to the full subtrees along the right edge of
+    /// the tree, which insertion does not change, and computes the hashes
+    /// above them on demand. It can be read on other threads while the tree
+    /// keeps inserting leaves; hashes that frozen blocks do not keep are
+    /// recomputed without caching them in the blocks. Snapshots must not
+    /// outlive their tree.
+    class Snapshot
     {
-      MERKLECPP_TRACE(MERKLECPP_TOUT << "> serialise " << std::endl;);
-
+    public:
+      /// @brief The root hash of the tree at the time of the snapshot
+      [[nodiscard]] const Hash& root() const
+      {
+        return _root;
+      }
+
+      /// @brief Extracts a past root hash
+      /// @param index The last leaf index to consider
+      /// @return The root hash of the tree when @p index was its last leaf
+      [[nodiscard]] std::shared_ptr<Hash> past_root(size_t index) const
+      {
+        if (index < min_index() || max_index() < index)
+        {
+          throw std::runtime_error("invalid leaf index");
+        }
+        return std::make_shared<Hash>(range_hash(0, index + 1));
+      }
+
+      /// @brief Extracts the path from a leaf index to the root
+      /// @param index The leaf index of the path to extract
+      /// @return The path
+      [[nodiscard]] std::shared_ptr<Path> path(size_t index) const
+      {
+        if (index < min_index() || max_index() < index)
+        {
+          throw std::runtime_error("invalid leaf index");
+        }
+        return past_path(index, max_index());
+      }
+
+      /// @brief Extracts a past path from a leaf index to the root
+      /// @param index The leaf index of the path to extract
+      /// @param as_of The maximum leaf index to consider
+      /// @return The path in the tree when @p as_of was its last leaf
+      [[nodiscard]] std::shared_ptr<Path> past_path(
+        size_t index, size_t as_of) const
+      {
+        if (index < min_index() || index > as_of || max_index() < as_of)
+        {
+          throw std::runtime_error("invalid leaf indices");
+        }
+
+        // Split the leaves like the tree does, into a full left subtree and
+        // the rest, toward `index`.
+        std::list<typename Path::Element> elements;
+        size_t first = 0;
+        size_t n = as_of + 1;
+        while (n > 1)
+        {
+          const size_t k = std::bit_floor(n - 1);
+          typename Path::Element e;
+          if (index < first + k)
+          {
+            e.hash = range_hash(first + k, n - k);
+            e.direction = Path::PATH_RIGHT;
+            n = k;
+          }
+          else
+          {
+            e.hash = subtree_hash(first, k);
+            e.direction = Path::PATH_LEFT;
+            first += k;
+            n -= k;
+          }
+          elements.push_front(std::move(e));
+        }
+
+        return std::make_shared<Path>(
+          leaf(index), index, std::move(elements), as_of);
+      }
+
+      /// @brief Extracts a leaf hash
+      /// @param index Leaf index of the leaf to extract
+      /// @return The leaf hash
+      [[nodiscard]] Hash leaf(size_t index) const
+      {
+        if (index < min_index() || max_index() < index)
+        {
+          throw std::runtime_error("leaf index out of bounds");
+        }
+        return subtree_hash(index, 1);
+      }
+
+      /// @brief Serialises the tree as it was at the time of the snapshot
+      /// @param bytes The vector of bytes to serialise to
+      /// @note The result deserialises into a tree like the one that
+      /// TreeT::serialise() would have produced.
+      void serialise(std::vector<uint8_t>& bytes) const
+      {
+        serialise_uint64_t(_num_leaves - num_flushed, bytes);
+        serialise_uint64_t(num_flushed, bytes);
+        for (const auto& [first, peak] : peaks)
+        {
+          serialise_leaves(cursor(peak, first), first, bytes);
+        }
+
+        // Hashes of the flushed subtrees along the left edge
+        std::vector<Hash> extras;
+        size_t first = 0;
+        size_t n = _num_leaves;
+        while (n > 1)
+        {
+          const size_t k = std::bit_floor(n - 1);
+          if (num_flushed < first + k)
+          {
+            n = k;
+          }
+          else
+          {
+            extras.push_back(subtree_hash(first, k));
+            first += k;
+            n -= k;
+          }
+        }
+        for (size_t i = extras.size() - 1; i != SIZE_MAX; i--)
+        {
+          extras.at(i).serialise(bytes);
+        }
+      }
+
+      /// @brief Operator to serialise the tree
+      operator std::vector<uint8_t>() const
+      {
+        std::vector<uint8_t> bytes;
+        serialise(bytes);
+        return bytes;
+      }
+
+      /// @brief Number of leaves, including flushed leaves
+      [[nodiscard]] size_t num_leaves() const
+      {
+        return _num_leaves;
+      }
+
+      /// @brief Minimum leaf index
+      [[nodiscard]] size_t min_index() const
+      {
+        return num_flushed;
+      }
+
+      /// @brief Maximum leaf index
+      [[nodiscard]] size_t max_index() const
+      {
+        return _num_leaves - 1;
+      }
+
+    protected:
+      friend class TreeT;
+
+      Snapshot() = default;
+
+      /// @brief The hash of a full subtree
+      /// @param first The first leaf index of the subtree
+      /// @param n The number of leaves of the subtree, a power of two
+      Hash subtree_hash(size_t first, size_t n) const
+      {
+        auto it = std::upper_bound(
+          peaks.begin(), peaks.end(), first, [](size_t i, const auto& p) {
+            return i < p.first;
+          });
+        assert(it != peaks.begin());
+        const auto& [peak_first, peak] = *std::prev(it);
+
+        Cursor c = cursor(peak, first);
+        while ((size_t{1} << (c.height() - 1)) > n)
+        {
+          if (!c.block && !c.node->left)
+          {
+            throw std::runtime_error("subtree was flushed");
+          }
+          const size_t half = size_t{1} << (c.height() - 2);
+          const bool right = ((first - peak_first) & half) != 0;
+          c = child(c, right, first);
+        }
+        return c.hash(false);
+      }
+
+      /// @brief The root hash of a range of leaves, as if they formed a tree
+      /// @param first The first leaf index of the range, a multiple of the
+      /// greatest power of two not greater than @p n
+      /// @param n The number of leaves in the range
+      Hash range_hash(size_t first, size_t n) const
+      {
+        if (std::has_single_bit(n))
+        {
+          return subtree_hash(first, n);
+        }
+        const size_t k = std::bit_floor(n);
+        Hash result = range_hash(first + k, n - k);
+        detail::hash_node<HASH_SIZE, HASH_FUNCTION>(
+          subtree_hash(first, k), result, result);
+        return result;
+      }
+
+      /// @brief Serialises the unflushed leaves under a cursor
+      /// @param c The cursor
+      /// @param first The first leaf index under @p c
+      /// @param bytes The vector of bytes to serialise to
+      void serialise_leaves(
+        Cursor c, size_t first, std::vector<uint8_t>& bytes) const
+      {
+        const size_t size = size_t{1} << (c.height() - 1);
+        if (first + size <= num_flushed)
+        {
+          return;
+        }
+        if (c.height() == 1)
+        {
+          c.hash().serialise(bytes);
+          return;
+        }
+        serialise_leaves(child(c, false, first), first, bytes);
+        serialise_leaves(
+          child(c, true, first + size / 2), first + size / 2, bytes);
+      }
+
+      /// @brief Creates a cursor for a tree node
+      /// @param n The tree node
+      /// @param index A leaf index under @p n, to find its frozen block
+      /// @note Like TreeT::cursor(), but with the frozen blocks of the
+      /// snapshot, because the tree may add and drop blocks meanwhile.
+      Cursor cursor(const Node* n, size_t index) const
+      {
+        Cursor c;
+        c.node = n;
+        if (n->frozen)
+        {
+          auto it = std::upper_bound(
+            blocks.begin(), blocks.end(), index, [](size_t i, const auto& b) {
+              return i < b.first;
+            });
+          assert(it != blocks.begin());
+          c.block = std::prev(it)->second;
+          c.position = 1;
+        }
+        return c;
+      }
+
+      /// @brief Moves a cursor to one of its children
+      /// @param c The cursor
+      /// @param right Indicates whether to move to the right child
+      /// @param index A leaf index under the child, to find its frozen block
+      Cursor child(Cursor c, bool right, size_t index) const
+      {
+        if (c.block)
+        {
+          c.position = 2 * c.position + (right ? 1 : 0);
+          return c;
+        }
+        return cursor(right ? c.node->right : c.node->left, index);
+      }
+
+      /// @brief The epoch in which the snapshot was taken
+      EpochRef epoch;
+
+      /// @brief The frozen blocks of the tree, by the index of their first
+      /// leaf
+      std::vector<std::pair<size_t, const FrozenBlock*>> blocks;
+
+      /// @brief The full subtrees along the right edge of the tree, by the
+      /// index of their first leaf
+      std::vector<std::pair<size_t, const Node*>> peaks;
+
+      /// @brief The root hash
+      Hash _root;
+
+      /// @brief The number of leaves
+      size_t _num_leaves = 0;
+
+      /// @brief The number of flushed leaves
+      size_t num_flushed = 0;
+    };
+
+    /// @brief Takes a snapshot of the tree
+    /// @return A read-only view of the tree in its current state
+    /// @note This computes the root and then takes O(log n) time and memory,
+    /// plus one pointer per frozen block; no nodes are copied. While snapshots
+    /// are alive, flush_to(), retract_to() and freezing copy the nodes they
+    /// change instead of changing them in place, and nodes and frozen blocks
+    /// that the tree drops are only freed once the snapshots that may refer
+    /// to them are gone. Assignment, deserialisation and moving the tree
+    /// throw.
+    Snapshot snapshot()
+    {
+      MERKLECPP_TRACE(MERKLECPP_TOUT << "> snapshot" << std::endl;);
+      compute_root();
+      reclaim();
+      if (
+        epochs.empty() || !epochs.back().retired.empty() ||
+        !epochs.back().retired_blocks.empty())
+      {
+        epochs.emplace_back();
+      }
+
+      Snapshot s;
+      s.epoch = EpochRef(&epochs.back());
+      s.blocks.reserve(frozen_blocks.size());
+      for (const auto& [first, block] : frozen_blocks)
+      {
+        s.blocks.emplace_back(first, &block);
+      }
+      const Node* n = _root;
+      size_t first = 0;
+      while (!n->is_full())
+      {
+        s.peaks.emplace_back(first, n->left);
+        first += (n->left->size + 1) / 2;
+        n = n->right;
+      }
+      s.peaks.emplace_back(first, n);
+      s._root = _root->hash;
+      s._num_leaves = num_leaves();
+      s.num_flushed = num_flushed;
+      return s;
+    }
+
+    /// @brief The number of live snapshots of the tree; see snapshot()
+    [[nodiscard]] size_t num_snapshots() const
+    {
+      size_t n = 0;
+      for (const auto& e : epochs)
+      {
+        n += e.num_snapshots.load(std::memory_order_acquire);
+      }
+      return n;
+    }
+
+  protected:
+    /// @brief The published version of a tree and the epochs of its readers
+    /// @note A reader announces the global epoch before it loads the version
+    /// and clears it afterwards. A version replaced at some epoch is deleted
+    /// once every reader has either cleared its epoch or announced a later
+    /// one, because those readers load newer versions.
+    struct Publication
+    {
+      /// @brief The epoch of a reader
+      struct Slot
+      {
+        /// @brief The global epoch when the current call of the reader
+        /// started, or 0 between calls
+        alignas(64) std::atomic<uint64_t> epoch = 0;
+
+        /// @brief Indicates whether a reader holds the slot; guarded by
+        /// the mutex of the publication
+        bool in_use = true;
+      };
+
+      Publication() = default;
+      Publication(const Publication&) = delete;
+      Publication& operator=(const Publication&) = delete;
+
+      ~Publication()
+      {
+        delete current.load();
+      }
+
+      /// @brief Finds a slot for a new reader
+      Slot& acquire_slot()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& slot : slots)
+        {
+          if (!slot.in_use)
+          {
+            slot.in_use = true;
+            return slot;
+          }
+        }
+        return slots.emplace_back();
+      }
+
+      /// @brief Indicates whether any reader holds a slot
+      bool has_readers()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::any_of(slots.begin(), slots.end(), [](const Slot& slot) {
+          return slot.in_use;
+        });
+      }
+
+      /// @brief Retires a version that is no longer published
+      /// @param version The version, or nullptr
+      void retire(const Snapshot* version)
+      {
+        if (version != nullptr)
+        {
+          retired.emplace_back(epoch.fetch_add(1), version);
+        }
+      }
+
+      /// @brief Deletes the retired versions that no reader can be reading
+      void reclaim()
+      {
+        if (retired.empty())
+        {
+          return;
+        }
+        uint64_t min_epoch = std::numeric_limits<uint64_t>::max();
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          for (const auto& slot : slots)
+          {
+            const uint64_t e = slot.epoch.load();
+            if (e != 0)
+            {
+              min_epoch = std::min(min_epoch, e);
+            }
+          }
+        }
+        while (!retired.empty() && retired.front().first < min_epoch)
+        {
+          retired.pop_front();
+        }
+      }
+
+      /// @brief The global epoch
+      std::atomic<uint64_t> epoch = 1;
+
+      /// @brief The published version, or nullptr
+      std::atomic<const Snapshot*> current = nullptr;
+
+      /// @brief The mutex guarding the list of slots
+      std::mutex mutex;
+
+      /// @brief The epoch slots of the readers
+      std::deque<Slot> slots;
+
+      /// @brief Retired versions by the epoch at which they were replaced
+      std::deque<std::pair<uint64_t, std::unique_ptr<const Snapshot>>>
+        retired;
+    };
+
+  public:
+
+    /// @brief A handle for reading the published version of a tree, on a
+    /// thread other than the one that changes the tree; see publish()
+    /// @note Each call reads whichever version is published when it starts,
+    /// without taking locks; use snapshot() to make several calls against the
+    /// same version. A reader is used by one thread at a time and must not
+    /// outlive its tree.
+    class Reader
+    {
+    public:
+      Reader(const Reader&) = delete;
+      Reader& operator=(const Reader&) = delete;
+
+      /// @brief Moves a reader
+      /// @param other The reader to move
+      Reader(Reader&& other) noexcept :
+        publication(std::exchange(other.publication, nullptr)),
+        slot(std::exchange(other.slot, nullptr))
+      {}
+
+      /// @brief Deconstructor
+      ~Reader()
+      {
+        if (slot)
+        {
+          std::lock_guard<std::mutex> lock(publication->mutex);
+          slot->in_use = false;
+        }
+      }
+
+      /// @brief The root hash of the published version
+      [[nodiscard]] Hash root() const
+      {
+        return read([](const Snapshot& s) { return s.root(); });
+      }
+
+      /// @brief Extracts a past root hash from the published version
+      /// @param index The last leaf index to consider
+      [[nodiscard]] std::shared_ptr<Hash> past_root(size_t index) const
+      {
+        return read([index](const Snapshot& s) { return s.past_root(index); });
+      }
+
+      /// @brief Extracts a path from the published version
+      /// @param index The leaf index of the path to extract
+      [[nodiscard]] std::shared_ptr<Path> path(size_t index) const
+      {
+        return read([index](const Snapshot& s) { return s.path(index); });
+      }
+
+      /// @brief Extracts a past path from the published version
+      /// @param index The leaf index of the path to extract
+      /// @param as_of The maximum leaf index to consider
+      [[nodiscard]] std::shared_ptr<Path> past_path(
+        size_t index, size_t as_of) const
+      {
+        return read([index, as_of](const Snapshot& s) {
+          return s.past_path(index, as_of);
+        });
+      }
+
+      /// @brief Copies the published version
+      [[nodiscard]] Snapshot snapshot() const
+      {
+        return read([](const Snapshot& s) { return s; });
+      }
+
+    protected:
+      friend class TreeT;
+
+      Reader(Publication* publication, typename Publication::Slot* slot) :
+        publication(publication),
+        slot(slot)
+      {}
+
+      /// @brief Calls a function with the published version
+      /// @param f The function
+      template <typename F>
+      auto read(const F& f) const
+      {
+        // The epoch announced before loading the version keeps the writer
+        // from deleting it; see Publication::reclaim().
+        slot->epoch.store(publication->epoch.load());
+        struct Leave
+        {
+          typename Publication::Slot* slot;
+          ~Leave()
+          {
+            slot->epoch.store(0, std::memory_order_release);
+          }
+        } leave{slot};
+        const Snapshot* version = publication->current.load();
+        if (version == nullptr)
+        {
+          throw std::runtime_error("tree has no published version");
+        }
+        return f(*version);
+      }
+
+      /// @brief The publication of the tree
+      Publication* publication = nullptr;
+
+      /// @brief The epoch slot of the reader
+      typename Publication::Slot* slot = nullptr;
+    };
+
+    /// @brief Publishes a snapshot of the tree to its readers; see reader()
+    /// @note Versions that readers stopped reading, and the nodes that only
+    /// they referred to, are freed by later calls to publish(), snapshot(),
+    /// flush_to() or retract_to().
+    void publish()
+    {
+      auto version = std::make_unique<const Snapshot>(snapshot());
+      if (!publication)
+      {
+        publication = std::make_unique<Publication>();
+      }
+      publication->retire(publication->current.exchange(version.release()));
+      reclaim();
+    }
+
+    /// @brief Withdraws the published version, so that operations that do
+    /// not work with live snapshots, such as assignment, work again once
+    /// readers are done with it
+    void unpublish()
+    {
+      if (publication)
+      {
+        publication->retire(publication->current.exchange(nullptr));
+        reclaim();
+      }
+    }
+
+    /// @brief Creates a handle for reading the published version of the tree
+    /// on another thread
+    Reader reader()
+    {
+      if (!publication)
+      {
+        publication = std::make_unique<Publication>();
+      }
+      return Reader(publication.get(), &publication->acquire_slot());
+    }
+
+    /// @brief Serialises the tree
+    /// @param bytes The vector of bytes to serialise to
+    void serialise(std::vector<uint8_t>& bytes)
+    {
+      MERKLECPP_TRACE(MERKLECPP_TOUT << "> serialise " << std::endl;);
+
       serialise_uint64_t(
         leaf_nodes.size() + uninserted_leaf_nodes.size(), bytes);
       serialise_uint64_t(num_flushed, bytes);
-      for (auto& n : leaf_nodes)
+      for (size_t i = 0; i < leaf_nodes.size(); i++)
       {
-        n->hash.serialise(bytes);
+        leaf(num_flushed + i).serialise(bytes);
       }
       for (auto& n : uninserted_leaf_nodes)
       {
@@ -1446,18 +3277,29 @@ namespace merkle
         MERKLECPP_TRACE(
           MERKLECPP_TOUT << to_string(TRACE_HASH_SIZE) << std::endl;);
 
-        std::vector<Node*> extras;
-        walk_to(min_index(), false, [&extras](Node*& n, bool go_right) {
-          if (go_right)
-          {
-            extras.push_back(n->left);
-          }
-          return true;
-        });
+        std::vector<Hash> extras;
+        Node* last =
+          walk_to(min_index(), false, [&extras](Node*& n, bool go_right) {
+            if (go_right)
+            {
+              extras.push_back(n->left->hash);
+            }
+            return true;
+          });
+        if (last->frozen)
+        {
+          walk_frozen_block(
+            min_index(), [&extras](const Hash& h, bool go_right) {
+              if (go_right)
+              {
+                extras.push_back(h);
+              }
+            });
+        }
 
         for (size_t i = extras.size() - 1; i != SIZE_MAX; i--)
         {
-          extras.at(i)->hash.serialise(bytes);
+          extras.at(i).serialise(bytes);
         }
       }
     }
@@ -1490,18 +3332,29 @@ namespace merkle
         MERKLECPP_TRACE(
           MERKLECPP_TOUT << to_string(TRACE_HASH_SIZE) << std::endl;);
 
-        std::vector<Node*> extras;
-        walk_to(from, false, [&extras](Node*& n, bool go_right) {
-          if (go_right)
-          {
-            extras.push_back(n->left);
-          }
-          return true;
-        });
+        std::vector<Hash> extras;
+        Node* last =
+          walk_to(from, false, [&extras](Node*& n, bool go_right) {
+            if (go_right)
+            {
+              extras.push_back(n->left->hash);
+            }
+            return true;
+          });
+        if (last->frozen)
+        {
+          walk_frozen_block(
+            from, [&extras](const Hash& h, bool go_right) {
+              if (go_right)
+              {
+                extras.push_back(h);
+              }
+            });
+        }
 
         for (size_t i = extras.size() - 1; i != SIZE_MAX; i--)
         {
-          extras.at(i)->hash.serialise(bytes);
+          extras.at(i).serialise(bytes);
         }
       }
     }
@@ -1521,6 +3374,7 @@ namespace merkle
     {
       MERKLECPP_TRACE(MERKLECPP_TOUT << "> deserialise " << std::endl;);
 
+      check_no_snapshots();
       clear();
 
       size_t num_leaf_nodes = deserialise_uint64_t(bytes, position);
@@ -1529,7 +3383,7 @@ namespace merkle
       leaf_nodes.reserve(num_leaf_nodes);
       for (size_t i = 0; i < num_leaf_nodes; i++)
       {
-        Node* n = Node::make(bytes.data() + position);
+        Node* n = Node::make(node_allocator, bytes.data() + position);
         position += HASH_SIZE;
         leaf_nodes.push_back(n);
       }
@@ -1545,7 +3399,7 @@ namespace merkle
         {
           Hash h(bytes, position);
           MERKLECPP_TRACE(MERKLECPP_TOUT << "+";);
-          auto n = Node::make(h);
+          auto n = Node::make(node_allocator, h);
           n->height = level_no + 1;
           n->size = (1 << n->height) - 1;
           assert(n->invariant());
@@ -1566,7 +3420,8 @@ namespace merkle
           }
           else
           {
-            next_level.push_back(Node::make(level.at(i), level.at(i + 1)));
+            next_level.push_back(
+              Node::make(node_allocator, level.at(i), level.at(i + 1)));
           }
         }
 
@@ -1618,7 +3473,13 @@ namespace merkle
           .at(index - num_flushed - leaf_nodes.size())
           ->hash;
       }
-      return leaf_nodes.at(index - num_flushed)->hash;
+      const Node* n = leaf_nodes.at(index - num_flushed);
+      if (n == nullptr)
+      {
+        const auto& [first, block] = *frozen_block(index);
+        return block.at(block.leaf_position(index - first));
+      }
+      return n->hash;
     }
 
     /// @brief Number of leaves in the tree
@@ -1678,13 +3539,7 @@ namespace merkle
 
       if (!empty())
       {
-        walk_to(min_index(), false, [&num_extras](Node*&, bool go_right) {
-          if (go_right)
-          {
-            num_extras++;
-          }
-          return true;
-        });
+        num_extras = count_extras(min_index());
       }
 
       return sizeof(leaf_nodes.size()) + sizeof(num_flushed) +
@@ -1699,25 +3554,60 @@ namespace merkle
     {
       validate_partial_range(from, to);
 
-      size_t num_extras = 0;
-      walk_to(from, false, [&num_extras](Node*&, bool go_right) {
-        if (go_right)
-        {
-          num_extras++;
-        }
-        return true;
-      });
+      size_t num_extras = count_extras(from);
 
       return sizeof(leaf_nodes.size()) + sizeof(num_flushed) +
         (to - from + 1) * sizeof(Hash) + num_extras * sizeof(Hash);
     }
 
-    /// @brief Structure to hold statistical information
-    mutable struct Statistics
+    /// @brief Settings for parallel root computation
+    /// @note With more than one thread, computing the root after many
+    /// insertions hashes the dirty subtrees of height @p split_height or
+    /// lower on separate threads, and then the nodes above them on the
+    /// calling thread. The resulting hashes and statistics are the same as
+    /// with one thread.
+    struct ParallelHashing
     {
-      /// @brief The number of hashes taken by the tree via hash()
+      /// @brief The maximum number of threads, including the calling thread
+      size_t num_threads = 1;
+
+      /// @brief The height of the subtrees hashed by separate threads
+      uint8_t split_height = 16;
+    } parallel_hashing;
+
+    /// @brief Settings for frozen blocks; see freeze_to()
+    /// @note A @p stride above 1 makes new frozen blocks keep only the leaves,
+    /// the root and every stride-th level in between, which takes about
+    /// 1/(2**stride - 1) of the memory of the leaves, and recompute the other
+    /// hashes when paths need them, at a cost of up to 2**(stride-1) node
+    /// hashes each. With an @p automatic_height, root() and all other
+    /// operations that compute the root freeze the full subtrees of at least
+    /// that height as soon as they are complete, so that only leaf hashes and
+    /// the kept levels stay in memory for most of the tree.
+    struct Freezing
+    {
+      /// @brief The distance between the levels kept in frozen blocks, up to
+      /// 8
+      uint8_t stride = 1;
+
+      /// @brief The minimum height of subtrees to freeze automatically, or 0
+      /// to only freeze in freeze_to()
+      uint8_t automatic_height = 0;
+
+      /// @brief The number of recomputed hashes cached per frozen block
+      size_t cache_size = 64;
+    } freezing;
+
+    /// @brief Structure to hold statistical information
+    mutable struct Statistics
+    {
+      /// @brief The number of hashes taken by the tree via hash()
       size_t num_hash = 0;
 
+      /// @brief The number of hashes in @p num_hash taken by the background
+      /// thread; see start_background_hashing()
+      size_t num_background_hash = 0;
+
       /// @brief The number of insert() opertations performed on the tree
       size_t num_insert = 0;
 
@@ -1733,6 +3623,12 @@ namespace merkle
       /// @brief The number of retract_to() opertations performed on the tree
       size_t num_retract = 0;
 
+      /// @brief The number of rollback() opertations performed on the tree
+      size_t num_rollback = 0;
+
+      /// @brief The number of freeze_to() opertations performed on the tree
+      size_t num_freeze = 0;
+
       /// @brief The number of paths extracted from the tree via path()
       size_t num_paths = 0;
 
@@ -1745,8 +3641,10 @@ namespace merkle
       {
         std::stringstream stream;
         stream << "num_insert=" << num_insert << " num_hash=" << num_hash
+               << " num_background_hash=" << num_background_hash
                << " num_root=" << num_root << " num_retract=" << num_retract
-               << " num_flush=" << num_flush << " num_paths=" << num_paths
+               << " num_flush=" << num_flush << " num_rollback=" << num_rollback
+               << " num_freeze=" << num_freeze << " num_paths=" << num_paths
                << " num_past_paths=" << num_past_paths;
         return stream.str();
       }
@@ -1759,6 +3657,7 @@ namespace merkle
     /// @return A string representing the tree
     std::string to_string(size_t num_bytes = HASH_SIZE) const
     {
+      sync_background();
       static const std::string dirty_hash(2 * num_bytes, '?');
       std::stringstream stream;
       std::vector<Node*> level;
@@ -1811,6 +3710,197 @@ namespace merkle
     }
 
   protected:
+    /// @brief Throws if snapshots of the tree are alive
+    void check_no_snapshots() const
+    {
+      if (shared())
+      {
+        throw std::runtime_error("tree has live snapshots");
+      }
+    }
+
+    /// @brief Indicates whether snapshots may refer to nodes of the tree
+    bool shared() const
+    {
+      return num_snapshots() > 0;
+    }
+
+    /// @brief Frees a node that the tree no longer refers to, once no
+    /// snapshot can refer to it either
+    /// @param n The node
+    /// @param subtree Indicates whether to free the subtree under @p n too;
+    /// otherwise, its children belong to another node.
+    void retire(Node* n, bool subtree)
+    {
+      if (n == nullptr)
+      {
+        return;
+      }
+      if (shared())
+      {
+        epochs.back().retired.emplace_back(n, subtree);
+        return;
+      }
+      if (!subtree)
+      {
+        n->left = n->right = nullptr;
+      }
+      Node::free(node_allocator, n);
+    }
+
+    /// @brief Drops a frozen block, once no snapshot can look it up either
+    /// @param it The frozen block
+    void retire_block(typename std::map<size_t, FrozenBlock>::const_iterator it)
+    {
+      if (shared())
+      {
+        epochs.back().retired_blocks.push_back(frozen_blocks.extract(it));
+        return;
+      }
+      frozen_blocks.erase(it);
+    }
+
+    /// @brief Copies a full node that snapshots may refer to, so that its
+    /// children can be replaced
+    /// @param n The node
+    void unshare(Node*& n)
+    {
+      if (shared() && n->is_full())
+      {
+        Node* copy = Node::make(node_allocator, n->hash);
+        *copy = *n;
+        retire(n, false);
+        n = copy;
+      }
+    }
+
+    /// @brief Frees the retired nodes and frozen blocks of the epochs that
+    /// have no snapshots left
+    void reclaim()
+    {
+      if (publication)
+      {
+        publication->reclaim();
+      }
+      while (
+        !epochs.empty() &&
+        epochs.front().num_snapshots.load(std::memory_order_acquire) == 0)
+      {
+        for (auto [n, subtree] : epochs.front().retired)
+        {
+          if (!subtree)
+          {
+            n->left = n->right = nullptr;
+          }
+          Node::free(node_allocator, n);
+        }
+        epochs.pop_front();
+      }
+    }
+
+    /// @brief Copies the full nodes on the path to a leaf, which snapshots may
+    /// refer to, so that the path can be changed in place
+    /// @param index The leaf index
+    void unshare_path(size_t index)
+    {
+      compute_root();
+      Node** slot = &_root;
+      size_t it = 0;
+      if (_root->height > 1)
+      {
+        it = index << (sizeof(index) * 8 - _root->height + 1);
+      }
+      for (uint8_t height = _root->height; height > 1 && !(*slot)->frozen;)
+      {
+        Node*& n = *slot;
+        const bool go_right = ((it >> (8 * sizeof(it) - 1)) & 0x01) != 0U;
+        if (n->height == height)
+        {
+          unshare(n);
+          slot = go_right ? &n->right : &n->left;
+        }
+        it <<= 1;
+        height--;
+      }
+    }
+
+    /// @brief Replaces the subtree under a node by the node's hash
+    /// @param n The node
+    void conflate(Node*& n)
+    {
+      if (!n->left && !n->frozen)
+      {
+        return;
+      }
+      if (shared())
+      {
+        Node* copy = Node::make(node_allocator, n->hash);
+        copy->size = n->size;
+        copy->height = n->height;
+        retire(n, true);
+        n = copy;
+        return;
+      }
+      Node::free(node_allocator, n->left);
+      n->left = nullptr;
+      Node::free(node_allocator, n->right);
+      n->right = nullptr;
+      n->frozen = false;
+    }
+
+    /// @brief Waits for the background thread to hash the subtrees handed to
+    /// it, and takes over its statistics and errors
+    void sync_background() const
+    {
+      if (!background)
+      {
+        return;
+      }
+      background->wait();
+      const size_t num_hash = std::exchange(background->state.num_hash, 0);
+      statistics.num_hash += num_hash;
+      statistics.num_background_hash += num_hash;
+      if (auto error = std::exchange(background->error, nullptr))
+      {
+        std::rethrow_exception(error);
+      }
+    }
+
+    /// @brief Hands the full subtree that ends at the last leaf to the
+    /// background thread
+    /// @note Only called when the number of leaves is a multiple of the
+    /// subtree size, so that the right edge of the tree ends in such a
+    /// subtree.
+    void submit_background()
+    {
+      insert_leaves(true);
+      Node* n = _root;
+      const uint8_t height = background->height + 1;
+      while (n->height > height)
+      {
+        n = n->right;
+      }
+      assert(n->height == height && n->is_full());
+      if (n->dirty)
+      {
+        background->submit(n);
+      }
+    }
+
+    /// @brief Makes room for more uninserted leaves
+    /// @param n The number of leaves about to be inserted
+    /// @note Grows geometrically, so that many small bulk insertions do not
+    /// reallocate every time.
+    void reserve_uninserted(size_t n)
+    {
+      const size_t needed = uninserted_leaf_nodes.size() + n;
+      if (needed > uninserted_leaf_nodes.capacity())
+      {
+        uninserted_leaf_nodes.reserve(
+          std::max(needed, 2 * uninserted_leaf_nodes.capacity()));
+      }
+    }
+
     void validate_partial_range(size_t from, size_t to) const
     {
       if (empty() || !(min_index() <= from && from <= to && to <= max_index()))
@@ -1821,34 +3911,69 @@ namespace merkle
 
     void clear()
     {
-      leaf_nodes.clear();
-      for (auto n : uninserted_leaf_nodes)
+      if (background)
       {
-        delete (n);
+        background->wait();
+        background->error = nullptr;
+        background->state.num_hash = 0;
       }
+      leaf_nodes.clear();
       uninserted_leaf_nodes.clear();
       insertion_stack.clear();
-      hashing_stack.clear();
+      hashing.stack.clear();
       walk_stack.clear();
-      delete (_root);
+      for (auto& e : epochs)
+      {
+        e.retired.clear();
+        e.retired_blocks.clear();
+      }
+      node_allocator.release();
+      frozen_blocks.clear();
       _root = nullptr;
       num_flushed = 0;
+      invalidate_marks();
     }
 
     void move_from(TreeT& other) noexcept
     {
+      // The background thread only refers to the nodes, which stay where
+      // they are, so it moves with them.
+      if (other.background)
+      {
+        other.background->wait();
+      }
+      background = std::exchange(other.background, nullptr);
+      node_allocator = std::move(other.node_allocator);
       leaf_nodes = std::exchange(other.leaf_nodes, {});
       uninserted_leaf_nodes = std::exchange(other.uninserted_leaf_nodes, {});
       _root = std::exchange(other._root, nullptr);
       num_flushed = std::exchange(other.num_flushed, 0);
+      frozen_blocks = std::exchange(other.frozen_blocks, {});
       insertion_stack = std::exchange(other.insertion_stack, {});
-      hashing_stack = std::exchange(other.hashing_stack, {});
+      hashing = std::exchange(other.hashing, {});
+      parallel_hashing = other.parallel_hashing;
+      freezing = other.freezing;
       walk_stack = std::exchange(other.walk_stack, {});
+      structure = std::exchange(other.structure, new_structure());
+      sequence = other.sequence;
+      rollbacks = std::exchange(other.rollbacks, {});
+      // Readers refer to the publication, which stays where it is.
+      epochs = std::exchange(other.epochs, {});
+      publication = std::exchange(other.publication, nullptr);
     }
 
+    /// @brief The allocator of the tree's nodes
+    /// @note Nodes are not destroyed individually when the tree is cleared;
+    /// all of their slabs are released at once.
+    NodeAllocator node_allocator;
+
     /// @brief Vector of leaf nodes current in the tree
+    /// @note Leaves in frozen blocks have no nodes; their entries are nullptr.
     std::vector<Node*> leaf_nodes;
 
+    /// @brief Frozen blocks by the index of their first leaf
+    std::map<size_t, FrozenBlock> frozen_blocks;
+
     /// @brief Vector of leaf nodes to be inserted in the tree
     /// @note These nodes are conceptually inserted, but no Node objects have
     /// been inserted for them yet.
@@ -1860,6 +3985,55 @@ namespace merkle
     /// @brief Current root node of the tree
     Node* _root = nullptr;
 
+    /// @brief The structure of the tree below its right edge, unique among
+    /// trees of the same type
+    /// @note Replaced by the operations that may move or free the full
+    /// subtrees that marks refer to; rolling back to earlier marks then falls
+    /// back to retract_to(). See rollback().
+    uint64_t structure = new_structure();
+
+    /// @brief The sequence number of the last mark or rollback
+    uint64_t sequence = 0;
+
+    /// @brief The rollbacks since @p structure was replaced, by sequence
+    /// number and number of leaves, both increasing
+    /// @note A mark with more leaves than the first rollback after it refers
+    /// to freed subtrees.
+    std::vector<std::pair<uint64_t, size_t>> rollbacks;
+
+    /// @brief Creates a new, unique structure; see @p structure
+    static uint64_t new_structure()
+    {
+      static std::atomic<uint64_t> next = 1;
+      return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// @brief Makes all marks fall back to retract_to()
+    void invalidate_marks()
+    {
+      structure = new_structure();
+      rollbacks.clear();
+    }
+
+    /// @brief Indicates whether the full subtrees that a mark refers to are
+    /// still those along the right edge of the tree up to the mark
+    /// @param m The mark
+    bool is_current(const Mark& m) const
+    {
+      if (m.structure != structure)
+      {
+        return false;
+      }
+      // The first rollback after the mark keeps the fewest leaves of those
+      // after it.
+      auto it = std::upper_bound(
+        rollbacks.begin(),
+        rollbacks.end(),
+        m.sequence,
+        [](uint64_t num, const auto& r) { return num < r.first; });
+      return it == rollbacks.end() || it->second >= m.num_leaves();
+    }
+
   private:
     /// @brief The structure of elements on the insertion stack
     using InsertionStackElement = struct
@@ -1876,10 +4050,124 @@ namespace merkle
     /// tree node insertion.
     mutable std::vector<InsertionStackElement> insertion_stack;
 
-    /// @brief The hashing stack
-    /// @note To avoid actual recursion, this holds the stack/continuation for
-    /// hashing (parts of the) nodes of a tree.
-    mutable std::vector<Node*> hashing_stack;
+    /// @brief The state of one thread hashing nodes of the tree
+    struct HashingState
+    {
+      /// @brief The hashing stack
+      /// @note To avoid actual recursion, this holds the stack/continuation
+      /// for hashing (parts of the) nodes of a tree.
+      std::vector<Node*> stack;
+
+      /// @brief The dirty nodes to hash, by height
+      std::vector<std::vector<Node*>> levels;
+
+      /// @brief The node hashes of one level, passed to hash_batch()
+      std::vector<HashPairT<HASH_SIZE>> pairs;
+
+      /// @brief The number of hashes taken
+      size_t num_hash = 0;
+    };
+
+    /// @brief The hashing state of the thread using the tree
+    mutable HashingState hashing;
+
+    /// @brief The state of the background hashing thread; see
+    /// start_background_hashing()
+    struct BackgroundHashing
+    {
+      explicit BackgroundHashing(uint8_t height) :
+        height(height),
+        thread([this]() { run(); })
+      {}
+
+      ~BackgroundHashing()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stop = true;
+        }
+        work.notify_one();
+      }
+
+      /// @brief Hands a dirty full subtree to the thread
+      void submit(Node* n)
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          jobs.push_back(n);
+        }
+        work.notify_one();
+      }
+
+      /// @brief Waits until all handed-over subtrees are hashed
+      void wait() noexcept
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return jobs.empty() && !busy; });
+      }
+
+      void run()
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+          work.wait(lock, [this]() { return stop || !jobs.empty(); });
+          if (jobs.empty())
+          {
+            return;
+          }
+          Node* n = jobs.front();
+          jobs.pop_front();
+          busy = true;
+          lock.unlock();
+          try
+          {
+            hash_subtree(n, state, 2);
+          }
+          catch (...)
+          {
+            error = std::current_exception();
+          }
+          lock.lock();
+          busy = false;
+          if (jobs.empty())
+          {
+            idle.notify_all();
+          }
+        }
+      }
+
+      /// @brief The height of the subtrees, counting leaves as 0
+      const uint8_t height;
+
+      /// @brief The hashing state of the thread; only read after wait()
+      HashingState state;
+
+      /// @brief The first exception thrown while hashing; only accessed
+      /// after wait()
+      std::exception_ptr error;
+
+      std::mutex mutex;
+      std::condition_variable work;
+      std::condition_variable idle;
+      std::deque<Node*> jobs;
+      bool busy = false;
+      bool stop = false;
+
+      /// @brief The thread, last so that it starts after the other members
+      /// are initialised and is joined before they are destroyed
+      std::jthread thread;
+    };
+
+    /// @brief The background hashing thread, if any
+    std::unique_ptr<BackgroundHashing> background;
+
+    /// @brief The epochs with live snapshots or retired nodes, oldest first
+    /// @note A deque, so that snapshots can refer to its elements.
+    std::deque<Epoch> epochs;
+
+    /// @brief The published version and its readers, if any; see publish()
+    std::unique_ptr<Publication> publication;
 
     /// @brief The walk stack
     /// @note To avoid actual recursion, this holds the stack/continuation for
@@ -1887,126 +4175,594 @@ namespace merkle
     mutable std::vector<Node*> walk_stack;
 
   protected:
-    /// @brief Finds the leaf node corresponding to @p index
-    /// @param index The leaf node index
-    const Node* leaf_node(size_t index) const
+    /// @brief Finds the frozen block holding a leaf
+    /// @param index The leaf index
+    /// @return The frozen block, or frozen_blocks.end() if the leaf is not
+    /// frozen
+    typename std::map<size_t, FrozenBlock>::const_iterator frozen_block(
+      size_t index) const
     {
-      MERKLECPP_TRACE(MERKLECPP_TOUT << "> leaf_node " << index << std::endl;);
-      if (index >= num_leaves())
+      auto it = frozen_blocks.upper_bound(index);
+      if (it == frozen_blocks.begin())
       {
-        throw std::runtime_error("leaf index out of bounds");
+        return frozen_blocks.end();
       }
-      if (index - num_flushed >= leaf_nodes.size())
+      it--;
+      if (index - it->first >= (size_t{1} << (it->second.height - 1)))
       {
-        return uninserted_leaf_nodes.at(
-          index - num_flushed - leaf_nodes.size());
+        return frozen_blocks.end();
       }
-      return leaf_nodes.at(index - num_flushed);
+      return it;
     }
 
-    /// @brief Computes the hash of a tree node
-    /// @param n The tree node
-    /// @param indent Indentation of trace output
-    /// @note This recurses down the child nodes to compute intermediate
-    /// hashes, if required.
-    void hash(Node* n, size_t indent = 2) const
+    /// @brief The greatest frozen leaf index, or 0 if no leaf is frozen
+    size_t max_frozen_index() const
     {
-#ifndef MERKLECPP_WITH_TRACE
-      (void)indent;
-#endif
+      if (frozen_blocks.empty())
+      {
+        return 0;
+      }
+      const auto& [first, block] = *frozen_blocks.rbegin();
+      return first + (size_t{1} << (block.height - 1)) - 1;
+    }
 
-      assert(hashing_stack.empty());
-      hashing_stack.reserve(n->height);
-      hashing_stack.push_back(n);
+    /// @brief Creates a cursor for a tree node
+    /// @param n The tree node
+    /// @param index A leaf index under @p n, to find its frozen block
+    Cursor cursor(const Node* n, size_t index) const
+    {
+      Cursor c;
+      c.node = n;
+      if (n->frozen)
+      {
+        c.block = &frozen_block(index)->second;
+        c.position = 1;
+      }
+      return c;
+    }
 
-      while (!hashing_stack.empty())
+    /// @brief Moves a cursor to one of its children
+    /// @param c The cursor
+    /// @param right Indicates whether to move to the right child
+    /// @param index A leaf index under the child, to find its frozen block
+    Cursor child(Cursor c, bool right, size_t index) const
+    {
+      if (c.block)
       {
-        n = hashing_stack.back();
-        assert((n->left && n->right) || (!n->left && !n->right));
+        c.position = 2 * c.position + (right ? 1 : 0);
+        return c;
+      }
+      return cursor(right ? c.node->right : c.node->left, index);
+    }
 
-        if (n->left && n->left->dirty)
-        {
-          hashing_stack.push_back(n->left);
-        }
-        else if (n->right && n->right->dirty)
-        {
-          hashing_stack.push_back(n->right);
-        }
-        else
-        {
-          assert(n->left && n->right);
-          if (!n->left || !n->right)
+    /// @brief Counts the extra hashes needed to serialise the tree from a leaf
+    /// @param index The first leaf index to serialise
+    size_t count_extras(size_t index)
+    {
+      size_t num_extras = 0;
+      Node* last =
+        walk_to(index, false, [&num_extras](Node*&, bool go_right) {
+          if (go_right)
           {
-            throw std::runtime_error("unexpected null child node");
+            num_extras++;
           }
-          HASH_FUNCTION(n->left->hash, n->right->hash, n->hash);
-          statistics.num_hash++;
-          MERKLECPP_TRACE(
-            MERKLECPP_TOUT << std::string(indent, ' ') << "+ h("
-                           << n->left->hash.to_string(TRACE_HASH_SIZE) << ", "
-                           << n->right->hash.to_string(TRACE_HASH_SIZE)
-                           << ") == " << n->hash.to_string(TRACE_HASH_SIZE)
-                           << " (" << n->size << "/" << (unsigned)n->height
-                           << ")" << std::endl);
-          n->dirty = false;
-          hashing_stack.pop_back();
-        }
+          return true;
+        });
+      if (last->frozen)
+      {
+        num_extras += std::popcount(index - frozen_block(index)->first);
       }
+      return num_extras;
     }
 
-    /// @brief Computes the root hash of the tree
-    void compute_root()
+    /// @brief Indicates whether all hashes of a subtree are in memory
+    /// @param n The root of the subtree
+    static bool is_resident(const Node* n)
     {
-      insert_leaves(true);
-      if (num_leaves() == 0)
+      if (n->frozen)
       {
-        throw std::runtime_error("empty tree does not have a root");
+        return true;
       }
-      assert(_root);
-      assert(_root->invariant());
-      if (_root->dirty)
+      if (!n->left || !n->right)
       {
-        hash(_root);
-        assert(_root && !_root->dirty);
+        return n->height == 1;
       }
+      return is_resident(n->left) && is_resident(n->right);
     }
 
-    /// @brief Inserts one new leaf into the insertion stack
-    /// @param n Current root node
-    /// @param new_leaf New leaf node to insert
-    /// @note This adds one new Node to the insertion stack/continuation for
-    /// efficient processing by process_insertion_stack() later.
-    void continue_insertion_stack(Node* n, Node* new_leaf)
+    /// @brief Minimum height of frozen blocks
+    static constexpr uint8_t min_frozen_height = 2;
+
+    /// @brief Moves the hashes of the full subtrees of leaves smaller than
+    /// some leaf into frozen blocks
+    /// @param index The leaf index to freeze the tree to
+    /// @param min_height The minimum height of subtrees to freeze
+    void freeze_subtrees(size_t index, uint8_t min_height)
     {
-      while (true)
+      if (shared())
       {
-        MERKLECPP_TRACE(
-          MERKLECPP_TOUT << "  @ " << n->hash.to_string(TRACE_HASH_SIZE)
-                         << std::endl;);
-        assert(n->invariant());
-
-        if (n->is_full())
+        if (!has_subtrees_to_freeze(index, min_height))
         {
-          Node* result = Node::make(n, new_leaf);
-          insertion_stack.push_back(InsertionStackElement());
-          insertion_stack.back().n = result;
           return;
         }
+        // Copies replace the full subtrees that marks refer to.
+        invalidate_marks();
+      }
 
-        assert(n->left && n->right);
-        insertion_stack.push_back(InsertionStackElement());
-        InsertionStackElement& se = insertion_stack.back();
-        se.n = n;
-        n->dirty = true;
-        if (!n->left->is_full())
+      // Freeze the left subtrees along the path to `index`; they are full.
+      Node** slot = &_root;
+      size_t first = 0;
+      while (*slot && !(*slot)->frozen && (*slot)->left &&
+             (*slot)->height >= min_height)
+      {
+        Node*& n = *slot;
+        if (n->is_full() && first + (n->size + 1) / 2 <= index)
         {
-          se.left = true;
-          n = n->left;
+          freeze_subtree(n, first, min_height);
+          break;
         }
-        else
+        unshare(n);
+        const size_t num_left_leaves = (n->left->size + 1) / 2;
+        if (first + num_left_leaves <= index)
         {
-          se.left = false;
-          n = n->right;
+          freeze_subtree(n->left, first, min_height);
+          first += num_left_leaves;
+          slot = &n->right;
+        }
+        else
+        {
+          slot = &n->left;
+        }
+      }
+    }
+
+    /// @brief Indicates whether freeze_subtrees() finds subtrees to freeze
+    /// @param index The leaf index to freeze the tree to
+    /// @param min_height The minimum height of subtrees to freeze
+    /// @note While snapshots are alive, freezing copies the nodes on its way,
+    /// so it only starts if there is something to freeze.
+    bool has_subtrees_to_freeze(size_t index, uint8_t min_height) const
+    {
+      const Node* n = _root;
+      size_t first = 0;
+      while (n && !n->frozen && n->left && n->height >= min_height)
+      {
+        if (n->is_full() && first + (n->size + 1) / 2 <= index)
+        {
+          return true;
+        }
+        const Node* left = n->left;
+        const size_t num_left_leaves = (left->size + 1) / 2;
+        if (first + num_left_leaves <= index)
+        {
+          if (!left->frozen && left->left && left->height >= min_height)
+          {
+            return true;
+          }
+          first += num_left_leaves;
+          n = n->right;
+        }
+        else
+        {
+          n = left;
+        }
+      }
+      return false;
+    }
+
+    /// @brief Moves the hashes of a full subtree into frozen blocks
+    /// @param n The root of the subtree
+    /// @param first The index of the first leaf of the subtree
+    /// @param min_height The minimum height of subtrees to freeze
+    /// @note Subtrees with flushed parts are frozen as far as they are still
+    /// in memory. While snapshots are alive, a frozen copy replaces @p n.
+    void freeze_subtree(Node*& n, size_t first, uint8_t min_height)
+    {
+      assert(n->is_full() && !n->dirty);
+      if (n->frozen || n->height < min_height || !n->left)
+      {
+        return;
+      }
+
+      // Only subtrees with flushed leaves can contain conflated nodes.
+      if (first < num_flushed && !is_resident(n))
+      {
+        unshare(n);
+        freeze_subtree(n->left, first, min_height);
+        freeze_subtree(
+          n->right, first + (n->left->size + 1) / 2, min_height);
+        return;
+      }
+
+      MERKLECPP_TRACE(
+        MERKLECPP_TOUT << " - freeze " << n->hash.to_string(TRACE_HASH_SIZE)
+                       << " (" << first << "/" << (unsigned)n->height << ")"
+                       << std::endl;);
+
+      FrozenBlock block(n->height, freezing.stride, freezing.cache_size);
+      copy_to_block(n, block, 1, first);
+
+      const size_t num_subtree_leaves = (n->size + 1) / 2;
+      for (size_t i = std::max(first, num_flushed);
+           i < first + num_subtree_leaves;
+           i++)
+      {
+        leaf_nodes.at(i - num_flushed) = nullptr;
+      }
+
+      if (shared())
+      {
+        Node* copy = Node::make(node_allocator, n->hash);
+        copy->size = n->size;
+        copy->height = n->height;
+        retire(n, true);
+        n = copy;
+      }
+      else
+      {
+        Node::free(node_allocator, n->left);
+        Node::free(node_allocator, n->right);
+        n->left = n->right = nullptr;
+      }
+      n->frozen = true;
+      frozen_blocks.emplace(first, std::move(block));
+    }
+
+    /// @brief Copies the hashes of a subtree into a frozen block
+    /// @param n The root of the subtree
+    /// @param block The frozen block
+    /// @param position The position of @p n in @p block
+    /// @param first The index of the first leaf of the subtree
+    /// @note Frozen blocks inside the subtree are merged into @p block.
+    void copy_to_block(
+      const Node* n, FrozenBlock& block, size_t position, size_t first)
+    {
+      if (n->frozen)
+      {
+        // Each level of the inner block is a contiguous range of positions in
+        // @p block, on the same level.
+        auto it = frozen_blocks.find(first);
+        assert(it != frozen_blocks.end());
+        const FrozenBlock& inner = it->second;
+        for (uint8_t level = 0; level < inner.height; level++)
+        {
+          if (!block.is_kept(level))
+          {
+            continue;
+          }
+          const size_t width = size_t{1} << (inner.height - 1 - level);
+          const size_t to = position * width;
+          if (inner.is_kept(level))
+          {
+            const auto from = inner.hashes.begin() +
+              static_cast<std::ptrdiff_t>(inner.offsets[level]);
+            std::copy(
+              from, from + static_cast<std::ptrdiff_t>(width), &block.at(to));
+          }
+          else
+          {
+            for (size_t i = 0; i < width; i++)
+            {
+              block.at(to + i) = inner.hash(width + i);
+            }
+          }
+        }
+        retire_block(it);
+        return;
+      }
+
+      if (block.is_kept(block.level(position)))
+      {
+        block.at(position) = n->hash;
+      }
+      if (n->left)
+      {
+        copy_to_block(n->left, block, 2 * position, first);
+        copy_to_block(
+          n->right, block, 2 * position + 1, first + (n->left->size + 1) / 2);
+      }
+    }
+
+    /// @brief Computes the hash of a tree node
+    /// @param n The tree node
+    /// @param indent Indentation of trace output
+    /// @note This recurses down the child nodes to compute intermediate
+    /// hashes, if required.
+    void hash(Node* n, size_t indent = 2) const
+    {
+      hash_subtree(n, hashing, indent);
+      statistics.num_hash += std::exchange(hashing.num_hash, 0);
+    }
+
+    /// @brief Computes the hash of a tree node
+    /// @param n The tree node
+    /// @param state The hashing state of the calling thread
+    /// @param indent Indentation of trace output
+    /// @note Subtrees of up to level_hashing_size nodes with dirty nodes on
+    /// both sides are hashed by hash_levels().
+    static void hash_subtree(Node* n, HashingState& state, size_t indent)
+    {
+#ifndef MERKLECPP_WITH_TRACE
+      (void)indent;
+#endif
+
+      state.stack.clear();
+      state.stack.reserve(n->height);
+      state.stack.push_back(n);
+
+      while (!state.stack.empty())
+      {
+        n = state.stack.back();
+        assert((n->left && n->right) || (!n->left && !n->right));
+
+        if (
+          n->size <= level_hashing_size && n->left && n->left->dirty &&
+          n->right && n->right->dirty)
+        {
+          hash_levels(n, state, indent);
+          state.stack.pop_back();
+        }
+        else if (n->left && n->left->dirty)
+        {
+          state.stack.push_back(n->left);
+        }
+        else if (n->right && n->right->dirty)
+        {
+          state.stack.push_back(n->right);
+        }
+        else
+        {
+          assert(n->left && n->right);
+          if (!n->left || !n->right)
+          {
+            throw std::runtime_error("unexpected null child node");
+          }
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(
+            n->left->hash, n->right->hash, n->hash);
+          state.num_hash++;
+          MERKLECPP_TRACE(
+            MERKLECPP_TOUT << std::string(indent, ' ') << "+ h("
+                           << n->left->hash.to_string(TRACE_HASH_SIZE) << ", "
+                           << n->right->hash.to_string(TRACE_HASH_SIZE)
+                           << ") == " << n->hash.to_string(TRACE_HASH_SIZE)
+                           << " (" << n->size << "/" << (unsigned)n->height
+                           << ")" << std::endl);
+          n->dirty = false;
+          state.stack.pop_back();
+        }
+      }
+    }
+
+    /// @brief Maximum number of nodes in subtrees hashed by hash_levels()
+    /// @note Large enough for wide batches, small enough for the subtree to
+    /// stay in the CPU caches while it is hashed level by level.
+    static constexpr size_t level_hashing_size = 2047;
+
+    /// @brief Computes the hash of a tree node, one level at a time
+    /// @param n The tree node
+    /// @param state The hashing state of the calling thread
+    /// @param indent Indentation of trace output
+    /// @note Children are always lower than their parents, so the dirty
+    /// nodes of one height are independent. This collects them by height and
+    /// hashes them bottom-up, passing each level to hash_batch().
+    static void hash_levels(Node* n, HashingState& state, size_t indent)
+    {
+#ifndef MERKLECPP_WITH_TRACE
+      (void)indent;
+#endif
+
+      if (state.levels.size() <= n->height)
+      {
+        state.levels.resize(n->height + 1);
+      }
+
+      state.levels[n->height].push_back(n);
+      for (size_t height = n->height; height > 0; height--)
+      {
+        for (Node* m : state.levels[height])
+        {
+          assert((m->left && m->right) || (!m->left && !m->right));
+          if (!m->left || !m->right)
+          {
+            for (auto& level : state.levels)
+            {
+              level.clear();
+            }
+            throw std::runtime_error("unexpected null child node");
+          }
+          if (m->left->dirty)
+          {
+            state.levels[m->left->height].push_back(m->left);
+          }
+          if (m->right->dirty)
+          {
+            state.levels[m->right->height].push_back(m->right);
+          }
+        }
+      }
+
+      for (size_t height = 2; height <= n->height; height++)
+      {
+        auto& level = state.levels[height];
+        if (level.size() == 1)
+        {
+          Node* m = level.front();
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(
+            m->left->hash, m->right->hash, m->hash);
+        }
+        else if (!level.empty())
+        {
+          state.pairs.clear();
+          for (Node* m : level)
+          {
+            state.pairs.push_back(
+              {&m->left->hash, &m->right->hash, &m->hash});
+          }
+          hash_batch<HASH_SIZE, HASH_FUNCTION>(state.pairs);
+        }
+
+        for (Node* m : level)
+        {
+          MERKLECPP_TRACE(
+            MERKLECPP_TOUT << std::string(indent, ' ') << "+ h("
+                           << m->left->hash.to_string(TRACE_HASH_SIZE) << ", "
+                           << m->right->hash.to_string(TRACE_HASH_SIZE)
+                           << ") == " << m->hash.to_string(TRACE_HASH_SIZE)
+                           << " (" << m->size << "/" << (unsigned)m->height
+                           << ")" << std::endl);
+          m->dirty = false;
+        }
+        state.num_hash += level.size();
+        level.clear();
+      }
+    }
+
+    /// @brief Computes the root hash of the tree
+    void compute_root()
+    {
+      sync_background();
+      insert_leaves(true);
+      if (num_leaves() == 0)
+      {
+        throw std::runtime_error("empty tree does not have a root");
+      }
+      assert(_root);
+      assert(_root->invariant());
+      if (_root->dirty)
+      {
+        if (
+          parallel_hashing.num_threads > 1 &&
+          _root->height > parallel_hashing.split_height)
+        {
+          hash_parallel(_root);
+        }
+        hash(_root);
+        assert(_root && !_root->dirty);
+        if (freezing.automatic_height > 0)
+        {
+          freeze_subtrees(
+            num_leaves(),
+            std::max(freezing.automatic_height, min_frozen_height));
+        }
+      }
+    }
+
+    /// @brief Computes the hashes of the dirty subtrees under a tree node on
+    /// multiple threads
+    /// @param n The tree node
+    /// @note This hashes the dirty subtrees of height
+    /// parallel_hashing.split_height or lower; the dirty nodes above them
+    /// are left for hash().
+    void hash_parallel(Node* n) const
+    {
+      std::vector<Node*> subtrees;
+      hashing.stack.clear();
+      hashing.stack.push_back(n);
+      while (!hashing.stack.empty())
+      {
+        n = hashing.stack.back();
+        hashing.stack.pop_back();
+        if (n->height <= parallel_hashing.split_height)
+        {
+          subtrees.push_back(n);
+        }
+        else
+        {
+          if (n->left && n->left->dirty)
+          {
+            hashing.stack.push_back(n->left);
+          }
+          if (n->right && n->right->dirty)
+          {
+            hashing.stack.push_back(n->right);
+          }
+        }
+      }
+
+      if (subtrees.size() < 2)
+      {
+        return;
+      }
+
+      const size_t num_threads =
+        std::min(parallel_hashing.num_threads, subtrees.size());
+      std::vector<HashingState> states(num_threads);
+      std::vector<std::exception_ptr> errors(num_threads);
+      std::atomic<size_t> next = 0;
+      auto work = [&](size_t t) {
+        try
+        {
+          for (size_t i = next++; i < subtrees.size(); i = next++)
+          {
+            hash_subtree(subtrees[i], states[t], 2);
+          }
+        }
+        catch (...)
+        {
+          errors[t] = std::current_exception();
+          next = subtrees.size();
+        }
+      };
+
+      {
+        std::vector<std::jthread> threads;
+        threads.reserve(num_threads - 1);
+        for (size_t t = 1; t < num_threads; t++)
+        {
+          threads.emplace_back(work, t);
+        }
+        work(0);
+      }
+
+      for (const auto& state : states)
+      {
+        statistics.num_hash += state.num_hash;
+      }
+      for (const auto& error : errors)
+      {
+        if (error)
+        {
+          std::rethrow_exception(error);
+        }
+      }
+    }
+
+    /// @brief Inserts one new leaf into the insertion stack
+    /// @param n Current root node
+    /// @param new_leaf New leaf node to insert
+    /// @note This adds one new Node to the insertion stack/continuation for
+    /// efficient processing by process_insertion_stack() later.
+    void continue_insertion_stack(Node* n, Node* new_leaf)
+    {
+      while (true)
+      {
+        MERKLECPP_TRACE(
+          MERKLECPP_TOUT << "  @ " << n->hash.to_string(TRACE_HASH_SIZE)
+                         << std::endl;);
+        assert(n->invariant());
+
+        if (n->is_full())
+        {
+          Node* result = Node::make(node_allocator, n, new_leaf);
+          insertion_stack.push_back(InsertionStackElement());
+          insertion_stack.back().n = result;
+          return;
+        }
+
+        assert(n->left && n->right);
+        insertion_stack.push_back(InsertionStackElement());
+        InsertionStackElement& se = insertion_stack.back();
+        se.n = n;
+        n->dirty = true;
+        if (!n->left->is_full())
+        {
+          se.left = true;
+          n = n->left;
+        }
+        else
+        {
+          se.left = false;
+          n = n->right;
         }
       }
     }
@@ -2068,169 +4824,2366 @@ namespace merkle
       return result;
     }
 
-    /// @brief Inserts a new leaf into the tree
-    /// @param root Current root node
-    /// @param n New leaf node to insert
-    void insert_leaf(Node*& root, Node* n)
+    /// @brief Inserts a new leaf into the tree
+    /// @param root Current root node
+    /// @param n New leaf node to insert
+    void insert_leaf(Node*& root, Node* n)
+    {
+      MERKLECPP_TRACE(
+        MERKLECPP_TOUT << " - insert_leaf "
+                       << n->hash.to_string(TRACE_HASH_SIZE) << std::endl;);
+      leaf_nodes.push_back(n);
+      if (insertion_stack.empty() && !root)
+      {
+        root = n;
+      }
+      else
+      {
+        continue_insertion_stack(root, n);
+        root = process_insertion_stack(false);
+      }
+    }
+
+    /// @brief Minimum number of uninserted leaves for insert_leaves() to use
+    /// insert_leaves_bulk()
+    static constexpr size_t bulk_insertion_size = 16;
+
+    /// @brief Inserts all uninserted leaves into the tree at once
+    /// @note This splits the right edge of the tree into its full subtrees,
+    /// adds the new leaves to them like a binary counter, so that each new
+    /// full subtree is built bottom-up, and then joins the full subtrees into
+    /// a new right edge. Each new node is created once, instead of walking
+    /// down from the root for every leaf.
+    void insert_leaves_bulk()
+    {
+      MERKLECPP_TRACE(
+        MERKLECPP_TOUT << " - insert_leaves_bulk "
+                       << uninserted_leaf_nodes.size() << std::endl;);
+
+      if (!insertion_stack.empty())
+      {
+        _root = process_insertion_stack();
+      }
+
+      std::vector<Node*> subtrees;
+      Node* n = _root;
+      while (n && !n->is_full())
+      {
+        assert(n->left && n->right && n->left->is_full());
+        subtrees.push_back(n->left);
+        Node* right = n->right;
+        n->left = n->right = nullptr;
+        Node::free(node_allocator, n);
+        n = right;
+      }
+      if (n)
+      {
+        subtrees.push_back(n);
+      }
+
+      for (Node* leaf : uninserted_leaf_nodes)
+      {
+        leaf_nodes.push_back(leaf);
+        n = leaf;
+        while (!subtrees.empty() && subtrees.back()->height == n->height)
+        {
+          n = Node::make(node_allocator, subtrees.back(), n);
+          subtrees.pop_back();
+        }
+        subtrees.push_back(n);
+      }
+
+      n = subtrees.back();
+      for (size_t i = subtrees.size() - 1; i > 0; i--)
+      {
+        n = Node::make(node_allocator, subtrees[i - 1], n);
+      }
+      _root = n;
+    }
+
+    /// @brief Inserts multiple new leaves into the tree
+    /// @param complete Indicates whether the insertion stack should be
+    /// processed to completion after insertion
+    void insert_leaves(bool complete = false)
+    {
+      if (!uninserted_leaf_nodes.empty())
+      {
+        MERKLECPP_TRACE(
+          MERKLECPP_TOUT << "* insert_leaves " << leaf_nodes.size() << " +"
+                         << uninserted_leaf_nodes.size() << std::endl;);
+        if (uninserted_leaf_nodes.size() >= bulk_insertion_size)
+        {
+          insert_leaves_bulk();
+        }
+        else
+        {
+          for (auto& n : uninserted_leaf_nodes)
+          {
+            insert_leaf(_root, n);
+          }
+        }
+        uninserted_leaf_nodes.clear();
+      }
+      if (complete && !insertion_stack.empty())
+      {
+        _root = process_insertion_stack();
+      }
+    }
+  };
+
+  /// @brief Template for compact ranges of Merkle tree leaves
+  /// @tparam HASH_SIZE Size of each hash in number of bytes
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
+  /// @note A compact range keeps only the roots of the largest full subtrees
+  /// that cover a range of leaves, at most two per height, instead of one
+  /// node per leaf. That is enough to append leaves and to compute the root
+  /// of the tree of a range starting at leaf 0, which is the same as the
+  /// root of a TreeT with the same leaves, but not to extract paths. The
+  /// subtree roots are stored inline, so appending leaves does not allocate
+  /// memory.
+  template <
+    size_t HASH_SIZE,
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
+  class CompactRangeT
+  {
+  public:
+    /// @brief Hash function used to combine tree nodes.
+    static constexpr auto hash_function = HASH_FUNCTION;
+
+    /// @brief The type of hashes in the range
+    using Hash = HashT<HASH_SIZE>;
+
+    /// @brief Constructs an empty range starting at leaf 0
+    CompactRangeT() = default;
+
+    /// @brief Constructs an empty range
+    /// @param begin The index of the first leaf of the range
+    explicit CompactRangeT(size_t begin) : _begin(begin), _end(begin) {}
+
+    /// @brief Appends a leaf to the range
+    /// @param hash The leaf hash
+    void append(const Hash& hash)
+    {
+      push(hash, 0);
+    }
+
+    /// @brief Appends multiple leaves to the range
+    /// @param hashes The leaf hashes
+    /// @note Full subtrees of up to 2**bulk_height new leaves are hashed
+    /// level by level with hash_batch().
+    void append(std::span<const Hash> hashes)
+    {
+      size_t i = 0;
+      while (i < hashes.size())
+      {
+        // The largest full subtree that starts at _end
+        const auto height = static_cast<uint8_t>(std::min<size_t>(
+          {static_cast<size_t>(std::countr_zero(_end)),
+           static_cast<size_t>(std::bit_width(hashes.size() - i)) - 1,
+           bulk_height}));
+        if (height < 2)
+        {
+          push(hashes[i++], 0);
+          continue;
+        }
+
+        const size_t width = size_t{1} << height;
+        std::array<Hash, bulk_size / 2> scratch;
+        std::array<HashPairT<HASH_SIZE>, bulk_size / 2> pairs;
+        for (size_t j = 0; j < width / 2; j++)
+        {
+          pairs[j] = {&hashes[i + 2 * j], &hashes[i + 2 * j + 1], &scratch[j]};
+        }
+        hash_batch<HASH_SIZE, HASH_FUNCTION>(
+          std::span(pairs.data(), width / 2));
+        for (size_t w = width / 4; w > 0; w /= 2)
+        {
+          for (size_t j = 0; j < w; j++)
+          {
+            pairs[j] = {&scratch[2 * j], &scratch[2 * j + 1], &scratch[j]};
+          }
+          hash_batch<HASH_SIZE, HASH_FUNCTION>(std::span(pairs.data(), w));
+        }
+        push(scratch[0], height);
+        i += width;
+      }
+    }
+
+    /// @brief Appends another range to the range
+    /// @param other The range to append, which must begin at end()
+    void merge(const CompactRangeT& other)
+    {
+      if (other._begin != _end)
+      {
+        throw std::runtime_error("compact ranges are not adjacent");
+      }
+      for (size_t i = 0; i < other.num_hashes; i++)
+      {
+        push(other._hashes[i], other.heights[i]);
+      }
+    }
+
+    /// @brief Computes the root hash of the tree of the leaves in the range
+    /// @return The root hash
+    /// @note The range must begin at leaf 0.
+    [[nodiscard]] Hash root() const
+    {
+      if (_begin != 0)
+      {
+        throw std::runtime_error("compact range does not begin at leaf 0");
+      }
+      if (num_hashes == 0)
+      {
+        throw std::runtime_error("empty tree does not have a root");
+      }
+      Hash result = _hashes[num_hashes - 1];
+      for (size_t i = num_hashes - 1; i > 0; i--)
+      {
+        detail::hash_node<HASH_SIZE, HASH_FUNCTION>(
+          _hashes[i - 1], result, result);
+      }
+      return result;
+    }
+
+    /// @brief The index of the first leaf of the range
+    [[nodiscard]] size_t begin() const
+    {
+      return _begin;
+    }
+
+    /// @brief The index after the last leaf of the range
+    [[nodiscard]] size_t end() const
+    {
+      return _end;
+    }
+
+    /// @brief Number of leaves in the range
+    [[nodiscard]] size_t num_leaves() const
+    {
+      return _end - _begin;
+    }
+
+    /// @brief Indicates whether the range is empty
+    [[nodiscard]] bool empty() const
+    {
+      return _end == _begin;
+    }
+
+    /// @brief The roots of the full subtrees covering the range, from left
+    /// to right
+    [[nodiscard]] std::span<const Hash> hashes() const
+    {
+      return {_hashes.data(), num_hashes};
+    }
+
+  protected:
+    /// @brief Maximum height of the subtrees hashed at once by append()
+    static constexpr uint8_t bulk_height = 6;
+
+    /// @brief Maximum number of leaves hashed at once by append()
+    static constexpr size_t bulk_size = size_t{1} << bulk_height;
+
+    /// @brief Maximum number of subtree roots
+    static constexpr size_t max_hashes =
+      2 * std::numeric_limits<size_t>::digits;
+
+    /// @brief Appends the root of a full subtree to the range
+    /// @param hash The root hash of the subtree
+    /// @param height The height of the subtree, counting leaves as 0
+    /// @note Adjacent subtrees of equal height are joined while they are
+    /// siblings, i.e. while the left one starts at a multiple of twice
+    /// their size.
+    void push(const Hash& hash, uint8_t height)
+    {
+      assert(num_hashes < max_hashes);
+      assert(_end % (size_t{1} << height) == 0);
+      _hashes[num_hashes] = hash;
+      heights[num_hashes] = height;
+      num_hashes++;
+      _end += size_t{1} << height;
+
+      while (num_hashes >= 2 &&
+             heights[num_hashes - 2] == heights[num_hashes - 1])
+      {
+        const uint8_t h = heights[num_hashes - 1];
+        const size_t left_begin = _end - (size_t{2} << h);
+        if (((left_begin >> h) & 0x01) != 0U)
+        {
+          break;
+        }
+        detail::hash_node<HASH_SIZE, HASH_FUNCTION>(
+          _hashes[num_hashes - 2],
+          _hashes[num_hashes - 1],
+          _hashes[num_hashes - 2]);
+        heights[num_hashes - 2]++;
+        num_hashes--;
+      }
+    }
+
+    /// @brief The index of the first leaf of the range
+    size_t _begin = 0;
+
+    /// @brief The index after the last leaf of the range
+    size_t _end = 0;
+
+    /// @brief The number of subtree roots
+    size_t num_hashes = 0;
+
+    /// @brief The roots of the full subtrees covering the range
+    std::array<Hash, max_hashes> _hashes;
+
+    /// @brief The heights of the subtrees in @p _hashes
+    std::array<uint8_t, max_hashes> heights = {};
+  };
+
+  /// @brief Template for Merkle trees of bounded size with inline storage
+  /// @tparam HASH_SIZE Size of each hash in number of bytes
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
+  /// @tparam MAX_LEAVES The maximum number of leaves of the tree
+  /// @note A static tree stores its leaves and the hashes of its full
+  /// subtrees level by level in one array of fewer than 2 * MAX_LEAVES hashes
+  /// that is part of the tree object, so inserting leaves and computing roots
+  /// does not allocate memory, also when the tree is on the stack. Roots and
+  /// paths are the same as those of a TreeT with the same leaves. The hashes
+  /// of new full subtrees are computed in batches when a root or path is
+  /// extracted.
+  template <
+    size_t HASH_SIZE,
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
+    size_t MAX_LEAVES>
+  class StaticTreeT
+  {
+    static_assert(MAX_LEAVES > 0, "static trees need at least one leaf");
+
+  public:
+    /// @brief Hash function used to combine tree nodes.
+    static constexpr auto hash_function = HASH_FUNCTION;
+
+    /// @brief The maximum number of leaves of the tree
+    static constexpr size_t max_leaves = MAX_LEAVES;
+
+    /// @brief The type of hashes in the tree
+    using Hash = HashT<HASH_SIZE>;
+
+    /// @brief The type of paths in the tree
+    using Path = PathT<HASH_SIZE, HASH_FUNCTION>;
+
+    /// @brief Constructs an empty tree
+    StaticTreeT() = default;
+
+    /// @brief Inserts a leaf into the tree
+    /// @param hash The leaf hash
+    void insert(const Hash& hash)
+    {
+      if (_num_leaves == MAX_LEAVES)
+      {
+        throw std::runtime_error("static tree is full");
+      }
+      hashes[_num_leaves++] = hash;
+    }
+
+    /// @brief Inserts multiple leaves into the tree
+    /// @param leaves The leaf hashes
+    void insert(std::span<const Hash> leaves)
+    {
+      if (leaves.size() > MAX_LEAVES - _num_leaves)
+      {
+        throw std::runtime_error("static tree is full");
+      }
+      std::copy(leaves.begin(), leaves.end(), hashes.begin() + _num_leaves);
+      _num_leaves += leaves.size();
+    }
+
+    /// @brief Retracts the tree to a past state
+    /// @param index The new maximum leaf index of the tree
+    /// @note The hashes of full subtrees that end at or before @p index are
+    /// kept.
+    void retract_to(size_t index)
+    {
+      if (empty() || max_index() < index)
+      {
+        return;
+      }
+      _num_leaves = index + 1;
+      num_hashed = std::min(num_hashed, _num_leaves);
+    }
+
+    /// @brief Removes all leaves from the tree
+    void clear()
+    {
+      _num_leaves = 0;
+      num_hashed = 0;
+    }
+
+    /// @brief Computes the root hash of the tree
+    /// @return The root hash
+    [[nodiscard]] Hash root()
+    {
+      if (empty())
+      {
+        throw std::runtime_error("empty tree does not have a root");
+      }
+      return past_root(max_index());
+    }
+
+    /// @brief Computes a past root hash
+    /// @param index The last leaf index to consider
+    /// @return The root hash of the tree when @p index was the last,
+    /// right-most leaf index
+    [[nodiscard]] Hash past_root(size_t index)
+    {
+      if (empty() || max_index() < index)
+      {
+        throw std::runtime_error("invalid leaf index");
+      }
+      compute();
+      const size_t n = index + 1;
+      return partial_root(static_cast<uint8_t>(std::bit_width(n)), n);
+    }
+
+    /// @brief Extracts the path from a leaf index to the root of the tree
+    /// @param index The leaf index of the path to extract
+    /// @return The path
+    std::shared_ptr<Path> path(size_t index)
+    {
+      if (empty() || max_index() < index)
+      {
+        throw std::runtime_error("invalid leaf index");
+      }
+      return past_path(index, max_index());
+    }
+
+    /// @brief Extracts a past path from a leaf index to the root of the tree
+    /// @param index The leaf index of the path to extract
+    /// @param as_of The maximum leaf index to consider
+    /// @return The past path
+    /// @note Like TreeT::past_path(), this is equivalent to retracting the
+    /// tree to @p as_of and then extracting the path of @p index.
+    std::shared_ptr<Path> past_path(size_t index, size_t as_of)
+    {
+      if (empty() || max_index() < as_of || as_of < index)
+      {
+        throw std::runtime_error("invalid leaf indices");
+      }
+      compute();
+
+      const size_t n = as_of + 1;
+      std::list<typename Path::Element> elements;
+      for (uint8_t level = 0; (size_t{1} << level) < n; level++)
+      {
+        const size_t i = index >> level;
+        const size_t sibling = i ^ 1;
+        if (sibling < i)
+        {
+          elements.push_back({node(level, sibling), Path::PATH_LEFT});
+        }
+        else if (((sibling + 1) << level) <= n)
+        {
+          elements.push_back({node(level, sibling), Path::PATH_RIGHT});
+        }
+        else if ((sibling << level) < n)
+        {
+          // The sibling subtree is incomplete.
+          elements.push_back({partial_root(level, n), Path::PATH_RIGHT});
+        }
+      }
+      return std::make_shared<Path>(
+        hashes[index], index, std::move(elements), as_of);
+    }
+
+    /// @brief Extracts a leaf hash from the tree
+    /// @param index Leaf index of the leaf to extract
+    /// @return The leaf hash
+    [[nodiscard]] const Hash& leaf(size_t index) const
+    {
+      if (index >= _num_leaves)
+      {
+        throw std::runtime_error("leaf index out of bounds");
+      }
+      return hashes[index];
+    }
+
+    /// @brief Number of leaves in the tree
+    [[nodiscard]] size_t num_leaves() const
+    {
+      return _num_leaves;
+    }
+
+    /// @brief Minimum leaf index
+    [[nodiscard]] size_t min_index() const
+    {
+      return 0;
+    }
+
+    /// @brief Maximum leaf index
+    [[nodiscard]] size_t max_index() const
+    {
+      return _num_leaves == 0 ? 0 : _num_leaves - 1;
+    }
+
+    /// @brief Indicates whether the tree is empty
+    [[nodiscard]] bool empty() const
+    {
+      return _num_leaves == 0;
+    }
+
+  protected:
+    /// @brief Number of levels of full subtrees, counting leaves as level 0
+    static constexpr size_t num_levels = std::bit_width(MAX_LEAVES);
+
+    /// @brief Maximum number of node hashes computed by one hash_batch() call
+    static constexpr size_t batch_size = 64;
+
+    /// @brief The positions of the levels in @p hashes; level l holds up to
+    /// MAX_LEAVES >> l full subtrees of height l.
+    static constexpr std::array<size_t, num_levels + 1> offsets = []() {
+      std::array<size_t, num_levels + 1> result = {};
+      for (size_t level = 0; level < num_levels; level++)
+      {
+        result[level + 1] = result[level] + (MAX_LEAVES >> level);
+      }
+      return result;
+    }();
+
+    /// @brief The number of leaves
+    size_t _num_leaves = 0;
+
+    /// @brief The number of leaves whose full subtrees are hashed
+    size_t num_hashed = 0;
+
+    /// @brief The leaves and the hashes of full subtrees, level by level
+    std::array<Hash, offsets[num_levels]> hashes;
+
+    /// @brief The hash of a full subtree
+    /// @param level The height of the subtree
+    /// @param index The index of the subtree among those of its height
+    Hash& node(size_t level, size_t index)
+    {
+      return hashes[offsets[level] + index];
+    }
+
+    /// @brief Hashes the full subtrees over leaves inserted since the last
+    /// call, level by level
+    void compute()
+    {
+      std::array<HashPairT<HASH_SIZE>, batch_size> pairs;
+      for (size_t level = 1; level < num_levels; level++)
+      {
+        const size_t end = _num_leaves >> level;
+        size_t i = num_hashed >> level;
+        while (i < end)
+        {
+          const size_t width = std::min(end - i, batch_size);
+          for (size_t j = 0; j < width; j++)
+          {
+            pairs[j] = {
+              &node(level - 1, 2 * (i + j)),
+              &node(level - 1, 2 * (i + j) + 1),
+              &node(level, i + j)};
+          }
+          hash_batch<HASH_SIZE, HASH_FUNCTION>(std::span(pairs.data(), width));
+          i += width;
+        }
+      }
+      num_hashed = _num_leaves;
+    }
+
+    /// @brief Computes the root of the incomplete subtree at the right edge
+    /// of a tree
+    /// @param level The height of the incomplete subtree
+    /// @param n The number of leaves of the tree
+    /// @return The hash of the leaves from (n >> level) << level to n
+    /// @note The subtree is made of the full subtrees whose heights are the
+    /// bits set in n below @p level.
+    Hash partial_root(uint8_t level, size_t n)
+    {
+      std::optional<Hash> result;
+      for (uint8_t l = 0; l < level; l++)
+      {
+        if (((n >> l) & 0x01) == 0U)
+        {
+          continue;
+        }
+        const Hash& h = node(l, (n >> l) - 1);
+        if (!result)
+        {
+          result = h;
+        }
+        else
+        {
+          detail::hash_node<HASH_SIZE, HASH_FUNCTION>(h, *result, *result);
+        }
+      }
+      assert(result);
+      return *result;
+    }
+  };
+
+  /// @brief Computes the root of the tree of a sequence of leaves
+  /// @tparam HASH_SIZE Size of each hash in number of bytes
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
+  /// @param leaves The leaf hashes
+  /// @param num_threads The maximum number of threads, including the calling
+  /// thread
+  /// @return The root hash, which is the same as the root of a TreeT with the
+  /// same leaves
+  /// @note This hashes the leaves level by level in full subtrees of up to
+  /// 64 leaves, like CompactRangeT::append(), without allocating tree nodes.
+  /// With more than one thread, the leaves are split into contiguous parts
+  /// that are hashed into compact ranges on separate threads and then
+  /// merged on the calling thread.
+  template <
+    size_t HASH_SIZE,
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
+  HashT<HASH_SIZE> merkle_tree_hash(
+    std::span<const HashT<HASH_SIZE>> leaves, size_t num_threads = 1)
+  {
+    using Range = CompactRangeT<HASH_SIZE, HASH_FUNCTION>;
+
+    if (leaves.empty())
+    {
+      throw std::runtime_error("empty tree does not have a root");
+    }
+
+    // Parts start at multiples of a large power of two, so that they are
+    // covered by few full subtrees.
+    constexpr size_t part_alignment = 4096;
+    num_threads = std::max<size_t>(num_threads, 1);
+    size_t part_size = (leaves.size() + num_threads - 1) / num_threads;
+    part_size =
+      (part_size + part_alignment - 1) / part_alignment * part_alignment;
+    const size_t num_parts = (leaves.size() + part_size - 1) / part_size;
+
+    if (num_parts < 2)
+    {
+      Range range;
+      range.append(leaves);
+      return range.root();
+    }
+
+    std::vector<Range> parts;
+    parts.reserve(num_parts);
+    for (size_t p = 0; p < num_parts; p++)
+    {
+      parts.emplace_back(p * part_size);
+    }
+    std::vector<std::exception_ptr> errors(num_parts);
+    auto work = [&](size_t p) {
+      try
+      {
+        const size_t begin = p * part_size;
+        parts[p].append(
+          leaves.subspan(begin, std::min(part_size, leaves.size() - begin)));
+      }
+      catch (...)
+      {
+        errors[p] = std::current_exception();
+      }
+    };
+
+    {
+      std::vector<std::jthread> threads;
+      threads.reserve(num_parts - 1);
+      for (size_t p = 1; p < num_parts; p++)
+      {
+        threads.emplace_back(work, p);
+      }
+      work(0);
+    }
+
+    for (const auto& error : errors)
+    {
+      if (error)
+      {
+        std::rethrow_exception(error);
+      }
+    }
+    for (size_t p = 1; p < num_parts; p++)
+    {
+      parts[0].merge(parts[p]);
+    }
+    return parts[0].root();
+  }
+
+  /// @brief Computes the roots of the trees of many sequences of leaves
+  /// @tparam HASH_SIZE Size of each hash in number of bytes
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
+  /// @param trees The leaf hashes of each tree
+  /// @return The root hash of each tree, the same as the root of a TreeT with
+  /// the same leaves
+  /// @note This hashes the trees level by level together, passing the nodes
+  /// of one level of all trees to one hash_batch() call, so that batch
+  /// kernels are kept busy also when each tree has only a few nodes per
+  /// level. An odd node at the end of a level is carried up to the next
+  /// level, which gives the same shape as TreeT.
+  template <
+    size_t HASH_SIZE,
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
+  std::vector<HashT<HASH_SIZE>> merkle_tree_hashes(
+    std::span<const std::span<const HashT<HASH_SIZE>>> trees)
+  {
+    using Hash = HashT<HASH_SIZE>;
+
+    // The level of each tree is hashed into its own part of `scratch`,
+    // in place after the leaves.
+    std::vector<size_t> first(trees.size());
+    std::vector<size_t> widths(trees.size());
+    std::vector<size_t> active;
+    size_t scratch_size = 0;
+    for (size_t t = 0; t < trees.size(); t++)
+    {
+      if (trees[t].empty())
+      {
+        throw std::runtime_error("empty tree does not have a root");
+      }
+      first[t] = scratch_size;
+      widths[t] = trees[t].size();
+      if (widths[t] > 1)
+      {
+        scratch_size += (widths[t] + 1) / 2;
+        active.push_back(t);
+      }
+    }
+
+    std::vector<Hash> scratch(scratch_size);
+    std::vector<HashPairT<HASH_SIZE>> pairs;
+    pairs.reserve(scratch_size);
+    bool leaves = true;
+    while (!active.empty())
+    {
+      auto input = [&](size_t t, size_t i) -> const Hash& {
+        return leaves ? trees[t][i] : scratch[first[t] + i];
+      };
+
+      pairs.clear();
+      for (size_t t : active)
+      {
+        for (size_t i = 0; i + 1 < widths[t]; i += 2)
+        {
+          pairs.push_back(
+            {&input(t, i), &input(t, i + 1), &scratch[first[t] + i / 2]});
+        }
+      }
+      hash_batch<HASH_SIZE, HASH_FUNCTION>(pairs);
+
+      for (size_t t : active)
+      {
+        if (widths[t] % 2 == 1)
+        {
+          scratch[first[t] + widths[t] / 2] = input(t, widths[t] - 1);
+        }
+        widths[t] = (widths[t] + 1) / 2;
+      }
+      std::erase_if(active, [&widths](size_t t) { return widths[t] == 1; });
+      leaves = false;
+    }
+
+    std::vector<Hash> roots;
+    roots.reserve(trees.size());
+    for (size_t t = 0; t < trees.size(); t++)
+    {
+      roots.push_back(trees[t].size() == 1 ? trees[t][0] : scratch[first[t]]);
+    }
+    return roots;
+  }
+
+  /// @brief Template for lock-free queues of leaves to append to a tree
+  /// @tparam HASH_SIZE Size of each hash in number of bytes
+  /// @tparam HASH_FUNCTION The hash function or hasher policy; see
+  /// NodeHasher
+  /// @note Many producer threads push leaves into a bounded ring and get
+  /// their leaf indices immediately, without waiting for a lock or for the
+  /// tree. The one thread that owns the tree moves the leaves that are ready
+  /// into it in order with drain(), between its other operations, such as
+  /// root() and path(). Producers only wait, with try_push() failing or
+  /// push() yielding, when the ring is full.
+  template <
+    size_t HASH_SIZE,
+    NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
+  class AppendQueueT
+  {
+  public:
+    /// @brief The type of hashes in the queue
+    using Hash = HashT<HASH_SIZE>;
+
+    /// @brief The type of trees the queue appends to
+    using Tree = TreeT<HASH_SIZE, HASH_FUNCTION>;
+
+    /// @brief Constructs an empty queue
+    /// @param capacity The number of leaves the ring holds, a power of two of
+    /// at least 2
+    /// @param first_index The leaf index of the first leaf pushed, usually
+    /// the number of leaves of the tree
+    /// @note After the queue is constructed, leaves must only be added to
+    /// the tree by drain().
+    AppendQueueT(size_t capacity, size_t first_index) :
+      mask(capacity_mask(capacity)),
+      first_index(first_index),
+      hashes(new Hash[capacity]),
+      sequences(new std::atomic<size_t>[capacity])
+    {
+      for (size_t i = 0; i < capacity; i++)
+      {
+        sequences[i].store(i, std::memory_order_relaxed);
+      }
+    }
+
+    AppendQueueT(const AppendQueueT&) = delete;
+    AppendQueueT& operator=(const AppendQueueT&) = delete;
+
+    /// @brief Pushes a leaf into the queue, if it is not full
+    /// @param hash The leaf hash
+    /// @return The leaf index of @p hash in the tree, or std::nullopt if the
+    /// queue is full
+    /// @note Thread-safe and lock-free.
+    std::optional<size_t> try_push(const Hash& hash)
+    {
+      size_t position = tail.load(std::memory_order_relaxed);
+      while (true)
+      {
+        // The sequence of a slot is its next position while it is free, and
+        // one more than that once a leaf is published in it.
+        const size_t sequence =
+          sequences[position & mask].load(std::memory_order_acquire);
+        const auto difference = static_cast<std::ptrdiff_t>(
+          sequence - position);
+        if (difference == 0)
+        {
+          if (tail.compare_exchange_weak(
+                position, position + 1, std::memory_order_relaxed))
+          {
+            break;
+          }
+        }
+        else if (difference < 0)
+        {
+          return std::nullopt;
+        }
+        else
+        {
+          position = tail.load(std::memory_order_relaxed);
+        }
+      }
+      hashes[position & mask] = hash;
+      sequences[position & mask].store(
+        position + 1, std::memory_order_release);
+      return first_index + position;
+    }
+
+    /// @brief Pushes a leaf into the queue, yielding while it is full
+    /// @param hash The leaf hash
+    /// @return The leaf index of @p hash in the tree
+    /// @note Thread-safe.
+    size_t push(const Hash& hash)
+    {
+      while (true)
+      {
+        if (auto index = try_push(hash))
+        {
+          return *index;
+        }
+        std::this_thread::yield();
+      }
+    }
+
+    /// @brief Moves the leaves at the front of the queue that are ready into
+    /// a tree
+    /// @param tree The tree, which must have first_index() plus the number of
+    /// drained leaves as its number of leaves
+    /// @param max_leaves The maximum number of leaves to move
+    /// @return The number of leaves moved
+    /// @note Only for the thread that owns @p tree. The leaves are inserted
+    /// in batches of contiguous slots of the ring; a leaf that is still being
+    /// written by its producer stops the drain until the next call.
+    size_t drain(
+      Tree& tree, size_t max_leaves = std::numeric_limits<size_t>::max())
+    {
+      if (tree.num_leaves() != first_index + head)
+      {
+        throw std::runtime_error("tree was modified outside of the queue");
+      }
+
+      size_t count = 0;
+      while (count < max_leaves &&
+             sequences[(head + count) & mask].load(
+               std::memory_order_acquire) == head + count + 1)
+      {
+        count++;
+      }
+
+      const size_t capacity = mask + 1;
+      size_t done = 0;
+      while (done < count)
+      {
+        const size_t slot = (head + done) & mask;
+        const size_t width = std::min(count - done, capacity - slot);
+        tree.insert(std::span<const Hash>(&hashes[slot], width));
+        for (size_t i = 0; i < width; i++)
+        {
+          sequences[slot + i].store(
+            head + done + i + capacity, std::memory_order_release);
+        }
+        done += width;
+      }
+      head += count;
+      return count;
+    }
+
+    /// @brief The leaf index of the first leaf pushed into the queue
+    [[nodiscard]] size_t first_leaf_index() const
+    {
+      return first_index;
+    }
+
+    /// @brief The number of leaves moved into the tree so far
+    /// @note Only for the thread that owns the tree.
+    [[nodiscard]] size_t num_drained() const
+    {
+      return head;
+    }
+
+  protected:
+    /// @brief The size of cache lines, to keep the positions of producers
+    /// and the consumer apart
+    static constexpr size_t cache_line_size = 64;
+
+    static size_t capacity_mask(size_t capacity)
+    {
+      // With one slot, the sequence number a producer waits for on the next
+      // lap equals the one the consumer waits for, so producers overwrite
+      // undrained leaves.
+      if (capacity < 2 || !std::has_single_bit(capacity))
+      {
+        throw std::runtime_error(
+          "queue capacity is not a power of two of at least 2");
+      }
+      return capacity - 1;
+    }
+
+    /// @brief The capacity of the ring minus one
+    const size_t mask;
+
+    /// @brief The leaf index of the first leaf
+    const size_t first_index;
+
+    /// @brief The leaf hashes, by position modulo the capacity
+    std::unique_ptr<Hash[]> hashes;
+
+    /// @brief The sequence numbers of the slots of @p hashes
+    std::unique_ptr<std::atomic<size_t>[]> sequences;
+
+    /// @brief The position of the next leaf to push
+    alignas(cache_line_size) std::atomic<size_t> tail = 0;
+
+    /// @brief The position of the next leaf to drain
+    alignas(cache_line_size) size_t head = 0;
+  };
+
+  namespace detail
+  {
+    // The SHA256 kernels and everything the kernel tables below refer to are
+    // inline rather than static inline, so that each has one definition in
+    // the program and all translation units share the same kernel selection.
+
+    inline std::array<uint32_t, 8> sha256_initial_state()
+    {
+      return {
+        0x6a09e667,
+        0xbb67ae85,
+        0x3c6ef372,
+        0xa54ff53a,
+        0x510e527f,
+        0x9b05688c,
+        0x1f83d9ab,
+        0x5be0cd19};
+    }
+
+    inline constexpr std::array<uint32_t, 64> sha256_constants = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    inline uint32_t sha256_load_word(const uint8_t* bytes)
+    {
+      return (static_cast<uint32_t>(bytes[0]) << 24) |
+        (static_cast<uint32_t>(bytes[1]) << 16) |
+        (static_cast<uint32_t>(bytes[2]) << 8) |
+        static_cast<uint32_t>(bytes[3]);
+    }
+
+    /// @brief Expands the first 16 message words in @p schedule to the round
+    /// inputs K[i] + W[i] of all 64 rounds
+    constexpr void sha256_expand_schedule(
+      std::array<uint32_t, 64>& schedule)
+    {
+      for (size_t i = 16; i < 64; ++i)
+      {
+        const uint32_t word15 = schedule[i - 15];
+        const uint32_t word2 = schedule[i - 2];
+        const uint32_t sigma0 = (word15 >> 7 | word15 << 25) ^
+          (word15 >> 18 | word15 << 14) ^ (word15 >> 3);
+        const uint32_t sigma1 = (word2 >> 17 | word2 << 15) ^
+          (word2 >> 19 | word2 << 13) ^ (word2 >> 10);
+        schedule[i] = schedule[i - 16] + sigma0 + schedule[i - 7] + sigma1;
+      }
+      for (size_t i = 0; i < 64; ++i)
+      {
+        schedule[i] += sha256_constants[i];
+      }
+    }
+
+    /// @brief Round inputs K[i] + W[i] of the padding block of a node hash
+    /// @details Node hashes always compress 64 bytes, so their second block is
+    /// the constant 0x80, zeros, bit length 512; its schedule never changes.
+    inline constexpr std::array<uint32_t, 64> sha256_padding_schedule = []() {
+      std::array<uint32_t, 64> schedule = {};
+      schedule[0] = 0x80000000;
+      schedule[15] = 512;
+      sha256_expand_schedule(schedule);
+      return schedule;
+    }();
+
+    /// @brief Runs the 64 SHA256 rounds on @p state
+    /// @param schedule Round inputs K[i] + W[i]
+    /// @param state Hash state, updated including the final feed-forward
+    inline void sha256_rounds(
+      const std::array<uint32_t, 64>& schedule, std::array<uint32_t, 8>& state)
+    {
+      auto working = state;
+      for (size_t i = 0; i < 64; ++i)
+      {
+        const uint32_t choice =
+          (working[4] & working[5]) ^ (~working[4] & working[6]);
+        const uint32_t majority = (working[0] & working[1]) ^
+          (working[0] & working[2]) ^ (working[1] & working[2]);
+        const uint32_t sigma0 = (working[0] >> 2 | working[0] << 30) ^
+          (working[0] >> 13 | working[0] << 19) ^
+          (working[0] >> 22 | working[0] << 10);
+        const uint32_t sigma1 = (working[4] >> 6 | working[4] << 26) ^
+          (working[4] >> 11 | working[4] << 21) ^
+          (working[4] >> 25 | working[4] << 7);
+        const uint32_t temporary1 =
+          working[7] + sigma1 + choice + schedule[i];
+        const uint32_t temporary2 = sigma0 + majority;
+
+        working[7] = working[6];
+        working[6] = working[5];
+        working[5] = working[4];
+        working[4] = working[3] + temporary1;
+        working[3] = working[2];
+        working[2] = working[1];
+        working[1] = working[0];
+        working[0] = temporary1 + temporary2;
+      }
+
+      for (size_t i = 0; i < state.size(); ++i)
+      {
+        state[i] += working[i];
+      }
+    }
+
+    inline void sha256_transform(
+      const uint8_t block[64], std::array<uint32_t, 8>& state)
+    {
+      std::array<uint32_t, 64> schedule = {};
+      for (size_t i = 0; i < 16; ++i)
+      {
+        schedule[i] = sha256_load_word(&block[i * 4]);
+      }
+      sha256_expand_schedule(schedule);
+      sha256_rounds(schedule, state);
+    }
+
+    inline void sha256_write_digest(
+      const std::array<uint32_t, 8>& state, HashT<32>& out)
+    {
+      for (size_t i = 0; i < state.size(); ++i)
+      {
+        out.bytes[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+        out.bytes[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+        out.bytes[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+        out.bytes[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+      }
+    }
+
+    /// @brief Computes a SHA256 node hash with the generic block transform
+    /// @p TRANSFORM
+    /// @details Hashes the 64-byte concatenation of @p l and @p r, followed by
+    /// the padding block of a 512-bit message, as two full block transforms.
+    /// The node hash kernels below compute the same hash with shortcuts.
+    template <void TRANSFORM(const uint8_t[64], std::array<uint32_t, 8>&)>
+    inline void sha256_node(
+      const HashT<32>& l, const HashT<32>& r, HashT<32>& out)
+    {
+      uint8_t block[32 * 2];
+      memcpy(&block[0], l.bytes, 32);
+      memcpy(&block[32], r.bytes, 32);
+
+      auto state = sha256_initial_state();
+      TRANSFORM(block, state);
+
+      uint8_t padding[64] = {0x80};
+      padding[62] = 0x02;
+      TRANSFORM(padding, state);
+      sha256_write_digest(state, out);
+    }
+
+    /// @brief Portable SHA256 node hash
+    /// @details Reads the message words straight from @p l and @p r and uses
+    /// the precomputed padding block schedule for the second compression.
+    inline void sha256_portable(
+      const HashT<32>& l, const HashT<32>& r, HashT<32>& out)
+    {
+      std::array<uint32_t, 64> schedule = {};
+      for (size_t i = 0; i < 8; ++i)
+      {
+        schedule[i] = sha256_load_word(&l.bytes[i * 4]);
+        schedule[i + 8] = sha256_load_word(&r.bytes[i * 4]);
+      }
+      sha256_expand_schedule(schedule);
+
+      auto state = sha256_initial_state();
+      sha256_rounds(schedule, state);
+      sha256_rounds(sha256_padding_schedule, state);
+      sha256_write_digest(state, out);
+    }
+
+    /// @brief CPU features relevant to the hash kernels
+    struct CpuFeatures
+    {
+      /// @brief SSSE3 byte shuffles
+      bool ssse3 = false;
+
+      /// @brief SSE4.1 blends
+      bool sse41 = false;
+
+      /// @brief SHA extensions (SHA-NI)
+      bool sha = false;
+
+      /// @brief AVX2, including operating system support for YMM state
+      bool avx2 = false;
+
+      /// @brief AVX-512 Foundation, including operating system support for
+      /// ZMM state
+      bool avx512f = false;
+    };
+
+#ifdef MERKLECPP_X86_64
+    inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+    {
+#  ifdef _MSC_VER
+      int r[4] = {};
+      __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+      for (size_t i = 0; i < 4; ++i)
+      {
+        regs[i] = static_cast<uint32_t>(r[i]);
+      }
+#  else
+      __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#  endif
+    }
+
+    /// @brief Reads the XCR0 register, which lists the register state saved by
+    /// the operating system
+    inline uint64_t xcr0()
+    {
+#  ifdef _MSC_VER
+      return _xgetbv(0);
+#  else
+      uint32_t eax = 0;
+      uint32_t edx = 0;
+      __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+      return (static_cast<uint64_t>(edx) << 32) | eax;
+#  endif
+    }
+#endif
+
+    /// @brief Probes the features of the executing CPU
+    inline CpuFeatures detect_cpu_features()
+    {
+      CpuFeatures r;
+#ifdef MERKLECPP_X86_64
+      uint32_t regs[4] = {};
+      cpuid(0, 0, regs);
+      const uint32_t max_leaf = regs[0];
+      bool ymm_state = false;
+      bool zmm_state = false;
+      if (max_leaf >= 1)
+      {
+        cpuid(1, 0, regs);
+        r.ssse3 = (regs[2] & (1U << 9)) != 0;
+        r.sse41 = (regs[2] & (1U << 19)) != 0;
+        if ((regs[2] & (1U << 27)) != 0)
+        {
+          const uint64_t xcr = xcr0();
+          ymm_state = (xcr & 0x06) == 0x06;
+          zmm_state = ymm_state && (xcr & 0xE0) == 0xE0;
+        }
+      }
+      if (max_leaf >= 7)
+      {
+        cpuid(7, 0, regs);
+        r.sha = (regs[1] & (1U << 29)) != 0;
+        r.avx2 = ymm_state && (regs[1] & (1U << 5)) != 0;
+        r.avx512f = zmm_state && (regs[1] & (1U << 16)) != 0;
+      }
+#endif
+      return r;
+    }
+
+    /// @brief Features of the executing CPU, probed once per process
+    inline const CpuFeatures& cpu_features()
+    {
+      static const CpuFeatures features = detect_cpu_features();
+      return features;
+    }
+
+#ifdef MERKLECPP_X86_64
+    /// @brief Performs four SHA256 rounds with SHA-NI
+    /// @param abef State words A, B, E and F
+    /// @param cdgh State words C, D, G and H
+    /// @param wk Round inputs K[i] + W[i] of the four rounds
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani_rounds(
+      __m128i& abef, __m128i& cdgh, __m128i wk)
+    {
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+    }
+
+    /// @brief Performs four SHA256 rounds with SHA-NI
+    /// @param abef State words A, B, E and F
+    /// @param cdgh State words C, D, G and H
+    /// @param words Message schedule words for the rounds
+    /// @param round Index of the first round
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani_rounds(
+      __m128i& abef, __m128i& cdgh, __m128i words, size_t round)
+    {
+      sha256_shani_rounds(
+        abef,
+        cdgh,
+        _mm_add_epi32(
+          words,
+          _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(&sha256_constants[round]))));
+    }
+
+    /// @brief Computes the next four message schedule words with SHA-NI
+    /// @note The arguments are the previous sixteen words, oldest first.
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline __m128i sha256_shani_schedule(
+      __m128i w0, __m128i w1, __m128i w2, __m128i w3)
+    {
+      return _mm_sha256msg2_epu32(
+        _mm_add_epi32(
+          _mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)),
+        w3);
+    }
+
+    /// @brief Byte shuffle between big-endian message bytes and 32-bit words
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline __m128i sha256_shani_byte_swap()
+    {
+      return _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    }
+
+    /// @brief Loads 16 big-endian message bytes as four 32-bit words
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline __m128i sha256_shani_load_words(const uint8_t* bytes)
+    {
+      return _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)),
+        sha256_shani_byte_swap());
+    }
+
+    /// @brief Converts a hash state to the ABEF/CDGH pairs used by the SHA-NI
+    /// round instructions
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani_load_state(
+      const std::array<uint32_t, 8>& state, __m128i& abef, __m128i& cdgh)
+    {
+      __m128i dcba =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+      cdgh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+      dcba = _mm_shuffle_epi32(dcba, 0xB1);
+      cdgh = _mm_shuffle_epi32(cdgh, 0x1B);
+      abef = _mm_alignr_epi8(dcba, cdgh, 8);
+      cdgh = _mm_blend_epi16(cdgh, dcba, 0xF0);
+    }
+
+    /// @brief Converts ABEF/CDGH pairs back to state words A-D and E-H
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani_state_words(
+      __m128i abef, __m128i cdgh, __m128i& abcd, __m128i& efgh)
+    {
+      const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+      const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+      abcd = _mm_blend_epi16(feba, dchg, 0xF0);
+      efgh = _mm_alignr_epi8(dchg, feba, 8);
+    }
+
+    /// @brief Compresses one message block with SHA-NI
+    /// @param abef State words A, B, E and F
+    /// @param cdgh State words C, D, G and H
+    /// @param w0 Message words 0-3
+    /// @param w1 Message words 4-7
+    /// @param w2 Message words 8-11
+    /// @param w3 Message words 12-15
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani_block(
+      __m128i& abef,
+      __m128i& cdgh,
+      __m128i w0,
+      __m128i w1,
+      __m128i w2,
+      __m128i w3)
+    {
+      const __m128i abef_in = abef;
+      const __m128i cdgh_in = cdgh;
+      sha256_shani_rounds(abef, cdgh, w0, 0);
+      sha256_shani_rounds(abef, cdgh, w1, 4);
+      sha256_shani_rounds(abef, cdgh, w2, 8);
+      sha256_shani_rounds(abef, cdgh, w3, 12);
+
+      for (size_t round = 16; round < 64; round += 16)
+      {
+        w0 = sha256_shani_schedule(w0, w1, w2, w3);
+        sha256_shani_rounds(abef, cdgh, w0, round);
+        w1 = sha256_shani_schedule(w1, w2, w3, w0);
+        sha256_shani_rounds(abef, cdgh, w1, round + 4);
+        w2 = sha256_shani_schedule(w2, w3, w0, w1);
+        sha256_shani_rounds(abef, cdgh, w2, round + 8);
+        w3 = sha256_shani_schedule(w3, w0, w1, w2);
+        sha256_shani_rounds(abef, cdgh, w3, round + 12);
+      }
+
+      abef = _mm_add_epi32(abef, abef_in);
+      cdgh = _mm_add_epi32(cdgh, cdgh_in);
+    }
+
+    /// @brief Compresses the padding block of a node hash with SHA-NI, using
+    /// the precomputed sha256_padding_schedule
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani_padding_block(__m128i& abef, __m128i& cdgh)
+    {
+      const __m128i abef_in = abef;
+      const __m128i cdgh_in = cdgh;
+      for (size_t round = 0; round < 64; round += 4)
+      {
+        sha256_shani_rounds(
+          abef,
+          cdgh,
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+            &sha256_padding_schedule[round])));
+      }
+      abef = _mm_add_epi32(abef, abef_in);
+      cdgh = _mm_add_epi32(cdgh, cdgh_in);
+    }
+
+    /// @brief SHA256 block transform using the SHA extensions (SHA-NI)
+    /// @note Bit-identical to sha256_transform(); only call this if
+    /// cpu_features() reports sha, ssse3 and sse41.
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_transform_shani(
+      const uint8_t block[64], std::array<uint32_t, 8>& state)
+    {
+      __m128i abef;
+      __m128i cdgh;
+      sha256_shani_load_state(state, abef, cdgh);
+      sha256_shani_block(
+        abef,
+        cdgh,
+        sha256_shani_load_words(&block[0]),
+        sha256_shani_load_words(&block[16]),
+        sha256_shani_load_words(&block[32]),
+        sha256_shani_load_words(&block[48]));
+
+      __m128i abcd;
+      __m128i efgh;
+      sha256_shani_state_words(abef, cdgh, abcd, efgh);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), abcd);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), efgh);
+    }
+
+    /// @brief SHA256 node hash using the SHA extensions (SHA-NI)
+    /// @details Reads the message words straight from @p l and @p r and uses
+    /// the precomputed padding block schedule for the second compression.
+    /// @note Only call this if has_sha256_shani() is true.
+    MERKLECPP_TARGET("sha,sse4.1")
+    inline void sha256_shani(
+      const HashT<32>& l, const HashT<32>& r, HashT<32>& out)
+    {
+      __m128i abef;
+      __m128i cdgh;
+      sha256_shani_load_state(sha256_initial_state(), abef, cdgh);
+      sha256_shani_block(
+        abef,
+        cdgh,
+        sha256_shani_load_words(&l.bytes[0]),
+        sha256_shani_load_words(&l.bytes[16]),
+        sha256_shani_load_words(&r.bytes[0]),
+        sha256_shani_load_words(&r.bytes[16]));
+      sha256_shani_padding_block(abef, cdgh);
+
+      __m128i abcd;
+      __m128i efgh;
+      sha256_shani_state_words(abef, cdgh, abcd, efgh);
+      const __m128i byte_swap = sha256_shani_byte_swap();
+      _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(&out.bytes[0]),
+        _mm_shuffle_epi8(abcd, byte_swap));
+      _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(&out.bytes[16]),
+        _mm_shuffle_epi8(efgh, byte_swap));
+    }
+
+    /// @brief Rotates each 32-bit lane of @p x right by @p n bits
+    MERKLECPP_TARGET("avx2")
+    inline __m256i sha256_avx2_rotr(__m256i x, int n)
+    {
+      return _mm256_or_si256(
+        _mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+    }
+
+    /// @brief Transposes an 8x8 matrix of 32-bit words held in @p rows
+    MERKLECPP_TARGET("avx2")
+    inline void sha256_avx2_transpose(__m256i rows[8])
+    {
+      const __m256i t0 = _mm256_unpacklo_epi32(rows[0], rows[1]);
+      const __m256i t1 = _mm256_unpackhi_epi32(rows[0], rows[1]);
+      const __m256i t2 = _mm256_unpacklo_epi32(rows[2], rows[3]);
+      const __m256i t3 = _mm256_unpackhi_epi32(rows[2], rows[3]);
+      const __m256i t4 = _mm256_unpacklo_epi32(rows[4], rows[5]);
+      const __m256i t5 = _mm256_unpackhi_epi32(rows[4], rows[5]);
+      const __m256i t6 = _mm256_unpacklo_epi32(rows[6], rows[7]);
+      const __m256i t7 = _mm256_unpackhi_epi32(rows[6], rows[7]);
+      const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+      const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+      const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+      const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+      const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+      const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+      const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+      const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+      rows[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+      rows[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+      rows[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+      rows[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+      rows[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+      rows[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+      rows[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+      rows[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+
+    /// @brief SHA256 block transform of eight independent messages
+    /// @tparam PADDING Compress the padding block of a node hash, using
+    /// sha256_padding_schedule instead of @p block
+    /// @param block Message words; lane i of block[t] is word t of message i
+    /// @param state Hash state; lane i of state[t] is word t of message i
+    template <bool PADDING = false>
+    MERKLECPP_TARGET("avx2")
+    inline void sha256_avx2_transform(
+      const __m256i block[16], __m256i state[8])
+    {
+      __m256i w[16];
+      if constexpr (!PADDING)
+      {
+        std::copy(block, block + 16, w);
+      }
+      __m256i a = state[0];
+      __m256i b = state[1];
+      __m256i c = state[2];
+      __m256i d = state[3];
+      __m256i e = state[4];
+      __m256i f = state[5];
+      __m256i g = state[6];
+      __m256i h = state[7];
+      for (size_t i = 0; i < 64; ++i)
+      {
+        __m256i kw;
+        if constexpr (PADDING)
+        {
+          kw = _mm256_set1_epi32(
+            static_cast<int>(sha256_padding_schedule[i]));
+        }
+        else
+        {
+          if (i >= 16)
+          {
+            const __m256i w15 = w[(i + 1) & 15];
+            const __m256i w2 = w[(i + 14) & 15];
+            const __m256i sigma0 = _mm256_xor_si256(
+              _mm256_xor_si256(
+                sha256_avx2_rotr(w15, 7), sha256_avx2_rotr(w15, 18)),
+              _mm256_srli_epi32(w15, 3));
+            const __m256i sigma1 = _mm256_xor_si256(
+              _mm256_xor_si256(
+                sha256_avx2_rotr(w2, 17), sha256_avx2_rotr(w2, 19)),
+              _mm256_srli_epi32(w2, 10));
+            w[i & 15] = _mm256_add_epi32(
+              _mm256_add_epi32(w[i & 15], sigma0),
+              _mm256_add_epi32(w[(i + 9) & 15], sigma1));
+          }
+          kw = _mm256_add_epi32(
+            w[i & 15],
+            _mm256_set1_epi32(static_cast<int>(sha256_constants[i])));
+        }
+        const __m256i choice =
+          _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        const __m256i majority = _mm256_xor_si256(
+          _mm256_and_si256(a, _mm256_xor_si256(b, c)), _mm256_and_si256(b, c));
+        const __m256i sigma0 = _mm256_xor_si256(
+          _mm256_xor_si256(sha256_avx2_rotr(a, 2), sha256_avx2_rotr(a, 13)),
+          sha256_avx2_rotr(a, 22));
+        const __m256i sigma1 = _mm256_xor_si256(
+          _mm256_xor_si256(sha256_avx2_rotr(e, 6), sha256_avx2_rotr(e, 11)),
+          sha256_avx2_rotr(e, 25));
+        const __m256i temporary1 = _mm256_add_epi32(
+          _mm256_add_epi32(h, sigma1), _mm256_add_epi32(choice, kw));
+        const __m256i temporary2 = _mm256_add_epi32(sigma0, majority);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, temporary1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(temporary1, temporary2);
+      }
+      state[0] = _mm256_add_epi32(state[0], a);
+      state[1] = _mm256_add_epi32(state[1], b);
+      state[2] = _mm256_add_epi32(state[2], c);
+      state[3] = _mm256_add_epi32(state[3], d);
+      state[4] = _mm256_add_epi32(state[4], e);
+      state[5] = _mm256_add_epi32(state[5], f);
+      state[6] = _mm256_add_epi32(state[6], g);
+      state[7] = _mm256_add_epi32(state[7], h);
+    }
+
+    /// @brief SHA256 node hashes of eight pairs using AVX2
+    /// @param pairs The first of eight consecutive pairs to hash
+    /// @note All inputs are read before any output is written. Only call this
+    /// if has_sha256_avx2() is true.
+    MERKLECPP_TARGET("avx2")
+    inline void sha256_avx2(const HashPairT<32>* pairs)
+    {
+      const __m256i byte_swap = _mm256_set_epi64x(
+        0x0c0d0e0f08090a0bLL,
+        0x0405060700010203LL,
+        0x0c0d0e0f08090a0bLL,
+        0x0405060700010203LL);
+      __m256i block[16];
+      for (size_t i = 0; i < 8; ++i)
+      {
+        block[i] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(pairs[i].l->bytes));
+        block[i + 8] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(pairs[i].r->bytes));
+      }
+      sha256_avx2_transpose(block);
+      sha256_avx2_transpose(block + 8);
+      for (auto& word : block)
+      {
+        word = _mm256_shuffle_epi8(word, byte_swap);
+      }
+
+      const auto initial = sha256_initial_state();
+      __m256i state[8];
+      for (size_t i = 0; i < 8; ++i)
+      {
+        state[i] = _mm256_set1_epi32(static_cast<int>(initial[i]));
+      }
+      sha256_avx2_transform(block, state);
+
+      sha256_avx2_transform<true>(nullptr, state);
+
+      sha256_avx2_transpose(state);
+      for (size_t i = 0; i < 8; ++i)
+      {
+        _mm256_storeu_si256(
+          reinterpret_cast<__m256i*>(pairs[i].out->bytes),
+          _mm256_shuffle_epi8(state[i], byte_swap));
+      }
+    }
+
+// GCC's AVX-512 intrinsics start from deliberately undefined vectors, which
+// -Wuninitialized reports wherever they are inlined.
+#if defined(__GNUC__) && !defined(__clang__)
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wuninitialized"
+#  pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+    /// @brief SHA256 block transform of sixteen independent messages
+    /// @tparam PADDING Compress the padding block of a node hash, using
+    /// sha256_padding_schedule instead of @p block
+    /// @param block Message words; lane i of block[t] is word t of message i
+    /// @param state Hash state; lane i of state[t] is word t of message i
+    template <bool PADDING = false>
+    MERKLECPP_TARGET("avx512f")
+    inline void sha256_avx512_transform(
+      const __m512i block[16], __m512i state[8])
+    {
+      __m512i w[16];
+      if constexpr (!PADDING)
+      {
+        std::copy(block, block + 16, w);
+      }
+      __m512i a = state[0];
+      __m512i b = state[1];
+      __m512i c = state[2];
+      __m512i d = state[3];
+      __m512i e = state[4];
+      __m512i f = state[5];
+      __m512i g = state[6];
+      __m512i h = state[7];
+      for (size_t i = 0; i < 64; ++i)
+      {
+        __m512i kw;
+        if constexpr (PADDING)
+        {
+          kw = _mm512_set1_epi32(
+            static_cast<int>(sha256_padding_schedule[i]));
+        }
+        else
+        {
+          if (i >= 16)
+          {
+            const __m512i w15 = w[(i + 1) & 15];
+            const __m512i w2 = w[(i + 14) & 15];
+            const __m512i sigma0 = _mm512_ternarylogic_epi32(
+              _mm512_ror_epi32(w15, 7),
+              _mm512_ror_epi32(w15, 18),
+              _mm512_srli_epi32(w15, 3),
+              0x96);
+            const __m512i sigma1 = _mm512_ternarylogic_epi32(
+              _mm512_ror_epi32(w2, 17),
+              _mm512_ror_epi32(w2, 19),
+              _mm512_srli_epi32(w2, 10),
+              0x96);
+            w[i & 15] = _mm512_add_epi32(
+              _mm512_add_epi32(w[i & 15], sigma0),
+              _mm512_add_epi32(w[(i + 9) & 15], sigma1));
+          }
+          kw = _mm512_add_epi32(
+            w[i & 15],
+            _mm512_set1_epi32(static_cast<int>(sha256_constants[i])));
+        }
+        const __m512i choice = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+        const __m512i majority = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+        const __m512i sigma0 = _mm512_ternarylogic_epi32(
+          _mm512_ror_epi32(a, 2),
+          _mm512_ror_epi32(a, 13),
+          _mm512_ror_epi32(a, 22),
+          0x96);
+        const __m512i sigma1 = _mm512_ternarylogic_epi32(
+          _mm512_ror_epi32(e, 6),
+          _mm512_ror_epi32(e, 11),
+          _mm512_ror_epi32(e, 25),
+          0x96);
+        const __m512i temporary1 = _mm512_add_epi32(
+          _mm512_add_epi32(h, sigma1), _mm512_add_epi32(choice, kw));
+        const __m512i temporary2 = _mm512_add_epi32(sigma0, majority);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm512_add_epi32(d, temporary1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm512_add_epi32(temporary1, temporary2);
+      }
+      state[0] = _mm512_add_epi32(state[0], a);
+      state[1] = _mm512_add_epi32(state[1], b);
+      state[2] = _mm512_add_epi32(state[2], c);
+      state[3] = _mm512_add_epi32(state[3], d);
+      state[4] = _mm512_add_epi32(state[4], e);
+      state[5] = _mm512_add_epi32(state[5], f);
+      state[6] = _mm512_add_epi32(state[6], g);
+      state[7] = _mm512_add_epi32(state[7], h);
+    }
+
+    /// @brief SHA256 node hashes of sixteen pairs using AVX-512
+    /// @param pairs The first of sixteen consecutive pairs to hash
+    /// @note All inputs are read before any output is written. Only call this
+    /// if has_sha256_avx512() is true.
+    MERKLECPP_TARGET("avx512f,avx2")
+    inline void sha256_avx512(const HashPairT<32>* pairs)
+    {
+      __m256i lo[16];
+      __m256i hi[16];
+      for (size_t i = 0; i < 8; ++i)
+      {
+        lo[i] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(pairs[i].l->bytes));
+        lo[i + 8] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(pairs[i].r->bytes));
+        hi[i] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(pairs[i + 8].l->bytes));
+        hi[i + 8] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(pairs[i + 8].r->bytes));
+      }
+      sha256_avx2_transpose(lo);
+      sha256_avx2_transpose(lo + 8);
+      sha256_avx2_transpose(hi);
+      sha256_avx2_transpose(hi + 8);
+
+      const __m256i byte_swap = _mm256_set_epi64x(
+        0x0c0d0e0f08090a0bLL,
+        0x0405060700010203LL,
+        0x0c0d0e0f08090a0bLL,
+        0x0405060700010203LL);
+      __m512i block[16];
+      for (size_t i = 0; i < 16; ++i)
+      {
+        block[i] = _mm512_inserti64x4(
+          _mm512_castsi256_si512(_mm256_shuffle_epi8(lo[i], byte_swap)),
+          _mm256_shuffle_epi8(hi[i], byte_swap),
+          1);
+      }
+
+      const auto initial = sha256_initial_state();
+      __m512i state[8];
+      for (size_t i = 0; i < 8; ++i)
+      {
+        state[i] = _mm512_set1_epi32(static_cast<int>(initial[i]));
+      }
+      sha256_avx512_transform(block, state);
+
+      sha256_avx512_transform<true>(nullptr, state);
+
+      for (size_t i = 0; i < 8; ++i)
+      {
+        lo[i] = _mm512_castsi512_si256(state[i]);
+        hi[i] = _mm512_extracti64x4_epi64(state[i], 1);
+      }
+      sha256_avx2_transpose(lo);
+      sha256_avx2_transpose(hi);
+      for (size_t i = 0; i < 8; ++i)
+      {
+        _mm256_storeu_si256(
+          reinterpret_cast<__m256i*>(pairs[i].out->bytes),
+          _mm256_shuffle_epi8(lo[i], byte_swap));
+        _mm256_storeu_si256(
+          reinterpret_cast<__m256i*>(pairs[i + 8].out->bytes),
+          _mm256_shuffle_epi8(hi[i], byte_swap));
+      }
+    }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#  pragma GCC diagnostic pop
+#endif
+#endif
+
+    /// @brief Indicates whether the SHA-NI node hash can run on this CPU
+    inline bool has_sha256_shani()
+    {
+#ifdef MERKLECPP_X86_64
+      const CpuFeatures& features = cpu_features();
+      return features.sha && features.ssse3 && features.sse41;
+#else
+      return false;
+#endif
+    }
+
+    /// @brief Indicates whether the AVX2 multi-buffer node hash can run on
+    /// this CPU
+    inline bool has_sha256_avx2()
+    {
+#ifdef MERKLECPP_X86_64
+      return cpu_features().avx2;
+#else
+      return false;
+#endif
+    }
+
+    /// @brief Indicates whether the AVX-512 multi-buffer node hash can run on
+    /// this CPU
+    inline bool has_sha256_avx512()
+    {
+#ifdef MERKLECPP_X86_64
+      const CpuFeatures& features = cpu_features();
+      return features.avx512f && features.avx2;
+#else
+      return false;
+#endif
+    }
+  }
+
+  /// @brief SHA256 kernels used by sha256() and sha256_batch()
+  enum class Sha256Kernel
+  {
+    /// @brief Portable C++ implementation
+    portable,
+
+    /// @brief SHA extensions (SHA-NI), one node hash at a time
+    shani,
+
+    /// @brief AVX2 multi-buffer, 8 node hashes at a time
+    avx2,
+
+    /// @brief AVX-512 multi-buffer, 16 node hashes at a time
+    avx512
+  };
+
+  /// @brief Name of a SHA256 kernel
+  /// @param kernel The kernel
+  static inline const char* sha256_kernel_name(Sha256Kernel kernel)
+  {
+    switch (kernel)
+    {
+      case Sha256Kernel::portable:
+        return "portable";
+      case Sha256Kernel::shani:
+        return "SHA-NI";
+      case Sha256Kernel::avx2:
+        return "AVX2";
+      case Sha256Kernel::avx512:
+        return "AVX-512";
+    }
+    return "unknown";
+  }
+
+  namespace detail
+  {
+    /// @brief Hashes a prefix of a batch with a multi-buffer kernel
+    /// @return The number of pairs hashed
+    using Sha256BatchFunction = size_t (*)(std::span<const HashPairT<32>>);
+
+    /// @brief The functions installed for one SHA256 kernel
+    struct Sha256Dispatch
+    {
+      /// @brief The kernel
+      Sha256Kernel kernel = Sha256Kernel::portable;
+
+      /// @brief Single node hash function
+      void (*node)(const HashT<32>&, const HashT<32>&, HashT<32>&) =
+        sha256_portable;
+
+      /// @brief Multi-buffer batch function, if any
+      Sha256BatchFunction batch = nullptr;
+    };
+
+#ifdef MERKLECPP_X86_64
+    inline size_t sha256_avx2_batch(std::span<const HashPairT<32>> pairs)
+    {
+      size_t i = 0;
+      for (; pairs.size() - i >= 8; i += 8)
+      {
+        sha256_avx2(&pairs[i]);
+      }
+      return i;
+    }
+
+    inline size_t sha256_avx512_batch(
+      std::span<const HashPairT<32>> pairs)
+    {
+      size_t i = 0;
+      for (; pairs.size() - i >= 16; i += 16)
+      {
+        sha256_avx512(&pairs[i]);
+      }
+      return i + sha256_avx2_batch(pairs.subspan(i));
+    }
+#endif
+
+    /// @brief Indicates whether the CPU supports a SHA256 kernel
+    inline bool sha256_kernel_cpu_support(Sha256Kernel kernel)
+    {
+      switch (kernel)
+      {
+        case Sha256Kernel::portable:
+          return true;
+        case Sha256Kernel::shani:
+          return has_sha256_shani();
+        case Sha256Kernel::avx2:
+          return has_sha256_avx2();
+        case Sha256Kernel::avx512:
+          return has_sha256_avx512();
+      }
+      return false;
+    }
+
+    /// @brief Builds the dispatch entry for a kernel the CPU supports
+    /// @note Multi-buffer kernels hash leftover pairs with SHA-NI if the CPU
+    /// has it.
+    inline Sha256Dispatch make_sha256_dispatch(Sha256Kernel kernel)
+    {
+      Sha256Dispatch r;
+      r.kernel = kernel;
+#ifdef MERKLECPP_X86_64
+      if (kernel != Sha256Kernel::portable && has_sha256_shani())
+      {
+        r.node = sha256_shani;
+      }
+      if (kernel == Sha256Kernel::avx2)
+      {
+        r.batch = sha256_avx2_batch;
+      }
+      else if (kernel == Sha256Kernel::avx512)
+      {
+        r.batch = sha256_avx512_batch;
+      }
+#endif
+      return r;
+    }
+
+    /// @brief Known-answer self-test of a SHA256 kernel
+    /// @details Checks the SHA256 of 64 zero bytes, then compares a batch that
+    /// exercises every multi-buffer width and the leftover path against the
+    /// portable implementation.
+    inline bool sha256_self_test(const Sha256Dispatch& dispatch)
+    {
+      static constexpr std::array<uint8_t, 32> zero_zero = {
+        0xf5, 0xa5, 0xfd, 0x42, 0xd1, 0x6a, 0x20, 0x30, 0x27, 0x98, 0xef,
+        0x6e, 0xd3, 0x09, 0x97, 0x9b, 0x43, 0x00, 0x3d, 0x23, 0x20, 0xd9,
+        0xf0, 0xe8, 0xea, 0x98, 0x31, 0xa9, 0x27, 0x59, 0xfb, 0x4b};
+
+      const HashT<32> zero;
+      HashT<32> digest;
+      dispatch.node(zero, zero, digest);
+      if (digest != HashT<32>(zero_zero.data()))
+      {
+        return false;
+      }
+
+      constexpr size_t n = 16 + 8 + 3;
+      std::vector<HashT<32>> inputs(2 * n);
+      std::vector<HashT<32>> expected(n);
+      std::vector<HashT<32>> actual(n);
+      std::vector<HashPairT<32>> pairs(n);
+      for (size_t i = 0; i < n; i++)
+      {
+        for (size_t j = 0; j < 32; j++)
+        {
+          inputs[2 * i].bytes[j] = static_cast<uint8_t>(i * 37 + j);
+          inputs[2 * i + 1].bytes[j] = static_cast<uint8_t>(i * 11 + j * 5);
+        }
+        sha256_portable(inputs[2 * i], inputs[2 * i + 1], expected[i]);
+        pairs[i] = {&inputs[2 * i], &inputs[2 * i + 1], &actual[i]};
+      }
+      size_t i = dispatch.batch != nullptr ? dispatch.batch(pairs) : 0;
+      for (; i < n; i++)
+      {
+        dispatch.node(*pairs[i].l, *pairs[i].r, *pairs[i].out);
+      }
+      return actual == expected;
+    }
+
+    /// @brief Time a SHA256 kernel takes to hash a short batch
+    /// @details Takes the best of a few rounds, so that the first round warms
+    /// up the kernel and a single preemption does not decide the ranking.
+    inline std::chrono::nanoseconds sha256_probe(const Sha256Dispatch& dispatch)
+    {
+      constexpr size_t n = 256;
+      std::vector<HashT<32>> inputs(2 * n);
+      std::vector<HashT<32>> outputs(n);
+      std::vector<HashPairT<32>> pairs(n);
+      for (size_t i = 0; i < n; i++)
+      {
+        inputs[2 * i].bytes[0] = static_cast<uint8_t>(i);
+        pairs[i] = {&inputs[2 * i], &inputs[2 * i + 1], &outputs[i]};
+      }
+
+      auto best = std::chrono::nanoseconds::max();
+      for (size_t round = 0; round < 4; round++)
+      {
+        const auto start = std::chrono::steady_clock::now();
+        size_t i = dispatch.batch != nullptr ? dispatch.batch(pairs) : 0;
+        for (; i < n; i++)
+        {
+          dispatch.node(*pairs[i].l, *pairs[i].r, *pairs[i].out);
+        }
+        best = std::min(
+          best,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start));
+      }
+      return best;
+    }
+
+    /// @brief Dispatch entries of all kernels, with their availability
+    /// @details Probes the CPU, self-tests each supported kernel and times
+    /// the ones that pass, once per process. Which kernel is fastest depends
+    /// on the microarchitecture; for example, SHA-NI beats the AVX2 kernel on
+    /// CPUs that have both.
+    struct Sha256Kernels
+    {
+      std::array<Sha256Dispatch, 4> dispatch;
+      std::array<bool, 4> available = {};
+      Sha256Kernel best = Sha256Kernel::portable;
+
+      Sha256Kernels()
+      {
+        auto best_time = std::chrono::nanoseconds::max();
+        for (size_t i = 0; i < dispatch.size(); i++)
+        {
+          const auto kernel = static_cast<Sha256Kernel>(i);
+          dispatch[i] = make_sha256_dispatch(kernel);
+          available[i] = sha256_kernel_cpu_support(kernel) &&
+            sha256_self_test(dispatch[i]);
+          if (available[i])
+          {
+            const auto time = sha256_probe(dispatch[i]);
+            if (time < best_time)
+            {
+              best_time = time;
+              best = kernel;
+            }
+          }
+        }
+      }
+    };
+
+    inline const Sha256Kernels& sha256_kernels()
+    {
+      static const Sha256Kernels kernels;
+      return kernels;
+    }
+
+    /// @brief The fastest available kernel
+    inline Sha256Kernel sha256_best_kernel()
+    {
+      return sha256_kernels().best;
+    }
+
+    inline std::atomic<const Sha256Dispatch*>& sha256_active_dispatch()
+    {
+      static std::atomic<const Sha256Dispatch*> active{
+        &sha256_kernels().dispatch[static_cast<size_t>(sha256_best_kernel())]};
+      return active;
+    }
+
+    /// @brief The dispatch entry used by sha256() and sha256_batch()
+    inline const Sha256Dispatch& sha256_dispatch()
+    {
+      return *sha256_active_dispatch().load(std::memory_order_relaxed);
+    }
+  }
+
+  /// @brief Indicates whether a SHA256 kernel can be used on this CPU
+  /// @param kernel The kernel
+  /// @return True if the CPU supports @p kernel and it passed its self-test
+  static inline bool sha256_kernel_available(Sha256Kernel kernel)
+  {
+    return detail::sha256_kernels().available[static_cast<size_t>(kernel)];
+  }
+
+  /// @brief The fastest SHA256 kernel available on this CPU
+  /// @note This is the kernel selected by default. It is chosen by timing
+  /// each available kernel on a short batch once per process.
+  static inline Sha256Kernel sha256_best_kernel()
+  {
+    return detail::sha256_best_kernel();
+  }
+
+  /// @brief The SHA256 kernel currently used by sha256() and sha256_batch()
+  static inline Sha256Kernel sha256_kernel()
+  {
+    return detail::sha256_dispatch().kernel;
+  }
+
+  /// @brief Selects the SHA256 kernel used by sha256() and sha256_batch()
+  /// @param kernel The kernel
+  /// @details The selection applies process-wide, for example to compare
+  /// kernels in benchmarks. All kernels produce identical hashes.
+  /// @throws std::runtime_error if @p kernel is not available on this CPU
+  static inline void set_sha256_kernel(Sha256Kernel kernel)
+  {
+    if (!sha256_kernel_available(kernel))
+    {
+      throw std::runtime_error(std::format(
+        "SHA256 kernel {} not available", sha256_kernel_name(kernel)));
+    }
+    detail::sha256_active_dispatch().store(
+      &detail::sha256_kernels().dispatch[static_cast<size_t>(kernel)],
+      std::memory_order_relaxed);
+  }
+
+  /// @brief Built-in SHA256 function for tree node hashes
+  /// @param l Left node hash
+  /// @param r Right node hash
+  /// @param out Output node hash
+  /// @details Computes SHA256 over the 64-byte concatenation of @p l and @p r,
+  /// including standard SHA256 message padding. Uses the kernel selected by
+  /// set_sha256_kernel(), by default the fastest one that passed its
+  /// self-test on this CPU; all kernels produce identical hashes.
+  static inline void sha256(
+    const HashT<32>& l, const HashT<32>& r, HashT<32>& out)
+  {
+    detail::sha256_dispatch().node(l, r, out);
+  }
+
+  /// @brief Built-in SHA256 function for batches of tree node hashes
+  /// @param pairs The node hashes to compute
+  /// @details Computes the same hashes as sha256() for each pair. With the
+  /// AVX-512 or AVX2 kernels, independent pairs are hashed 16 or 8 at a time;
+  /// the remainder goes through the single node hash.
+  static inline void sha256_batch(std::span<const HashPairT<32>> pairs)
+  {
+    const auto& dispatch = detail::sha256_dispatch();
+    size_t i = dispatch.batch != nullptr ? dispatch.batch(pairs) : 0;
+    for (; i < pairs.size(); i++)
+    {
+      dispatch.node(*pairs[i].l, *pairs[i].r, *pairs[i].out);
+    }
+  }
+
+  /// @brief Hasher policy for the built-in SHA256 function, with batches
+  /// computed by sha256_batch()
+  /// @details Computes the same hashes as passing sha256 itself.
+  struct Sha256Hasher
+  {
+    static void hash(const HashT<32>& l, const HashT<32>& r, HashT<32>& out)
     {
-      MERKLECPP_TRACE(
-        MERKLECPP_TOUT << " - insert_leaf "
-                       << n->hash.to_string(TRACE_HASH_SIZE) << std::endl;);
-      leaf_nodes.push_back(n);
-      if (insertion_stack.empty() && !root)
-      {
-        root = n;
-      }
-      else
-      {
-        continue_insertion_stack(root, n);
-        root = process_insertion_stack(false);
-      }
+      sha256(l, r, out);
     }
 
-    /// @brief Inserts multiple new leaves into the tree
-    /// @param complete Indicates whether the insertion stack should be
-    /// processed to completion after insertion
-    void insert_leaves(bool complete = false)
+    static void hash_batch(std::span<const HashPairT<32>> pairs)
     {
-      if (!uninserted_leaf_nodes.empty())
-      {
-        MERKLECPP_TRACE(
-          MERKLECPP_TOUT << "* insert_leaves " << leaf_nodes.size() << " +"
-                         << uninserted_leaf_nodes.size() << std::endl;);
-        // Potential future improvement: make this go fast when there are many
-        // leaves to insert.
-        for (auto& n : uninserted_leaf_nodes)
-        {
-          insert_leaf(_root, n);
-        }
-        uninserted_leaf_nodes.clear();
-      }
-      if (complete && !insertion_stack.empty())
-      {
-        _root = process_insertion_stack();
-      }
+      sha256_batch(pairs);
     }
   };
 
   namespace detail
   {
-    static inline std::array<uint32_t, 8> sha256_initial_state()
+    static inline std::array<uint64_t, 8> sha384_initial_state()
     {
       return {
-        0x6a09e667,
-        0xbb67ae85,
-        0x3c6ef372,
-        0xa54ff53a,
-        0x510e527f,
-        0x9b05688c,
-        0x1f83d9ab,
-        0x5be0cd19};
+        0xcbbb9d5dc1059ed8,
+        0x629a292a367cd507,
+        0x9159015a3070dd17,
+        0x152fecd8f70e5939,
+        0x67332667ffc00b31,
+        0x8eb44a8768581511,
+        0xdb0c2e0d64f98fa7,
+        0x47b5481dbefa4fa4};
     }
 
-    static inline void sha256_transform(
-      const uint8_t block[64], std::array<uint32_t, 8>& state)
+    static inline std::array<uint64_t, 8> sha512_initial_state()
     {
-      static constexpr std::array<uint32_t, 64> constants = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
-        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
-        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
-        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
-        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
-        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
-        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
-        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
-        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+      return {
+        0x6a09e667f3bcc908,
+        0xbb67ae8584caa73b,
+        0x3c6ef372fe94f82b,
+        0xa54ff53a5f1d36f1,
+        0x510e527fade682d1,
+        0x9b05688c2b3e6c1f,
+        0x1f83d9abfb41bd6b,
+        0x5be0cd19137e2179};
+    }
 
-      std::array<uint32_t, 64> schedule = {};
-      for (size_t i = 0; i < 16; ++i)
+    static constexpr std::array<uint64_t, 80> sha512_constants = {
+      0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f,
+      0xe9b5dba58189dbbc, 0x3956c25bf348b538, 0x59f111f1b605d019,
+      0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242,
+      0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+      0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235,
+      0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3,
+      0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 0x2de92c6f592b0275,
+      0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+      0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f,
+      0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+      0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc,
+      0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+      0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6,
+      0x92722c851482353b, 0xa2bfe8a14cf10364, 0xa81a664bbc423001,
+      0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218,
+      0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+      0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99,
+      0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb,
+      0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc,
+      0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+      0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915,
+      0xc67178f2e372532b, 0xca273eceea26619c, 0xd186b8c721c0c207,
+      0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba,
+      0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+      0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc,
+      0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a,
+      0x5fcb6fab3ad6faec, 0x6c44198c4a475817};
+
+    static inline uint64_t sha512_load_word(const uint8_t* bytes)
+    {
+      uint64_t r = 0;
+      for (size_t i = 0; i < 8; ++i)
       {
-        const size_t offset = i * 4;
-        schedule[i] = (static_cast<uint32_t>(block[offset]) << 24) |
-          (static_cast<uint32_t>(block[offset + 1]) << 16) |
-          (static_cast<uint32_t>(block[offset + 2]) << 8) |
-          static_cast<uint32_t>(block[offset + 3]);
+        r = (r << 8) | bytes[i];
       }
+      return r;
+    }
 
-      for (size_t i = 16; i < 64; ++i)
+    static constexpr uint64_t sha512_rotr(uint64_t x, unsigned n)
+    {
+      return (x >> n) | (x << (64 - n));
+    }
+
+    /// @brief Expands the first 16 message words in @p schedule to the round
+    /// inputs K[i] + W[i] of all 80 rounds
+    static constexpr void sha512_expand_schedule(
+      std::array<uint64_t, 80>& schedule)
+    {
+      for (size_t i = 16; i < 80; ++i)
       {
-        const uint32_t word15 = schedule[i - 15];
-        const uint32_t word2 = schedule[i - 2];
-        const uint32_t sigma0 = (word15 >> 7 | word15 << 25) ^
-          (word15 >> 18 | word15 << 14) ^ (word15 >> 3);
-        const uint32_t sigma1 = (word2 >> 17 | word2 << 15) ^
-          (word2 >> 19 | word2 << 13) ^ (word2 >> 10);
+        const uint64_t word15 = schedule[i - 15];
+        const uint64_t word2 = schedule[i - 2];
+        const uint64_t sigma0 = sha512_rotr(word15, 1) ^
+          sha512_rotr(word15, 8) ^ (word15 >> 7);
+        const uint64_t sigma1 =
+          sha512_rotr(word2, 19) ^ sha512_rotr(word2, 61) ^ (word2 >> 6);
         schedule[i] = schedule[i - 16] + sigma0 + schedule[i - 7] + sigma1;
       }
-
-      auto working = state;
-      for (size_t i = 0; i < 64; ++i)
+      for (size_t i = 0; i < 80; ++i)
       {
-        const uint32_t choice =
-          (working[4] & working[5]) ^ (~working[4] & working[6]);
-        const uint32_t majority = (working[0] & working[1]) ^
-          (working[0] & working[2]) ^ (working[1] & working[2]);
-        const uint32_t sigma0 = (working[0] >> 2 | working[0] << 30) ^
-          (working[0] >> 13 | working[0] << 19) ^
-          (working[0] >> 22 | working[0] << 10);
-        const uint32_t sigma1 = (working[4] >> 6 | working[4] << 26) ^
-          (working[4] >> 11 | working[4] << 21) ^
-          (working[4] >> 25 | working[4] << 7);
-        const uint32_t temporary1 =
-          working[7] + sigma1 + choice + constants[i] + schedule[i];
-        const uint32_t temporary2 = sigma0 + majority;
+        schedule[i] += sha512_constants[i];
+      }
+    }
 
-        working[7] = working[6];
-        working[6] = working[5];
-        working[5] = working[4];
-        working[4] = working[3] + temporary1;
-        working[3] = working[2];
-        working[2] = working[1];
-        working[1] = working[0];
-        working[0] = temporary1 + temporary2;
+    /// @brief Round inputs K[i] + W[i] of the padding block of a SHA512 node
+    /// hash, whose 128-byte message fills the first block exactly
+    static constexpr std::array<uint64_t, 80> sha512_padding_schedule = []() {
+      std::array<uint64_t, 80> schedule = {};
+      schedule[0] = 0x8000000000000000;
+      schedule[15] = 1024;
+      sha512_expand_schedule(schedule);
+      return schedule;
+    }();
+
+    /// @brief Runs the 80 SHA512 rounds on @p state
+    /// @param schedule Round inputs K[i] + W[i]
+    /// @param state Hash state, updated including the final feed-forward
+    /// @details The rounds are branch-free 64-bit arithmetic on eight working
+    /// variables, which compilers map onto rotate and three-operand
+    /// instructions.
+    static inline void sha512_rounds(
+      const std::array<uint64_t, 80>& schedule, std::array<uint64_t, 8>& state)
+    {
+      uint64_t a = state[0];
+      uint64_t b = state[1];
+      uint64_t c = state[2];
+      uint64_t d = state[3];
+      uint64_t e = state[4];
+      uint64_t f = state[5];
+      uint64_t g = state[6];
+      uint64_t h = state[7];
+      for (size_t i = 0; i < 80; ++i)
+      {
+        const uint64_t choice = (e & f) ^ (~e & g);
+        const uint64_t majority = (a & (b ^ c)) ^ (b & c);
+        const uint64_t sigma0 =
+          sha512_rotr(a, 28) ^ sha512_rotr(a, 34) ^ sha512_rotr(a, 39);
+        const uint64_t sigma1 =
+          sha512_rotr(e, 14) ^ sha512_rotr(e, 18) ^ sha512_rotr(e, 41);
+        const uint64_t temporary1 = h + sigma1 + choice + schedule[i];
+        const uint64_t temporary2 = sigma0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temporary1;
+        d = c;
+        c = b;
+        b = a;
+        a = temporary1 + temporary2;
       }
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+    }
 
-      for (size_t i = 0; i < state.size(); ++i)
+    /// @brief SHA512 block transform
+    static inline void sha512_transform(
+      const uint8_t block[128], std::array<uint64_t, 8>& state)
+    {
+      std::array<uint64_t, 80> schedule = {};
+      for (size_t i = 0; i < 16; ++i)
       {
-        state[i] += working[i];
+        schedule[i] = sha512_load_word(&block[i * 8]);
       }
+      sha512_expand_schedule(schedule);
+      sha512_rounds(schedule, state);
     }
 
-    static inline void sha256_write_digest(
-      const std::array<uint32_t, 8>& state, HashT<32>& out)
+    /// @brief Writes the first SIZE bytes of a SHA384/SHA512 state
+    template <size_t SIZE>
+    static inline void sha512_write_digest(
+      const std::array<uint64_t, 8>& state, HashT<SIZE>& out)
     {
-      for (size_t i = 0; i < state.size(); ++i)
+      static_assert(SIZE % 8 == 0 && SIZE <= 64);
+      for (size_t i = 0; i < SIZE / 8; ++i)
       {
-        out.bytes[i * 4] = static_cast<uint8_t>(state[i] >> 24);
-        out.bytes[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
-        out.bytes[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
-        out.bytes[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+        for (size_t j = 0; j < 8; ++j)
+        {
+          out.bytes[i * 8 + j] = static_cast<uint8_t>(state[i] >> (56 - 8 * j));
+        }
       }
     }
   }
 
-  /// @brief Built-in SHA256 function for tree node hashes
+  /// @brief Built-in SHA384 function for tree node hashes
   /// @param l Left node hash
   /// @param r Right node hash
   /// @param out Output node hash
-  /// @details Computes SHA256 over the 64-byte concatenation of @p l and @p r,
-  /// including standard SHA256 message padding.
-  static inline void sha256(
-    const HashT<32>& l, const HashT<32>& r, HashT<32>& out)
+  /// @details Computes SHA384 over the 96-byte concatenation of @p l and @p r,
+  /// including standard message padding, which fits in the same block.
+  /// Produces the same hashes as sha384_openssl().
+  static inline void sha384(
+    const HashT<48>& l, const HashT<48>& r, HashT<48>& out)
   {
-    uint8_t block[32 * 2];
-    memcpy(&block[0], l.bytes, 32);
-    memcpy(&block[32], r.bytes, 32);
+    std::array<uint64_t, 80> schedule = {};
+    for (size_t i = 0; i < 6; ++i)
+    {
+      schedule[i] = detail::sha512_load_word(&l.bytes[i * 8]);
+      schedule[i + 6] = detail::sha512_load_word(&r.bytes[i * 8]);
+    }
+    schedule[12] = 0x8000000000000000;
+    schedule[15] = 96 * 8;
+    detail::sha512_expand_schedule(schedule);
+
+    auto state = detail::sha384_initial_state();
+    detail::sha512_rounds(schedule, state);
+    detail::sha512_write_digest(state, out);
+  }
 
-    auto state = detail::sha256_initial_state();
-    detail::sha256_transform(block, state);
+  /// @brief Built-in SHA512 function for tree node hashes
+  /// @param l Left node hash
+  /// @param r Right node hash
+  /// @param out Output node hash
+  /// @details Computes SHA512 over the 128-byte concatenation of @p l and
+  /// @p r, including standard message padding. The padding block is the same
+  /// for every node, so its schedule is precomputed. Produces the same hashes
+  /// as sha512_openssl().
+  static inline void sha512(
+    const HashT<64>& l, const HashT<64>& r, HashT<64>& out)
+  {
+    std::array<uint64_t, 80> schedule = {};
+    for (size_t i = 0; i < 8; ++i)
+    {
+      schedule[i] = detail::sha512_load_word(&l.bytes[i * 8]);
+      schedule[i + 8] = detail::sha512_load_word(&r.bytes[i * 8]);
+    }
+    detail::sha512_expand_schedule(schedule);
 
-    uint8_t padding[64] = {0x80};
-    padding[62] = 0x02;
-    detail::sha256_transform(padding, state);
-    detail::sha256_write_digest(state, out);
+    auto state = detail::sha512_initial_state();
+    detail::sha512_rounds(schedule, state);
+    detail::sha512_rounds(detail::sha512_padding_schedule, state);
+    detail::sha512_write_digest(state, out);
   }
 
 #ifdef HAVE_OPENSSL
@@ -2300,18 +7253,231 @@ namespace merkle
     }
   }
 
-  /// @brief Type of paths in the SHA384 tree type
-  using Path384 = PathT<48, sha384_openssl>;
+  namespace detail
+  {
+    /// @brief OpenSSL digest contexts for node hashes of SIZE bytes
+    /// @details The digest is fetched once per process. Each thread keeps an
+    /// instance (see OpenSSLHasher) with a context initialised with it, and
+    /// every node hash starts from a copy of that context instead of looking
+    /// up the digest and setting up a new context.
+    template <size_t SIZE>
+    class OpenSSLNodeHasher
+    {
+    public:
+      OpenSSLNodeHasher()
+      {
+        if (
+          !initial || !work ||
+          EVP_DigestInit_ex(initial.get(), md(), nullptr) != 1)
+        {
+          throw std::runtime_error("EVP_DigestInit_ex failed");
+        }
+      }
+
+      /// @brief Computes a node hash
+      /// @param l Left node hash
+      /// @param r Right node hash
+      /// @param out Output node hash, which may alias @p l or @p r
+      void hash(
+        const HashT<SIZE>& l, const HashT<SIZE>& r, HashT<SIZE>& out)
+      {
+        if (
+          EVP_MD_CTX_copy_ex(work.get(), initial.get()) != 1 ||
+          EVP_DigestUpdate(work.get(), l.bytes, SIZE) != 1 ||
+          EVP_DigestUpdate(work.get(), r.bytes, SIZE) != 1 ||
+          EVP_DigestFinal_ex(work.get(), out.bytes, nullptr) != 1)
+        {
+          throw std::runtime_error("EVP digest failed");
+        }
+      }
+
+      /// @brief Computes a batch of node hashes, in order
+      void hash_batch(std::span<const HashPairT<SIZE>> pairs)
+      {
+        for (const auto& pair : pairs)
+        {
+          hash(*pair.l, *pair.r, *pair.out);
+        }
+      }
 
-  /// @brief SHA384 tree with OpenSSL hash function
-  using Tree384 = TreeT<48, sha384_openssl>;
+    private:
+      using Context = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
 
-  /// @brief Type of paths in the SHA512 tree type
-  using Path512 = PathT<64, sha512_openssl>;
+      Context initial{EVP_MD_CTX_new(), EVP_MD_CTX_free};
+      Context work{EVP_MD_CTX_new(), EVP_MD_CTX_free};
+
+      static const EVP_MD* md()
+      {
+        static_assert(SIZE == 32 || SIZE == 48 || SIZE == 64);
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        // Explicitly fetch once; EVP_sha*() make OpenSSL 3 fetch implicitly
+        // at every initialisation.
+        static const std::unique_ptr<EVP_MD, decltype(&EVP_MD_free)> fetched(
+          EVP_MD_fetch(
+            nullptr,
+            SIZE == 32 ? "SHA256" : (SIZE == 48 ? "SHA384" : "SHA512"),
+            nullptr),
+          EVP_MD_free);
+        if (!fetched)
+        {
+          throw std::runtime_error("EVP_MD_fetch failed");
+        }
+        return fetched.get();
+#  else
+        if constexpr (SIZE == 32)
+        {
+          return EVP_sha256();
+        }
+        else if constexpr (SIZE == 48)
+        {
+          return EVP_sha384();
+        }
+        else
+        {
+          return EVP_sha512();
+        }
+#  endif
+      }
+    };
+  }
+
+  /// @brief Hasher policy for OpenSSL with cached per-thread digest contexts
+  /// @tparam SIZE Hash size, 32, 48 or 64 bytes for SHA256, SHA384 or SHA512
+  /// @details Supports batches; see NodeHasher.
+  template <size_t SIZE>
+  struct OpenSSLHasher
+  {
+    using thread_state = detail::OpenSSLNodeHasher<SIZE>;
+  };
+
+  /// @brief OpenSSL SHA256 with cached digest contexts
+  /// @param l Left node hash
+  /// @param r Right node hash
+  /// @param out Output node hash
+  /// @details Produces the same hashes as sha256_openssl() with less
+  /// per-call overhead; see OpenSSLHasher.
+  static inline void sha256_openssl_cached(
+    const merkle::HashT<32>& l,
+    const merkle::HashT<32>& r,
+    merkle::HashT<32>& out)
+  {
+    detail::hash_node<32, OpenSSLHasher<32>{}>(l, r, out);
+  }
+
+  /// @brief OpenSSL SHA384 with cached digest contexts
+  /// @param l Left node hash
+  /// @param r Right node hash
+  /// @param out Output node hash
+  /// @details Produces the same hashes as sha384_openssl() with less
+  /// per-call overhead; see OpenSSLHasher.
+  static inline void sha384_openssl_cached(
+    const merkle::HashT<48>& l,
+    const merkle::HashT<48>& r,
+    merkle::HashT<48>& out)
+  {
+    detail::hash_node<48, OpenSSLHasher<48>{}>(l, r, out);
+  }
+
+  /// @brief OpenSSL SHA512 with cached digest contexts
+  /// @param l Left node hash
+  /// @param r Right node hash
+  /// @param out Output node hash
+  /// @details Produces the same hashes as sha512_openssl() with less
+  /// per-call overhead; see OpenSSLHasher.
+  static inline void sha512_openssl_cached(
+    const merkle::HashT<64>& l,
+    const merkle::HashT<64>& r,
+    merkle::HashT<64>& out)
+  {
+    detail::hash_node<64, OpenSSLHasher<64>{}>(l, r, out);
+  }
+
+  /// @brief Computes a batch of node hashes with OpenSSL
+  /// @tparam SIZE Hash size, 32, 48 or 64 bytes for SHA256, SHA384 or SHA512
+  /// @param pairs The node hashes to compute, in order
+  /// @details Uses the calling thread's cached digest contexts for the whole
+  /// batch.
+  template <size_t SIZE>
+  static inline void openssl_hash_batch(std::span<const HashPairT<SIZE>> pairs)
+  {
+    detail::hasher_thread_state<OpenSSLHasher<SIZE>>().hash_batch(pairs);
+  }
+#endif
+
+  namespace detail
+  {
+    template <typename T, size_t SIZE>
+    concept BatchHasher =
+      requires(T& hasher, std::span<const HashPairT<SIZE>> pairs) {
+        hasher.hash_batch(pairs);
+      };
+  }
 
-  /// @brief SHA512 tree with OpenSSL hash function
-  using Tree512 = TreeT<64, sha512_openssl>;
+  /// @brief Computes a batch of tree node hashes with @p HASH_FUNCTION
+  /// @tparam HASH_SIZE Size of each hash in number of bytes
+  /// @tparam HASH_FUNCTION The hash function or hasher policy
+  /// @param pairs The node hashes to compute
+  /// @note Uses the policy's hash_batch() if it has one, sha256_batch() for
+  /// the built-in SHA256 function, openssl_hash_batch() for the cached
+  /// OpenSSL functions, and hashes each pair in order otherwise.
+  template <size_t HASH_SIZE, NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
+  static inline void hash_batch(std::span<const HashPairT<HASH_SIZE>> pairs)
+  {
+    using H = std::remove_cvref_t<decltype(HASH_FUNCTION)>;
+    if constexpr (detail::ThreadHasherPolicy<H, HASH_SIZE>)
+    {
+      if constexpr (detail::BatchHasher<typename H::thread_state, HASH_SIZE>)
+      {
+        detail::hasher_thread_state<H>().hash_batch(pairs);
+        return;
+      }
+    }
+    else if constexpr (detail::StaticHasherPolicy<H, HASH_SIZE>)
+    {
+      if constexpr (detail::BatchHasher<H, HASH_SIZE>)
+      {
+        H::hash_batch(pairs);
+        return;
+      }
+    }
+    else if constexpr (HASH_SIZE == 32)
+    {
+      if constexpr (HASH_FUNCTION == sha256)
+      {
+        sha256_batch(pairs);
+        return;
+      }
+#ifdef HAVE_OPENSSL
+      if constexpr (HASH_FUNCTION == sha256_openssl_cached)
+      {
+        openssl_hash_batch(pairs);
+        return;
+      }
+#endif
+    }
+#ifdef HAVE_OPENSSL
+    else if constexpr (HASH_SIZE == 48)
+    {
+      if constexpr (HASH_FUNCTION == sha384_openssl_cached)
+      {
+        openssl_hash_batch(pairs);
+        return;
+      }
+    }
+    else if constexpr (HASH_SIZE == 64)
+    {
+      if constexpr (HASH_FUNCTION == sha512_openssl_cached)
+      {
+        openssl_hash_batch(pairs);
+        return;
+      }
+    }
 #endif
+    for (const auto& pair : pairs)
+    {
+      detail::hash_node<HASH_SIZE, HASH_FUNCTION>(*pair.l, *pair.r, *pair.out);
+    }
+  }
 
   /// @brief Type of SHA384-sized hashes
   using Hash384 = HashT<48>;
@@ -2327,4 +7493,64 @@ namespace merkle
 
   /// @brief Default tree with default hash size and function
   using Tree = TreeT<32, sha256>;
+
+  /// @brief Type of paths in the SHA384 tree type
+  using Path384 = PathT<48, sha384>;
+
+  /// @brief SHA384 tree with the built-in hash function
+  using Tree384 = TreeT<48, sha384>;
+
+  /// @brief Type of paths in the SHA512 tree type
+  using Path512 = PathT<64, sha512>;
+
+  /// @brief SHA512 tree with the built-in hash function
+  using Tree512 = TreeT<64, sha512>;
+
+  /// @brief Default compact range with default hash size and function
+  using CompactRange = CompactRangeT<32, sha256>;
+
+  /// @brief SHA384 compact range with the built-in hash function
+  using CompactRange384 = CompactRangeT<48, sha384>;
+
+  /// @brief SHA512 compact range with the built-in hash function
+  using CompactRange512 = CompactRangeT<64, sha512>;
+
+  /// @brief Default static tree with default hash size and function
+  template <size_t MAX_LEAVES>
+  using StaticTree = StaticTreeT<32, sha256, MAX_LEAVES>;
+
+  /// @brief SHA384 static tree with the built-in hash function
+  template <size_t MAX_LEAVES>
+  using StaticTree384 = StaticTreeT<48, sha384, MAX_LEAVES>;
+
+  /// @brief SHA512 static tree with the built-in hash function
+  template <size_t MAX_LEAVES>
+  using StaticTree512 = StaticTreeT<64, sha512, MAX_LEAVES>;
+
+  /// @brief Computes the root of the tree of a sequence of leaves with the
+  /// default hash size and function; see merkle_tree_hash<HASH_SIZE,
+  /// HASH_FUNCTION>()
+  inline Hash merkle_tree_hash(
+    std::span<const Hash> leaves, size_t num_threads = 1)
+  {
+    return merkle_tree_hash<32, sha256>(leaves, num_threads);
+  }
+
+  /// @brief Computes the roots of the trees of many sequences of leaves with
+  /// the default hash size and function; see merkle_tree_hashes<HASH_SIZE,
+  /// HASH_FUNCTION>()
+  inline std::vector<Hash> merkle_tree_hashes(
+    std::span<const std::span<const Hash>> trees)
+  {
+    return merkle_tree_hashes<32, sha256>(trees);
+  }
+
+  /// @brief Default append queue with default hash size and function
+  using AppendQueue = AppendQueueT<32, sha256>;
+
+  /// @brief SHA384 append queue with the built-in hash function
+  using AppendQueue384 = AppendQueueT<48, sha384>;
+
+  /// @brief SHA512 append queue with the built-in hash function
+  using AppendQueue512 = AppendQueueT<64, sha512>;
 };
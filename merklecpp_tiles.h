@@ -18,6 +18,7 @@
 #include <iterator>
 #include <limits>
 #include <set>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -156,22 +157,20 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
 
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE = DEFAULT_TILE_HEIGHT>
     class TileWriterT;
 
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE = DEFAULT_TILE_HEIGHT>
     class EntryBundleWriterT;
 
     /// @brief Reads and writes tlog-tiles tile files on a local filesystem.
     /// @tparam HASH_SIZE Size of each hash in bytes
-    /// @tparam HASH_FUNCTION The tree's node hash function (carried for use by
-    /// later components; tile I/O itself does not hash).
+    /// @tparam HASH_FUNCTION The tree's node hash function or hasher policy
+    /// (carried for use by later components; tile I/O itself does not hash).
     /// @tparam TILE_HEIGHT_VALUE Number of tree levels represented by a tile;
     /// the tile width is 2**TILE_HEIGHT_VALUE. The default value 8 is the C2SP
     /// tlog-tiles geometry; other values are merklecpp extensions.
@@ -181,8 +180,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// tiles atomically.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE = DEFAULT_TILE_HEIGHT>
     class TileStoreT
     {
@@ -486,35 +484,61 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
 
       static std::string default_hash_algorithm_short_name()
       {
+        using merkle::detail::same_hasher;
         if constexpr (HASH_SIZE == merkle::Tree::Hash::size_bytes)
         {
-          if constexpr (HASH_FUNCTION == merkle::Tree::hash_function)
+          if constexpr (
+            same_hasher<HASH_FUNCTION, merkle::Tree::hash_function> ||
+            same_hasher<HASH_FUNCTION, Sha256Hasher{}>)
           {
             return std::string(detail::SHA256_ALGORITHM_SHORT_NAME);
           }
 #ifdef HAVE_OPENSSL
-          if constexpr (HASH_FUNCTION == sha256_openssl)
+          if constexpr (
+            same_hasher<HASH_FUNCTION, sha256_openssl> ||
+            same_hasher<HASH_FUNCTION, sha256_openssl_cached> ||
+            same_hasher<HASH_FUNCTION, OpenSSLHasher<HASH_SIZE>{}>)
           {
             return std::string(detail::SHA256_ALGORITHM_SHORT_NAME);
           }
 #endif
         }
-#ifdef HAVE_OPENSSL
         else if constexpr (HASH_SIZE == merkle::Tree384::Hash::size_bytes)
         {
-          if constexpr (HASH_FUNCTION == merkle::Tree384::hash_function)
+          if constexpr (same_hasher<
+                          HASH_FUNCTION,
+                          merkle::Tree384::hash_function>)
+          {
+            return std::string(detail::SHA384_ALGORITHM_SHORT_NAME);
+          }
+#ifdef HAVE_OPENSSL
+          if constexpr (
+            same_hasher<HASH_FUNCTION, sha384_openssl> ||
+            same_hasher<HASH_FUNCTION, sha384_openssl_cached> ||
+            same_hasher<HASH_FUNCTION, OpenSSLHasher<HASH_SIZE>{}>)
           {
             return std::string(detail::SHA384_ALGORITHM_SHORT_NAME);
           }
+#endif
         }
         else if constexpr (HASH_SIZE == merkle::Tree512::Hash::size_bytes)
         {
-          if constexpr (HASH_FUNCTION == merkle::Tree512::hash_function)
+          if constexpr (same_hasher<
+                          HASH_FUNCTION,
+                          merkle::Tree512::hash_function>)
+          {
+            return std::string(detail::SHA512_ALGORITHM_SHORT_NAME);
+          }
+#ifdef HAVE_OPENSSL
+          if constexpr (
+            same_hasher<HASH_FUNCTION, sha512_openssl> ||
+            same_hasher<HASH_FUNCTION, sha512_openssl_cached> ||
+            same_hasher<HASH_FUNCTION, OpenSSLHasher<HASH_SIZE>{}>)
           {
             return std::string(detail::SHA512_ALGORITHM_SHORT_NAME);
           }
-        }
 #endif
+        }
         throw std::runtime_error(
           "TileStoreT requires a hash algorithm short name");
       }
@@ -810,25 +834,14 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     {
       template <
         size_t HASH_SIZE,
-        void HASH_FUNCTION(
-          const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&)>
+        NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
       HashT<HASH_SIZE> perfect_root_range(
         const std::vector<HashT<HASH_SIZE>>& hashes,
         size_t offset,
         size_t count)
       {
-        if (count == 1)
-        {
-          return hashes[offset];
-        }
-        const size_t half = count / 2;
-        const auto left =
-          perfect_root_range<HASH_SIZE, HASH_FUNCTION>(hashes, offset, half);
-        const auto right = perfect_root_range<HASH_SIZE, HASH_FUNCTION>(
-          hashes, offset + half, half);
-        HashT<HASH_SIZE> out;
-        HASH_FUNCTION(left, right, out);
-        return out;
+        return merkle_tree_hash<HASH_SIZE, HASH_FUNCTION>(
+          std::span(hashes).subspan(offset, count));
       }
     }
 
@@ -840,8 +853,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// change as leaves are added and must therefore never be tiled.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&)>
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
     inline HashT<HASH_SIZE> perfect_root(
       const std::vector<HashT<HASH_SIZE>>& leaves)
     {
@@ -861,7 +873,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
 
     /// @brief Computes and persists tlog-tiles tiles for a growing tree.
     /// @tparam HASH_SIZE Size of each hash in bytes
-    /// @tparam HASH_FUNCTION The tree's node hash function
+    /// @tparam HASH_FUNCTION The tree's node hash function or hasher policy
     /// @tparam TILE_HEIGHT_VALUE Number of tree levels represented by a tile
     /// @note Only balanced subtrees are tiled: a level-L entry is the root of a
     /// complete 2**(TILE_HEIGHT_VALUE*L)-leaf subtree. Only full tiles are
@@ -875,8 +887,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// ownership and restore the matching tree state.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE>
     class TileWriterT
     {
@@ -1041,8 +1052,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// from tiles, from an in-memory tree, or from a combination of the two.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&)>
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
     struct HashSourceT
     {
       /// @brief The type of hashes resolved.
@@ -1067,7 +1077,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
 
     /// @brief Resolves subtree roots from tlog-tiles tile files.
     /// @tparam HASH_SIZE Size of each hash in bytes
-    /// @tparam HASH_FUNCTION The tree's node hash function
+    /// @tparam HASH_FUNCTION The tree's node hash function or hasher policy
     /// @tparam TILE_HEIGHT_VALUE Number of tree levels represented by a tile
     /// @note @p available_size is rounded down to a whole number of full tiles:
     /// only complete, durably-written full tiles are read. A complete subtree
@@ -1079,8 +1089,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// shared source.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE = DEFAULT_TILE_HEIGHT>
     class TileHashSourceT : public HashSourceT<HASH_SIZE, HASH_FUNCTION>
     {
@@ -1179,7 +1188,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
         Hash hi;
         resolve((uint8_t)(level - 1), index * 2, lo);
         resolve((uint8_t)(level - 1), index * 2 + 1, hi);
-        HASH_FUNCTION(lo, hi, out);
+        merkle::detail::hash_node<HASH_SIZE, HASH_FUNCTION>(lo, hi, out);
       }
 
       struct TileCacheEntry
@@ -1228,8 +1237,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// Callers must serialize operations when the source is shared.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&)>
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
     class ProofEngineT
     {
     public:
@@ -1398,8 +1406,8 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
           const Hash& c = proof[i];
           if ((fn & 1) != 0 || fn == sn)
           {
-            HASH_FUNCTION(c, fr, fr);
-            HASH_FUNCTION(c, sr, sr);
+            merkle::detail::hash_node<HASH_SIZE, HASH_FUNCTION>(c, fr, fr);
+            merkle::detail::hash_node<HASH_SIZE, HASH_FUNCTION>(c, sr, sr);
             if ((fn & 1) == 0)
             {
               while ((fn & 1) == 0 && fn != 0)
@@ -1411,7 +1419,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
           }
           else
           {
-            HASH_FUNCTION(sr, c, sr);
+            merkle::detail::hash_node<HASH_SIZE, HASH_FUNCTION>(sr, c, sr);
           }
           fn >>= 1;
           sn >>= 1;
@@ -1477,7 +1485,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
         {
           return false;
         }
-        HASH_FUNCTION(left, right, out);
+        merkle::detail::hash_node<HASH_SIZE, HASH_FUNCTION>(left, right, out);
         return true;
       }
 
@@ -1531,8 +1539,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// hashes but does not change logical contents or hashing semantics.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&)>
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
     class MemoryHashSourceT : public HashSourceT<HASH_SIZE, HASH_FUNCTION>
     {
     public:
@@ -1567,8 +1574,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// resident frontier) with tile files (secondary: serve the flushed past).
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&)>
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION>
     class CombinedHashSourceT : public HashSourceT<HASH_SIZE, HASH_FUNCTION>
     {
     public:
@@ -1594,7 +1600,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
 
     /// @brief A merkle tree backed by tlog-tiles storage.
     /// @tparam HASH_SIZE Size of each hash in bytes
-    /// @tparam HASH_FUNCTION The tree's node hash function
+    /// @tparam HASH_FUNCTION The tree's node hash function or hasher policy
     /// @tparam TILE_HEIGHT_VALUE Number of tree levels represented by a tile
     /// @note Appends grow an in-memory tree; flush() durably writes only full
     /// (balanced) tiles, so the incomplete frontier is never tiled and stays
@@ -1612,8 +1618,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// all access to a shared tree, including proof operations.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE = DEFAULT_TILE_HEIGHT>
     class TiledTreeT
     {
@@ -1947,7 +1952,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// @brief Writes tlog-tiles entry bundles (raw log entries) for a growing
     /// log.
     /// @tparam HASH_SIZE Size of each hash in bytes
-    /// @tparam HASH_FUNCTION The tree's node hash function
+    /// @tparam HASH_FUNCTION The tree's node hash function or hasher policy
     /// @tparam TILE_HEIGHT_VALUE Number of tree levels represented by a bundle
     /// @note Entry bundles are level-0 only and application-owned: merklecpp
     /// stores leaf hashes, while the raw entries (and the leaf-hash derivation
@@ -1960,8 +1965,7 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
     /// access to a writer and its store.
     template <
       size_t HASH_SIZE,
-      void HASH_FUNCTION(
-        const HashT<HASH_SIZE>&, const HashT<HASH_SIZE>&, HashT<HASH_SIZE>&),
+      NodeHasher<HASH_SIZE> auto HASH_FUNCTION,
       uint8_t TILE_HEIGHT_VALUE>
     class EntryBundleWriterT
     {
@@ -2103,52 +2107,50 @@ namespace merkle // NOLINT(modernize-concat-nested-namespaces)
       merkle::Tree::hash_function,
       DEFAULT_TILE_HEIGHT>;
 
-#ifdef HAVE_OPENSSL
     /// @brief SHA384 tile store.
     using TileStore384 =
-      TileStoreT<48, sha384_openssl, DEFAULT_TILE_HEIGHT>;
+      TileStoreT<48, sha384, DEFAULT_TILE_HEIGHT>;
 
     /// @brief SHA512 tile store.
     using TileStore512 =
-      TileStoreT<64, sha512_openssl, DEFAULT_TILE_HEIGHT>;
+      TileStoreT<64, sha512, DEFAULT_TILE_HEIGHT>;
 
     /// @brief SHA384 tile writer.
     using TileWriter384 =
-      TileWriterT<48, sha384_openssl, DEFAULT_TILE_HEIGHT>;
+      TileWriterT<48, sha384, DEFAULT_TILE_HEIGHT>;
 
     /// @brief SHA512 tile writer.
     using TileWriter512 =
-      TileWriterT<64, sha512_openssl, DEFAULT_TILE_HEIGHT>;
+      TileWriterT<64, sha512, DEFAULT_TILE_HEIGHT>;
 
     /// @brief SHA384 hash source, tile-backed source and proof engine.
-    using HashSource384 = HashSourceT<48, sha384_openssl>;
+    using HashSource384 = HashSourceT<48, sha384>;
     using TileHashSource384 =
-      TileHashSourceT<48, sha384_openssl, DEFAULT_TILE_HEIGHT>;
-    using ProofEngine384 = ProofEngineT<48, sha384_openssl>;
+      TileHashSourceT<48, sha384, DEFAULT_TILE_HEIGHT>;
+    using ProofEngine384 = ProofEngineT<48, sha384>;
 
     /// @brief SHA512 hash source, tile-backed source and proof engine.
-    using HashSource512 = HashSourceT<64, sha512_openssl>;
+    using HashSource512 = HashSourceT<64, sha512>;
     using TileHashSource512 =
-      TileHashSourceT<64, sha512_openssl, DEFAULT_TILE_HEIGHT>;
-    using ProofEngine512 = ProofEngineT<64, sha512_openssl>;
+      TileHashSourceT<64, sha512, DEFAULT_TILE_HEIGHT>;
+    using ProofEngine512 = ProofEngineT<64, sha512>;
 
     /// @brief SHA384 memory/combined sources and tiled tree.
-    using MemoryHashSource384 = MemoryHashSourceT<48, sha384_openssl>;
-    using CombinedHashSource384 = CombinedHashSourceT<48, sha384_openssl>;
+    using MemoryHashSource384 = MemoryHashSourceT<48, sha384>;
+    using CombinedHashSource384 = CombinedHashSourceT<48, sha384>;
     using TiledTree384 =
-      TiledTreeT<48, sha384_openssl, DEFAULT_TILE_HEIGHT>;
+      TiledTreeT<48, sha384, DEFAULT_TILE_HEIGHT>;
 
     /// @brief SHA512 memory/combined sources and tiled tree.
-    using MemoryHashSource512 = MemoryHashSourceT<64, sha512_openssl>;
-    using CombinedHashSource512 = CombinedHashSourceT<64, sha512_openssl>;
+    using MemoryHashSource512 = MemoryHashSourceT<64, sha512>;
+    using CombinedHashSource512 = CombinedHashSourceT<64, sha512>;
     using TiledTree512 =
-      TiledTreeT<64, sha512_openssl, DEFAULT_TILE_HEIGHT>;
+      TiledTreeT<64, sha512, DEFAULT_TILE_HEIGHT>;
 
     /// @brief SHA384/512 entry-bundle writers.
     using EntryBundleWriter384 =
-      EntryBundleWriterT<48, sha384_openssl, DEFAULT_TILE_HEIGHT>;
+      EntryBundleWriterT<48, sha384, DEFAULT_TILE_HEIGHT>;
     using EntryBundleWriter512 =
-      EntryBundleWriterT<64, sha512_openssl, DEFAULT_TILE_HEIGHT>;
-#endif
+      EntryBundleWriterT<64, sha512, DEFAULT_TILE_HEIGHT>;
   }
 }
@@ -3,15 +3,15 @@
 
 #include "util.h"
 
-#include <chrono>
 #include <cstdlib>
 #include <ctime>
-#include <iomanip>
 #include <iostream>
 #include <merklecpp.h>
 
 constexpr size_t PRNTSZ = 3;
 
+using PortableTree = merkle::TreeT<32, merkle::detail::sha256_portable>;
+
 #ifdef HAVE_OPENSSL
 using OpenSSLTree = merkle::TreeT<32, merkle::sha256_openssl>;
 #endif
@@ -59,6 +59,7 @@ void compare_sha256_hashes()
   for (size_t k = 0; k < num_trees; k++)
   {
     merkle::Tree mt;
+    PortableTree mtp;
 
 #ifdef HAVE_OPENSSL
     OpenSSLTree mto;
@@ -71,6 +72,7 @@ void compare_sha256_hashes()
     for (const auto h : hashes)
     {
       mt.insert(h);
+      mtp.insert(h);
 
 #ifdef HAVE_OPENSSL
       mto.insert(h);
@@ -80,6 +82,8 @@ void compare_sha256_hashes()
 
       if ((j++ % root_interval) == 0)
       {
+        compare_roots(mt, mtp, "portable");
+
 #ifdef HAVE_OPENSSL
         compare_roots(mt, mto, "OpenSSL");
 #endif
@@ -88,73 +92,17 @@ void compare_sha256_hashes()
       }
     }
 
+    compare_roots(mt, mtp, "portable");
+
 #ifdef HAVE_OPENSSL
     compare_roots(mt, mto, "OpenSSL");
 #endif
   }
 
   std::cout << num_trees << " trees, " << total_inserts << " inserts, "
-            << total_roots << " roots with SHA256: OK" << '\n';
-}
-
-template <typename T>
-void bench(
-  const std::vector<merkle::Hash>& hashes,
-  const std::string& name,
-  size_t root_interval)
-{
-  size_t j = 0;
-  auto start = std::chrono::high_resolution_clock::now();
-  T mt;
-  for (const auto& h : hashes)
-  {
-    mt.insert(h);
-    if ((j++ % root_interval) == 0)
-    {
-      mt.root();
-    }
-  }
-  mt.root();
-  auto stop = std::chrono::high_resolution_clock::now();
-  const double seconds =
-    static_cast<double>(
-      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
-        .count()) /
-    1e9;
-  std::cout << std::left << std::setw(10) << name << ": "
-            << mt.statistics.num_insert << " insertions, "
-            << mt.statistics.num_root << " roots in " << seconds << " sec"
-            << '\n';
-}
-
-template <typename T, size_t HASH_SIZE>
-void benchT(
-  const std::vector<merkle::HashT<HASH_SIZE>>& hashes,
-  const std::string& name,
-  size_t root_interval)
-{
-  size_t j = 0;
-  auto start = std::chrono::high_resolution_clock::now();
-  T mt;
-  for (const auto& h : hashes)
-  {
-    mt.insert(h);
-    if ((j++ % root_interval) == 0)
-    {
-      mt.root();
-    }
-  }
-  mt.root();
-  auto stop = std::chrono::high_resolution_clock::now();
-  const double seconds =
-    static_cast<double>(
-      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
-        .count()) /
-    1e9;
-  std::cout << std::left << std::setw(10) << name << ": "
-            << mt.statistics.num_insert << " insertions, "
-            << mt.statistics.num_root << " roots in " << seconds << " sec"
-            << '\n';
+            << total_roots << " roots with SHA256 ("
+            << merkle::sha256_kernel_name(merkle::sha256_kernel())
+            << " kernel): OK" << '\n';
 }
 
 int main()
@@ -165,38 +113,6 @@ int main()
     std::srand(std::time(nullptr));
 
     compare_sha256_hashes();
-
-#ifndef NDEBUG
-    const size_t num_leaves = static_cast<size_t>(128) * 1024;
-    const size_t root_interval = 128;
-#else
-    const size_t num_leaves = static_cast<size_t>(16) * 1024 * 1024;
-    const size_t root_interval = 1024;
-#endif
-
-    auto hashes = make_hashes(num_leaves);
-
-    std::cout << "--- merklecpp trees with SHA256: " << '\n';
-
-    bench<merkle::Tree>(hashes, "merklecpp", root_interval);
-
-#ifdef HAVE_OPENSSL
-    bench<OpenSSLTree>(hashes, "OpenSSL", root_interval);
-#endif
-
-#ifdef HAVE_OPENSSL
-    {
-      std::cout << "--- merklecpp trees with SHA384: " << '\n';
-      auto hashes384 = make_hashesT<48>(num_leaves);
-      benchT<merkle::Tree384, 48>(hashes384, "OpenSSL", root_interval);
-    }
-
-    {
-      std::cout << "--- merklecpp trees with SHA512: " << '\n';
-      auto hashes512 = make_hashesT<64>(num_leaves);
-      benchT<merkle::Tree512, 64>(hashes512, "OpenSSL", root_interval);
-    }
-#endif
   }
   catch (std::exception& ex)
   {
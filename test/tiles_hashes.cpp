@@ -86,9 +86,21 @@ int main()
     exercise_tiled_hash<
       48,
       merkle::Tree384,
-      merkle::tiles::TiledTreeT<48, merkle::sha384_openssl, 2>,
+      merkle::tiles::TiledTreeT<48, merkle::sha384, 2>,
       merkle::tiles::ProofEngine384>(
       base / "sha384-small", "SHA384 alternate geometry");
+#ifdef HAVE_OPENSSL
+    exercise_tiled_hash<
+      48,
+      merkle::Tree384,
+      merkle::tiles::TiledTreeT<48, merkle::sha384_openssl>,
+      merkle::tiles::ProofEngine384>(base / "sha384-openssl", "SHA384 OpenSSL");
+    exercise_tiled_hash<
+      64,
+      merkle::Tree512,
+      merkle::tiles::TiledTreeT<64, merkle::sha512_openssl>,
+      merkle::tiles::ProofEngine512>(base / "sha512-openssl", "SHA512 OpenSSL");
+#endif
 
     std::cout << "tiles_hashes: OK" << '\n';
   }
@@ -244,6 +244,14 @@ TEST_CASE("Tile store paths and hash namespaces")
   CHECK(
     store256.root().lexically_relative(dir).generic_string() == "sha256-256w");
 
+  using OpenSSLTileStore384 =
+    merkle::tiles::TileStoreT<48, merkle::sha384_openssl>;
+  const OpenSSLTileStore384 openssl_store384(dir);
+  CHECK(
+    openssl_store384.root().lexically_relative(dir).generic_string() ==
+    "sha384-256w");
+#endif
+
   using TileStore384 = merkle::tiles::TileStoreT<
     merkle::Tree384::Hash::size_bytes,
     merkle::Tree384::hash_function>;
@@ -283,7 +291,6 @@ TEST_CASE("Tile store paths and hash namespaces")
     (uintmax_t)TileStore512::TILE_WIDTH * merkle::Tree512::Hash::size_bytes);
   CHECK(store512.has_full_tile(0, 0));
   CHECK(store512.read_tile(TileRef{0, 0}) == full512);
-#endif
 }
 
 TEST_CASE("Tile writes sync directory links in order")
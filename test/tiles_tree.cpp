@@ -180,6 +180,37 @@ int main()
       std::cout << "custom hash namespace: OK" << '\n';
     }
 
+    // ---- Part 0d': hasher policies for the built-in SHA256 share its
+    //      storage namespace and produce the same root and proofs.
+    {
+      using PolicyTiledTree =
+        merkle::tiles::TiledTreeT<Hash::size_bytes, merkle::Sha256Hasher{}>;
+      PolicyTiledTree::Config policy_cfg;
+      policy_cfg.prefix = base / "tt_policy";
+      PolicyTiledTree policy(policy_cfg);
+      merkle::Tree reference;
+      for (size_t i = 0; i < 300; i++)
+      {
+        policy.append(hashes[i]);
+        reference.insert(hashes[i]);
+      }
+      expect(
+        policy.flush().full_written == 1, "hasher policy: full tile written");
+      expect(policy.root() == reference.root(), "hasher policy: root matches");
+      expect(
+        policy.store_ref().root() == store_root(policy_cfg.prefix),
+        "hasher policy: default namespace used");
+      for (size_t i : {size_t{0}, size_t{255}, size_t{299}})
+      {
+        std::vector<uint8_t> expected;
+        std::vector<uint8_t> actual;
+        reference.path(i)->serialise(expected);
+        policy.inclusion_proof(i, 300)->serialise(actual);
+        expect(actual == expected, "hasher policy: inclusion proof matches");
+      }
+      std::cout << "hasher policy: OK" << '\n';
+    }
+
     // ---- Part 0e: proof requests cannot describe a state beyond the current
     //      tree, even when the lower proof engine would not read its source.
     {
@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "util.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <merklecpp.h>
+
+// Times trees with the SHA256 kernels, the portable SHA256 code, SHA384
+// and SHA512, and OpenSSL where available. compare_hash_functions checks
+// that their roots agree.
+
+using PortableTree = merkle::TreeT<32, merkle::detail::sha256_portable>;
+
+#ifdef HAVE_OPENSSL
+using OpenSSLTree = merkle::TreeT<32, merkle::sha256_openssl>;
+#endif
+
+template <typename T>
+void bench(
+  const std::vector<merkle::Hash>& hashes,
+  const std::string& name,
+  size_t root_interval)
+{
+  size_t j = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  T mt;
+  for (const auto& h : hashes)
+  {
+    mt.insert(h);
+    if ((j++ % root_interval) == 0)
+    {
+      mt.root();
+    }
+  }
+  mt.root();
+  auto stop = std::chrono::high_resolution_clock::now();
+  const double seconds =
+    static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+        .count()) /
+    1e9;
+  std::cout << std::left << std::setw(10) << name << ": "
+            << mt.statistics.num_insert << " insertions, "
+            << mt.statistics.num_root << " roots in " << seconds << " sec"
+            << '\n';
+}
+
+template <typename T, size_t HASH_SIZE>
+void benchT(
+  const std::vector<merkle::HashT<HASH_SIZE>>& hashes,
+  const std::string& name,
+  size_t root_interval)
+{
+  size_t j = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  T mt;
+  for (const auto& h : hashes)
+  {
+    mt.insert(h);
+    if ((j++ % root_interval) == 0)
+    {
+      mt.root();
+    }
+  }
+  mt.root();
+  auto stop = std::chrono::high_resolution_clock::now();
+  const double seconds =
+    static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+        .count()) /
+    1e9;
+  std::cout << std::left << std::setw(10) << name << ": "
+            << mt.statistics.num_insert << " insertions, "
+            << mt.statistics.num_root << " roots in " << seconds << " sec"
+            << '\n';
+}
+
+void bench_kernels(const std::vector<merkle::Hash>& hashes)
+{
+  const size_t n = hashes.size() / 2;
+  std::vector<merkle::Hash> out(n);
+  std::vector<merkle::HashPairT<32>> pairs(n);
+  for (size_t i = 0; i < n; i++)
+  {
+    pairs[i] = {&hashes[2 * i], &hashes[2 * i + 1], &out[i]};
+  }
+
+  const auto selected = merkle::sha256_kernel();
+  for (auto kernel :
+       {merkle::Sha256Kernel::portable,
+        merkle::Sha256Kernel::shani,
+        merkle::Sha256Kernel::avx2,
+        merkle::Sha256Kernel::avx512})
+  {
+    if (!merkle::sha256_kernel_available(kernel))
+    {
+      continue;
+    }
+    merkle::set_sha256_kernel(kernel);
+    auto start = std::chrono::high_resolution_clock::now();
+    merkle::sha256_batch(pairs);
+    auto stop = std::chrono::high_resolution_clock::now();
+    const double seconds =
+      static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+          .count()) /
+      1e9;
+    std::cout << std::left << std::setw(10)
+              << merkle::sha256_kernel_name(kernel) << ": " << n
+              << " node hashes in " << seconds << " sec" << '\n';
+  }
+  merkle::set_sha256_kernel(selected);
+}
+
+int main()
+{
+  try
+  {
+#ifndef NDEBUG
+    const size_t num_leaves = static_cast<size_t>(128) * 1024;
+    const size_t root_interval = 128;
+#else
+    const size_t num_leaves = static_cast<size_t>(16) * 1024 * 1024;
+    const size_t root_interval = 1024;
+#endif
+
+    {
+      auto hashes = make_hashes(num_leaves);
+
+      std::cout << "--- merklecpp trees with SHA256: " << '\n';
+
+      bench<merkle::Tree>(hashes, "merklecpp", root_interval);
+      bench<PortableTree>(hashes, "portable", root_interval);
+
+#ifdef HAVE_OPENSSL
+      bench<OpenSSLTree>(hashes, "OpenSSL", root_interval);
+#endif
+
+      std::cout << "--- SHA256 node hash batches by kernel: " << '\n';
+      bench_kernels(hashes);
+    }
+
+    // The wider hashes use a quarter of the leaves, built after the SHA256
+    // leaves are released, so that at most one set of leaves and one large
+    // tree are alive at a time.
+    {
+      std::cout << "--- merklecpp trees with SHA384: " << '\n';
+      auto hashes384 = make_hashesT<48>(num_leaves / 4);
+      benchT<merkle::Tree384, 48>(hashes384, "merklecpp", root_interval);
+#ifdef HAVE_OPENSSL
+      benchT<merkle::TreeT<48, merkle::sha384_openssl>, 48>(
+        hashes384, "OpenSSL", root_interval);
+#endif
+    }
+
+    {
+      std::cout << "--- merklecpp trees with SHA512: " << '\n';
+      auto hashes512 = make_hashesT<64>(num_leaves / 4);
+      benchT<merkle::Tree512, 64>(hashes512, "merklecpp", root_interval);
+#ifdef HAVE_OPENSSL
+      benchT<merkle::TreeT<64, merkle::sha512_openssl>, 64>(
+        hashes512, "OpenSSL", root_interval);
+#endif
+    }
+  }
+  catch (std::exception& ex)
+  {
+    std::cout << "Error: " << ex.what() << '\n';
+    return 1;
+  }
+  catch (...)
+  {
+    std::cout << "Error" << '\n';
+    return 1;
+  }
+
+  return 0;
+}
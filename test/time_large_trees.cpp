@@ -1,13 +1,119 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT License.
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 #include "util.h"
 
 #include <merklecpp.h>
 
+#ifdef HAVE_OPENSSL
+template <
+  size_t HASH_SIZE,
+  void HASH_FUNCTION(
+    const merkle::HashT<HASH_SIZE>& l,
+    const merkle::HashT<HASH_SIZE>& r,
+    merkle::HashT<HASH_SIZE>& out)>
+static double time_tree(
+  std::span<const merkle::HashT<HASH_SIZE>> hashes,
+  size_t root_interval,
+  merkle::HashT<HASH_SIZE>& root)
+{
+  merkle::TreeT<HASH_SIZE, HASH_FUNCTION> mt;
+  size_t j = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (auto& h : hashes)
+  {
+    mt.insert(h);
+    if ((j++ % root_interval) == 0)
+    {
+      mt.root();
+    }
+  }
+  root = mt.root();
+  auto stop = std::chrono::high_resolution_clock::now();
+  return static_cast<double>(
+           std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+             .count()) /
+    1e9;
+}
+
+template <
+  size_t HASH_SIZE,
+  void HASH_FUNCTION(
+    const merkle::HashT<HASH_SIZE>& l,
+    const merkle::HashT<HASH_SIZE>& r,
+    merkle::HashT<HASH_SIZE>& out)>
+static double time_node_hashes(
+  std::span<const merkle::HashT<HASH_SIZE>> hashes,
+  merkle::HashT<HASH_SIZE>& out)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  for (auto& h : hashes)
+  {
+    HASH_FUNCTION(out, h, out);
+  }
+  auto stop = std::chrono::high_resolution_clock::now();
+  return static_cast<double>(
+           std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+             .count()) /
+    static_cast<double>(hashes.size());
+}
+
+// Compares the one-shot OpenSSL functions with the cached-context ones, on
+// their own and inside trees over the given leaves. The trees are built one
+// after the other, so only one of them is alive at a time.
+template <
+  size_t HASH_SIZE,
+  void ONE_SHOT(
+    const merkle::HashT<HASH_SIZE>& l,
+    const merkle::HashT<HASH_SIZE>& r,
+    merkle::HashT<HASH_SIZE>& out),
+  void CACHED(
+    const merkle::HashT<HASH_SIZE>& l,
+    const merkle::HashT<HASH_SIZE>& r,
+    merkle::HashT<HASH_SIZE>& out)>
+static void compare_openssl(
+  const std::string& name,
+  std::span<const merkle::HashT<HASH_SIZE>> hashes,
+  size_t root_interval)
+{
+  merkle::HashT<HASH_SIZE> one_shot_chain;
+  merkle::HashT<HASH_SIZE> cached_chain;
+  const double one_shot_node =
+    time_node_hashes<HASH_SIZE, ONE_SHOT>(hashes, one_shot_chain);
+  const double cached_node =
+    time_node_hashes<HASH_SIZE, CACHED>(hashes, cached_chain);
+  if (one_shot_chain != cached_chain)
+  {
+    throw std::runtime_error(name + ": OpenSSL hash mismatch");
+  }
+  std::cout << name << " OpenSSL node hashes: one-shot " << one_shot_node
+            << " ns, cached contexts " << cached_node << " ns ("
+            << one_shot_node / cached_node << "x)" << '\n';
+
+  merkle::HashT<HASH_SIZE> one_shot_root;
+  merkle::HashT<HASH_SIZE> cached_root;
+  const double one_shot =
+    time_tree<HASH_SIZE, ONE_SHOT>(hashes, root_interval, one_shot_root);
+  const double cached =
+    time_tree<HASH_SIZE, CACHED>(hashes, root_interval, cached_root);
+  if (one_shot_root != cached_root)
+  {
+    throw std::runtime_error(name + ": OpenSSL root mismatch");
+  }
+  std::cout << name << " OpenSSL trees: one-shot " << one_shot
+            << " sec, cached contexts " << cached << " sec ("
+            << one_shot / cached << "x)" << '\n';
+}
+#endif
+
 int main()
 {
   try
@@ -20,77 +126,161 @@ int main()
     const size_t root_interval = 1024;
 #endif
 
-    auto hashes = make_hashes(num_leaves);
-
-    merkle::Tree mt;
-    size_t j = 0;
-    auto start = std::chrono::high_resolution_clock::now();
-    for (auto& h : hashes)
+    // Each digest reuses its leaves for all of its trees, and each tree is
+    // destroyed before the next one is built, so that at most one set of
+    // leaves and one large tree are alive at a time. The OpenSSL comparisons
+    // use a quarter of the leaves.
     {
-      mt.insert(h);
-      if ((j++ % root_interval) == 0)
+      auto hashes = make_hashes(num_leaves);
+
+      {
+        // One root over a quarter of the leaves, serially and on all hardware
+        // threads.
+        const auto bulk =
+          std::span<const merkle::Hash>(hashes).first(num_leaves / 4);
+        const size_t num_threads =
+          std::max<size_t>(std::thread::hardware_concurrency(), 2);
+        merkle::Tree serial;
+        merkle::Tree parallel;
+        parallel.parallel_hashing.num_threads = num_threads;
+        auto insert_start = std::chrono::high_resolution_clock::now();
+        serial.insert(bulk);
+        serial.size();
+        auto insert_stop = std::chrono::high_resolution_clock::now();
+        parallel.insert(bulk);
+        parallel.size();
+        std::cout << "SHA256 bulk insertion: " << bulk.size() << " leaves in "
+                  << std::chrono::duration<double>(insert_stop - insert_start)
+                       .count()
+                  << " sec" << '\n';
+
+        auto serial_start = std::chrono::high_resolution_clock::now();
+        const auto serial_root = serial.root();
+        auto parallel_start = std::chrono::high_resolution_clock::now();
+        const auto parallel_root = parallel.root();
+        auto parallel_stop = std::chrono::high_resolution_clock::now();
+        if (
+          serial_root != parallel_root ||
+          serial.statistics.num_hash != parallel.statistics.num_hash)
+        {
+          throw std::runtime_error("parallel root mismatch");
+        }
+        std::cout << "SHA256 bulk root: serial "
+                  << std::chrono::duration<double>(
+                       parallel_start - serial_start)
+                       .count()
+                  << " sec, " << num_threads << " threads "
+                  << std::chrono::duration<double>(
+                       parallel_stop - parallel_start)
+                       .count()
+                  << " sec" << '\n';
+      }
+
       {
+        merkle::Tree mt;
+        size_t j = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (auto& h : hashes)
+        {
+          mt.insert(h);
+          if ((j++ % root_interval) == 0)
+          {
+            mt.root();
+          }
+        }
         mt.root();
+        auto stop = std::chrono::high_resolution_clock::now();
+        const double seconds =
+          static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+              .count()) /
+          1e9;
+        std::cout << "SHA256: " << mt.statistics.to_string() << " in "
+                  << seconds << " sec" << '\n';
       }
-    }
-    mt.root();
-    auto stop = std::chrono::high_resolution_clock::now();
-    const double seconds =
-      static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
-        .count()) /
-      1e9;
-    std::cout << "SHA256: " << mt.statistics.to_string() << " in " << seconds
-              << " sec" << '\n';
 
 #ifdef HAVE_OPENSSL
+      compare_openssl<
+        32,
+        merkle::sha256_openssl,
+        merkle::sha256_openssl_cached>(
+        "SHA256",
+        std::span<const merkle::Hash>(hashes).first(num_leaves / 4),
+        root_interval);
+#endif
+    }
+
     {
       auto hashes384 = make_hashesT<48>(num_leaves);
 
-      merkle::Tree384 mt384;
-      size_t j384 = 0;
-      auto start384 = std::chrono::high_resolution_clock::now();
-      for (auto& h : hashes384)
       {
-        mt384.insert(h);
-        if ((j384++ % root_interval) == 0)
+        merkle::Tree384 mt384;
+        size_t j384 = 0;
+        auto start384 = std::chrono::high_resolution_clock::now();
+        for (auto& h : hashes384)
         {
-          mt384.root();
+          mt384.insert(h);
+          if ((j384++ % root_interval) == 0)
+          {
+            mt384.root();
+          }
         }
+        mt384.root();
+        auto stop384 = std::chrono::high_resolution_clock::now();
+        const double seconds384 =
+          static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop384 - start384)
+            .count()) /
+          1e9;
+        std::cout << "SHA384: " << mt384.statistics.to_string() << " in "
+                  << seconds384 << " sec" << '\n';
       }
-      mt384.root();
-      auto stop384 = std::chrono::high_resolution_clock::now();
-      const double seconds384 =
-        static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop384 - start384)
-          .count()) /
-        1e9;
-      std::cout << "SHA384: " << mt384.statistics.to_string() << " in "
-                << seconds384 << " sec" << '\n';
+
+#ifdef HAVE_OPENSSL
+      compare_openssl<
+        48,
+        merkle::sha384_openssl,
+        merkle::sha384_openssl_cached>(
+        "SHA384",
+        std::span<const merkle::HashT<48>>(hashes384).first(num_leaves / 4),
+        root_interval);
+#endif
     }
 
     {
       auto hashes512 = make_hashesT<64>(num_leaves);
 
-      merkle::Tree512 mt512;
-      size_t j512 = 0;
-      auto start512 = std::chrono::high_resolution_clock::now();
-      for (auto& h : hashes512)
       {
-        mt512.insert(h);
-        if ((j512++ % root_interval) == 0)
+        merkle::Tree512 mt512;
+        size_t j512 = 0;
+        auto start512 = std::chrono::high_resolution_clock::now();
+        for (auto& h : hashes512)
         {
-          mt512.root();
+          mt512.insert(h);
+          if ((j512++ % root_interval) == 0)
+          {
+            mt512.root();
+          }
         }
+        mt512.root();
+        auto stop512 = std::chrono::high_resolution_clock::now();
+        const double seconds512 =
+          static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop512 - start512)
+            .count()) /
+          1e9;
+        std::cout << "SHA512: " << mt512.statistics.to_string() << " in "
+                  << seconds512 << " sec" << '\n';
       }
-      mt512.root();
-      auto stop512 = std::chrono::high_resolution_clock::now();
-      const double seconds512 =
-        static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop512 - start512)
-          .count()) /
-        1e9;
-      std::cout << "SHA512: " << mt512.statistics.to_string() << " in "
-                << seconds512 << " sec" << '\n';
-    }
+
+#ifdef HAVE_OPENSSL
+      compare_openssl<
+        64,
+        merkle::sha512_openssl,
+        merkle::sha512_openssl_cached>(
+        "SHA512",
+        std::span<const merkle::HashT<64>>(hashes512).first(num_leaves / 4),
+        root_interval);
 #endif
+    }
   }
   catch (std::exception& ex)
   {
@@ -3,6 +3,8 @@
 
 #include "util.h"
 
+#include <filesystem>
+
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 #include <merklecpp.h>
@@ -23,6 +25,1553 @@ TEST_CASE("Built-in SHA256 hashes complete messages")
   REQUIRE(tree.root() == digest);
 }
 
+TEST_CASE("SHA256 kernels produce identical hashes")
+{
+  merkle::Hash l;
+  merkle::Hash r;
+  for (size_t i = 0; i < 1024; i++)
+  {
+    for (size_t j = 0; j < l.size(); j++)
+    {
+      l.bytes[j] = static_cast<uint8_t>(i * 31 + j * 7);
+      r.bytes[j] = static_cast<uint8_t>(i * 17 + j * 13 + 1);
+    }
+    merkle::Hash portable;
+    merkle::detail::sha256_portable(l, r, portable);
+
+    // The node hash kernels take shortcuts; the generic path runs two full
+    // block transforms.
+    merkle::Hash generic;
+    merkle::detail::sha256_node<merkle::detail::sha256_transform>(
+      l, r, generic);
+    REQUIRE(portable == generic);
+
+    merkle::Hash dispatched;
+    merkle::sha256(l, r, dispatched);
+    REQUIRE(dispatched == portable);
+
+#ifdef MERKLECPP_X86_64
+    if (merkle::detail::has_sha256_shani())
+    {
+      merkle::Hash shani;
+      merkle::detail::sha256_shani(l, r, shani);
+      REQUIRE(shani == portable);
+
+      merkle::Hash shani_generic;
+      merkle::detail::sha256_node<merkle::detail::sha256_transform_shani>(
+        l, r, shani_generic);
+      REQUIRE(shani_generic == portable);
+    }
+#endif
+  }
+}
+
+TEST_CASE("SHA256 padding block schedule")
+{
+  std::array<uint32_t, 64> schedule = {};
+  schedule[0] = 0x80000000;
+  schedule[15] = 512;
+  merkle::detail::sha256_expand_schedule(schedule);
+  REQUIRE(schedule == merkle::detail::sha256_padding_schedule);
+
+  // Compressing with the precomputed schedule matches the padding block.
+  uint8_t padding[64] = {0x80};
+  padding[62] = 0x02;
+  auto expected = merkle::detail::sha256_initial_state();
+  merkle::detail::sha256_transform(padding, expected);
+  auto actual = merkle::detail::sha256_initial_state();
+  merkle::detail::sha256_rounds(
+    merkle::detail::sha256_padding_schedule, actual);
+  REQUIRE(actual == expected);
+}
+
+static void xor_hash(
+  const merkle::Hash& l, const merkle::Hash& r, merkle::Hash& out)
+{
+  for (size_t i = 0; i < out.size(); i++)
+  {
+    out.bytes[i] = l.bytes[i] ^ r.bytes[i];
+  }
+}
+
+TEST_CASE("SHA256 batch kernels match per-pair hashing")
+{
+  for (size_t n : {0, 1, 7, 8, 9, 15, 16, 17, 24, 31, 32, 33, 40, 100})
+  {
+    std::vector<merkle::Hash> inputs(2 * n);
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+      for (size_t j = 0; j < inputs[i].size(); j++)
+      {
+        inputs[i].bytes[j] = static_cast<uint8_t>(i * 31 + j * 7 + n);
+      }
+    }
+
+    std::vector<merkle::Hash> expected(n);
+    std::vector<merkle::Hash> batched(n);
+    std::vector<merkle::HashPairT<32>> pairs(n);
+    for (size_t i = 0; i < n; i++)
+    {
+      merkle::detail::sha256_portable(
+        inputs[2 * i], inputs[2 * i + 1], expected[i]);
+      pairs[i] = {&inputs[2 * i], &inputs[2 * i + 1], &batched[i]};
+    }
+    merkle::sha256_batch(pairs);
+    REQUIRE(batched == expected);
+
+    // Reduce in place, as a tree level does: out[i] aliases in[2i].
+    for (size_t i = 0; i < n; i++)
+    {
+      pairs[i] = {&inputs[2 * i], &inputs[2 * i + 1], &inputs[i]};
+    }
+    merkle::hash_batch<32, merkle::sha256>(pairs);
+    inputs.resize(n);
+    REQUIRE(inputs == expected);
+  }
+
+  // Non-SHA256 hash functions go through the generic path.
+  std::vector<merkle::Hash> hs(4);
+  hs[0].bytes[0] = 1;
+  hs[1].bytes[0] = 2;
+  std::vector<merkle::HashPairT<32>> pairs = {{&hs[0], &hs[1], &hs[2]}};
+  merkle::hash_batch<32, xor_hash>(pairs);
+  xor_hash(hs[0], hs[1], hs[3]);
+  REQUIRE(hs[2] == hs[3]);
+}
+
+TEST_CASE("SHA256 kernel selection")
+{
+  const auto selected = merkle::sha256_kernel();
+  REQUIRE(selected == merkle::sha256_best_kernel());
+  REQUIRE(merkle::sha256_kernel_available(merkle::Sha256Kernel::portable));
+
+  std::vector<merkle::Hash> inputs(2 * 45);
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    inputs[i].bytes[i % 32] = static_cast<uint8_t>(i);
+  }
+  std::vector<merkle::Hash> expected(inputs.size() / 2);
+  for (size_t i = 0; i < expected.size(); i++)
+  {
+    merkle::detail::sha256_portable(
+      inputs[2 * i], inputs[2 * i + 1], expected[i]);
+  }
+
+  for (auto kernel :
+       {merkle::Sha256Kernel::portable,
+        merkle::Sha256Kernel::shani,
+        merkle::Sha256Kernel::avx2,
+        merkle::Sha256Kernel::avx512})
+  {
+    if (!merkle::sha256_kernel_available(kernel))
+    {
+      REQUIRE_THROWS(merkle::set_sha256_kernel(kernel));
+      continue;
+    }
+    merkle::set_sha256_kernel(kernel);
+    REQUIRE(merkle::sha256_kernel() == kernel);
+
+    std::vector<merkle::Hash> actual(expected.size());
+    std::vector<merkle::HashPairT<32>> pairs(expected.size());
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+      pairs[i] = {&inputs[2 * i], &inputs[2 * i + 1], &actual[i]};
+    }
+    merkle::sha256_batch(pairs);
+    REQUIRE(actual == expected);
+
+    merkle::Hash single;
+    merkle::sha256(inputs[0], inputs[1], single);
+    REQUIRE(single == expected[0]);
+  }
+
+  merkle::set_sha256_kernel(selected);
+}
+
+TEST_CASE("Built-in SHA384 and SHA512 hash complete messages")
+{
+  const merkle::Hash384 zero384;
+  merkle::Hash384 digest384;
+  merkle::sha384(zero384, zero384, digest384);
+  REQUIRE(
+    digest384.to_string() ==
+    "f57bb7ed82c6ae4a29e6c9879338c592c7d42a39135583e8ccbe3940f2344b0eb6eb8503"
+    "db0ffd6a39ddd00cd07d8317");
+
+  const merkle::Hash512 zero512;
+  merkle::Hash512 digest512;
+  merkle::sha512(zero512, zero512, digest512);
+  REQUIRE(
+    digest512.to_string() ==
+    "ab942f526272e456ed68a979f50202905ca903a141ed98443567b11ef0bf25a552d63905"
+    "1a01be58558122c58e3de07d749ee59ded36acf0c55cd91924d6ba11");
+
+  // The node hash takes shortcuts; the generic path transforms full blocks.
+  merkle::Hash512 l;
+  merkle::Hash512 r;
+  for (size_t i = 0; i < 64; i++)
+  {
+    l.bytes[i] = static_cast<uint8_t>(i * 3);
+    r.bytes[i] = static_cast<uint8_t>(i * 5 + 1);
+  }
+  uint8_t blocks[256] = {};
+  memcpy(&blocks[0], l.bytes, 64);
+  memcpy(&blocks[64], r.bytes, 64);
+  blocks[128] = 0x80;
+  blocks[254] = 0x04;
+  auto state = merkle::detail::sha512_initial_state();
+  merkle::detail::sha512_transform(&blocks[0], state);
+  merkle::detail::sha512_transform(&blocks[128], state);
+  merkle::Hash512 generic;
+  merkle::detail::sha512_write_digest(state, generic);
+  merkle::Hash512 node;
+  merkle::sha512(l, r, node);
+  REQUIRE(node == generic);
+
+  merkle::Tree384 tree384;
+  tree384.insert(zero384);
+  tree384.insert(zero384);
+  REQUIRE(tree384.root() == digest384);
+}
+
+#ifdef HAVE_OPENSSL
+TEST_CASE("Built-in SHA384 and SHA512 match OpenSSL")
+{
+  merkle::Hash384 l384;
+  merkle::Hash384 r384;
+  merkle::Hash512 l512;
+  merkle::Hash512 r512;
+  for (size_t k = 0; k < 256; k++)
+  {
+    for (size_t j = 0; j < 64; j++)
+    {
+      if (j < 48)
+      {
+        l384.bytes[j] = static_cast<uint8_t>(k * 31 + j * 7);
+        r384.bytes[j] = static_cast<uint8_t>(k * 17 + j * 13 + 1);
+      }
+      l512.bytes[j] = static_cast<uint8_t>(k * 29 + j * 3);
+      r512.bytes[j] = static_cast<uint8_t>(k * 11 + j * 19 + 2);
+    }
+
+    merkle::Hash384 native384;
+    merkle::Hash384 openssl384;
+    merkle::sha384(l384, r384, native384);
+    merkle::sha384_openssl(l384, r384, openssl384);
+    REQUIRE(native384 == openssl384);
+
+    merkle::Hash512 native512;
+    merkle::Hash512 openssl512;
+    merkle::sha512(l512, r512, native512);
+    merkle::sha512_openssl(l512, r512, openssl512);
+    REQUIRE(native512 == openssl512);
+  }
+}
+
+TEST_CASE("Cached OpenSSL node hashes match one-shot OpenSSL")
+{
+  std::vector<merkle::Hash> h256(64);
+  std::vector<merkle::Hash384> h384(64);
+  std::vector<merkle::Hash512> h512(64);
+  for (size_t i = 0; i < 64; i++)
+  {
+    for (size_t j = 0; j < 64; j++)
+    {
+      if (j < 32)
+      {
+        h256[i].bytes[j] = static_cast<uint8_t>(i * 7 + j);
+      }
+      if (j < 48)
+      {
+        h384[i].bytes[j] = static_cast<uint8_t>(i * 11 + j);
+      }
+      h512[i].bytes[j] = static_cast<uint8_t>(i * 13 + j);
+    }
+  }
+
+  for (size_t i = 0; i + 1 < 64; i++)
+  {
+    merkle::Hash a;
+    merkle::Hash b;
+    merkle::sha256_openssl(h256[i], h256[i + 1], a);
+    merkle::sha256_openssl_cached(h256[i], h256[i + 1], b);
+    REQUIRE(a == b);
+
+    merkle::Hash384 c;
+    merkle::Hash384 d;
+    merkle::sha384_openssl(h384[i], h384[i + 1], c);
+    merkle::sha384_openssl_cached(h384[i], h384[i + 1], d);
+    REQUIRE(c == d);
+
+    merkle::Hash512 e;
+    merkle::Hash512 f;
+    merkle::sha512_openssl(h512[i], h512[i + 1], e);
+    merkle::sha512_openssl_cached(h512[i], h512[i + 1], f);
+    REQUIRE(e == f);
+  }
+
+  // Batches, reduced in place.
+  std::vector<merkle::Hash512> expected(32);
+  std::vector<merkle::HashPairT<64>> pairs(32);
+  for (size_t i = 0; i < 32; i++)
+  {
+    merkle::sha512_openssl(h512[2 * i], h512[2 * i + 1], expected[i]);
+    pairs[i] = {&h512[2 * i], &h512[2 * i + 1], &h512[i]};
+  }
+  merkle::hash_batch<64, merkle::sha512_openssl_cached>(pairs);
+  h512.resize(32);
+  REQUIRE(h512 == expected);
+}
+#endif
+
+namespace
+{
+  // A per-thread hasher policy that counts the node hashes of its thread.
+  struct CountingHasher
+  {
+    struct thread_state
+    {
+      size_t calls = 0;
+
+      void hash(
+        const merkle::Hash& l, const merkle::Hash& r, merkle::Hash& out)
+      {
+        calls++;
+        merkle::sha256(l, r, out);
+      }
+    };
+
+    static size_t calls()
+    {
+      return merkle::detail::hasher_thread_state<CountingHasher>().calls;
+    }
+  };
+}
+
+static_assert(merkle::NodeHasher<decltype(&merkle::sha256), 32>);
+static_assert(merkle::NodeHasher<merkle::Sha256Hasher, 32>);
+static_assert(merkle::NodeHasher<CountingHasher, 32>);
+static_assert(!merkle::NodeHasher<merkle::Sha256Hasher, 48>);
+
+TEST_CASE("Hasher policies")
+{
+  std::vector<merkle::Hash> hashes(37);
+  for (size_t i = 0; i < hashes.size(); i++)
+  {
+    hashes[i].bytes[0] = static_cast<uint8_t>(i);
+    hashes[i].bytes[31] = static_cast<uint8_t>(i * 3);
+  }
+
+  merkle::Tree reference;
+  merkle::TreeT<32, merkle::Sha256Hasher{}> with_static;
+  merkle::TreeT<32, CountingHasher{}> with_state;
+  const size_t calls_before = CountingHasher::calls();
+  for (const auto& h : hashes)
+  {
+    reference.insert(h);
+    with_static.insert(h);
+    with_state.insert(h);
+  }
+
+  REQUIRE(with_static.root() == reference.root());
+  REQUIRE(with_state.root() == reference.root());
+  REQUIRE(CountingHasher::calls() > calls_before);
+
+  for (size_t i = 0; i < hashes.size(); i++)
+  {
+    std::vector<uint8_t> expected_path;
+    std::vector<uint8_t> actual_path;
+    reference.path(i)->serialise(expected_path);
+    auto path = with_state.path(i);
+    path->serialise(actual_path);
+    REQUIRE(actual_path == expected_path);
+    REQUIRE(path->verify(reference.root()));
+    REQUIRE(with_static.path(i)->verify(reference.root()));
+  }
+
+  // Batches go through the policy's hash_batch(), or node by node.
+  std::vector<merkle::Hash> expected(18);
+  std::vector<merkle::Hash> out_static(18);
+  std::vector<merkle::Hash> out_state(18);
+  std::vector<merkle::HashPairT<32>> pairs_static(18);
+  std::vector<merkle::HashPairT<32>> pairs_state(18);
+  for (size_t i = 0; i < 18; i++)
+  {
+    merkle::sha256(hashes[2 * i], hashes[2 * i + 1], expected[i]);
+    pairs_static[i] = {&hashes[2 * i], &hashes[2 * i + 1], &out_static[i]};
+    pairs_state[i] = {&hashes[2 * i], &hashes[2 * i + 1], &out_state[i]};
+  }
+  merkle::hash_batch<32, merkle::Sha256Hasher{}>(pairs_static);
+  const size_t calls_before_batch = CountingHasher::calls();
+  merkle::hash_batch<32, CountingHasher{}>(pairs_state);
+  REQUIRE(out_static == expected);
+  REQUIRE(out_state == expected);
+  REQUIRE(CountingHasher::calls() == calls_before_batch + 18);
+}
+
+namespace
+{
+  // A hasher policy that records the size of the largest batch.
+  struct RecordingHasher
+  {
+    static inline size_t largest_batch = 0;
+
+    static void hash(
+      const merkle::Hash& l, const merkle::Hash& r, merkle::Hash& out)
+    {
+      merkle::sha256(l, r, out);
+    }
+
+    static void hash_batch(std::span<const merkle::HashPairT<32>> pairs)
+    {
+      largest_batch = std::max(largest_batch, pairs.size());
+      merkle::sha256_batch(pairs);
+    }
+  };
+}
+
+TEST_CASE("Dirty nodes are hashed in batches, level by level")
+{
+  const auto hashes = make_hashes(5000);
+
+  // One root per insertion only ever has one dirty node per level.
+  merkle::TreeT<32, RecordingHasher{}> incremental;
+  RecordingHasher::largest_batch = 0;
+  for (const auto& h : hashes)
+  {
+    incremental.insert(h);
+    incremental.root();
+  }
+  REQUIRE(RecordingHasher::largest_batch == 0);
+
+  merkle::TreeT<32, RecordingHasher{}> bulk;
+  bulk.insert(hashes);
+  REQUIRE(bulk.root() == incremental.root());
+  REQUIRE(bulk.statistics.num_hash == hashes.size() - 1);
+  REQUIRE(RecordingHasher::largest_batch > 1);
+
+  // Dirty regions on top of an existing tree.
+  for (size_t i = 0; i < hashes.size(); i++)
+  {
+    merkle::Hash h = hashes[i];
+    h.bytes[2] = 1;
+    incremental.insert(h);
+    bulk.insert(h);
+    if (i % 999 == 0)
+    {
+      REQUIRE(bulk.root() == incremental.root());
+    }
+  }
+  REQUIRE(bulk.root() == incremental.root());
+  for (size_t i = 0; i < bulk.num_leaves(); i += 97)
+  {
+    REQUIRE(bulk.path(i)->verify(incremental.root()));
+  }
+}
+
+TEST_CASE("Parallel root computation matches serial")
+{
+  const auto hashes = make_hashes(3000);
+
+  for (uint8_t split_height : {1, 2, 5, 11, 12, 16})
+  {
+    merkle::Tree serial;
+    merkle::Tree parallel;
+    parallel.parallel_hashing.num_threads = 4;
+    parallel.parallel_hashing.split_height = split_height;
+    for (size_t i = 0; i < hashes.size(); i++)
+    {
+      serial.insert(hashes[i]);
+      parallel.insert(hashes[i]);
+      if (i == 0 || i == 1000 || i == 1001 || i == 2047)
+      {
+        REQUIRE(parallel.root() == serial.root());
+      }
+    }
+    REQUIRE(parallel.root() == serial.root());
+    REQUIRE(parallel.statistics.num_hash == serial.statistics.num_hash);
+    for (size_t i = 0; i < hashes.size(); i += 101)
+    {
+      REQUIRE(parallel.path(i)->verify(serial.root()));
+    }
+
+    merkle::Tree copy = parallel;
+    REQUIRE(copy.parallel_hashing.num_threads == 4);
+    REQUIRE(copy.parallel_hashing.split_height == split_height);
+  }
+}
+
+TEST_CASE("Background hashing matches foreground hashing")
+{
+  const auto hashes = make_hashes(5000);
+
+  // Full subtrees are hashed in the background, the rest by root().
+  merkle::Tree fresh;
+  fresh.start_background_hashing(8);
+  REQUIRE_THROWS(fresh.start_background_hashing(0));
+  fresh.insert(std::span<const merkle::Hash>(hashes).first(4096));
+  fresh.root();
+  REQUIRE(fresh.statistics.num_hash == 4095);
+  REQUIRE(fresh.statistics.num_background_hash == 16 * 255);
+  REQUIRE(
+    fresh.statistics.to_string().find(" num_background_hash=4080 ") !=
+    std::string::npos);
+
+  merkle::Tree plain;
+  merkle::Tree tree;
+  tree.start_background_hashing(6);
+  for (size_t i = 0; i < hashes.size(); i++)
+  {
+    plain.insert(hashes[i]);
+    tree.insert(hashes[i]);
+    if (i % 700 == 0)
+    {
+      REQUIRE(tree.root() == plain.root());
+      REQUIRE(*tree.path(i / 2) == *plain.path(i / 2));
+    }
+  }
+  REQUIRE(tree.root() == plain.root());
+  REQUIRE(tree.statistics.num_hash == plain.statistics.num_hash);
+  REQUIRE(tree.statistics.num_background_hash > 0);
+
+  tree.flush_to(1000);
+  plain.flush_to(1000);
+  tree.retract_to(3999);
+  plain.retract_to(3999);
+  for (size_t i = 0; i < 1000; i++)
+  {
+    plain.insert(hashes[i]);
+    tree.insert(hashes[i]);
+  }
+  REQUIRE(*tree.past_path(2000, 4500) == *plain.past_path(2000, 4500));
+
+  merkle::Tree copy = tree;
+  merkle::Tree moved = std::move(tree);
+  for (size_t i = 0; i < 1000; i++)
+  {
+    plain.insert(hashes[i]);
+    copy.insert(hashes[i]);
+    moved.insert(hashes[i]);
+  }
+  REQUIRE(copy.root() == plain.root());
+  REQUIRE(moved.root() == plain.root());
+  moved.stop_background_hashing();
+  REQUIRE(moved.root() == plain.root());
+}
+
+TEST_CASE("Snapshots stay unchanged while the tree grows")
+{
+  const auto hashes = make_hashes(3000);
+
+  merkle::Tree tree;
+  tree.insert(std::span<const merkle::Hash>(hashes).first(1000));
+  tree.freeze_to(512);
+  tree.flush_to(300);
+  tree.freezing.automatic_height = 5;
+
+  auto check = [](const merkle::Tree::Snapshot& s, merkle::Tree& expected) {
+    REQUIRE(s.root() == expected.root());
+    REQUIRE(s.min_index() == expected.min_index());
+    REQUIRE(s.max_index() == expected.max_index());
+    for (size_t i = s.min_index(); i <= s.max_index(); i += 37)
+    {
+      REQUIRE(s.leaf(i) == expected.leaf(i));
+      REQUIRE(*s.path(i) == *expected.path(i));
+      REQUIRE(*s.past_root(i) == *expected.past_root(i));
+      const size_t as_of = i + (s.max_index() - i) / 2;
+      REQUIRE(*s.past_path(i, as_of) == *expected.past_path(i, as_of));
+    }
+    REQUIRE_THROWS((void)s.path(s.min_index() - 1));
+    REQUIRE_THROWS((void)s.leaf(s.max_index() + 1));
+    std::vector<uint8_t> bytes;
+    expected.serialise(bytes);
+    REQUIRE(static_cast<std::vector<uint8_t>>(s) == bytes);
+  };
+
+  merkle::Tree first_expected = tree;
+  {
+    auto first = tree.snapshot();
+    tree.insert(std::span<const merkle::Hash>(hashes).subspan(1000, 1001));
+    merkle::Tree second_expected = tree;
+    auto second = tree.snapshot();
+    REQUIRE(tree.num_snapshots() == 2);
+    tree.insert(std::span<const merkle::Hash>(hashes).subspan(2001));
+
+    // Freezing replaces the nodes of snapshots by frozen copies.
+    tree.root();
+    REQUIRE_THROWS(tree.retract_to(2500));
+    tree.freeze_to(2998);
+    check(first, first_expected);
+    check(second, second_expected);
+
+    REQUIRE_THROWS(tree = first_expected);
+
+    // Flushing and retracting leave the nodes of snapshots in place.
+    tree.flush_to(1500);
+    tree.retract_to(2998);
+    check(first, first_expected);
+    check(second, second_expected);
+  }
+
+  REQUIRE(tree.num_snapshots() == 0);
+  tree.freezing.automatic_height = 0;
+  tree.flush_to(1600);
+  tree.retract_to(2997);
+  auto last = tree.snapshot();
+  check(last, tree);
+}
+
+TEST_CASE("Readers see published versions while the tree changes")
+{
+  const auto hashes = make_hashes(4000);
+  std::span<const merkle::Hash> leaves(hashes);
+
+  merkle::Tree tree;
+  auto reader = tree.reader();
+  REQUIRE_THROWS((void)reader.root());
+  tree.insert(leaves.first(1000));
+  tree.publish();
+  merkle::Tree expected = tree;
+  REQUIRE(reader.root() == expected.root());
+
+  {
+    auto version = reader.snapshot();
+    tree.flush_to(600);
+    tree.retract_to(800);
+    tree.insert(leaves.subspan(1000, 1000));
+    REQUIRE(reader.root() == expected.root());
+    REQUIRE(*reader.path(700) == *expected.path(700));
+    REQUIRE(*reader.past_path(100, 500) == *expected.past_path(100, 500));
+    REQUIRE(*reader.past_root(300) == *expected.past_root(300));
+
+    tree.publish();
+    REQUIRE(reader.root() == tree.root());
+    REQUIRE_THROWS((void)reader.path(10));
+    REQUIRE(version.root() == expected.root());
+    REQUIRE(*version.path(10) == *expected.path(10));
+  }
+
+  // Readers on other threads check the paths of the versions they see,
+  // while the writer keeps changing the tree.
+  std::atomic<bool> done = false;
+  std::atomic<size_t> num_checked = 0;
+  std::atomic<size_t> num_failed = 0;
+  std::vector<std::jthread> threads;
+  for (size_t t = 0; t < 2; t++)
+  {
+    threads.emplace_back([&, r = tree.reader()]() {
+      for (size_t k = 0; !done || k < 100; k++)
+      {
+        auto version = r.snapshot();
+        const size_t n = version.num_leaves() - version.min_index();
+        const size_t i = version.min_index() + (k * 7919) % n;
+        if (!version.path(i)->verify(version.root()))
+        {
+          num_failed++;
+        }
+        num_checked++;
+      }
+    });
+  }
+  for (size_t k = 0; k < 20; k++)
+  {
+    tree.insert(leaves.subspan(2000 + 100 * k, 100));
+    if (k % 3 == 0)
+    {
+      tree.flush_to(tree.num_leaves() - 500);
+      tree.retract_to(tree.max_index() - 10);
+    }
+    tree.publish();
+  }
+  done = true;
+  threads.clear();
+  REQUIRE(num_checked >= 200);
+  REQUIRE(num_failed == 0);
+  REQUIRE(reader.root() == tree.root());
+
+  tree.unpublish();
+  REQUIRE_THROWS((void)reader.root());
+  REQUIRE(tree.num_snapshots() == 0);
+  tree.freeze_to(tree.max_index());
+}
+
+TEST_CASE("Published trees keep freezing and releasing frozen blocks")
+{
+  const auto hashes = make_hashes(20000);
+  std::span<const merkle::Hash> leaves(hashes);
+
+  merkle::Tree tree;
+  tree.freezing.stride = 2;
+  tree.freezing.automatic_height = 4;
+
+  // The writer publishes after every batch and flushes all but the last
+  // leaves, while a reader checks the versions it sees.
+  std::atomic<bool> done = false;
+  std::atomic<size_t> num_failed = 0;
+  std::jthread thread([&, r = tree.reader()]() {
+    for (size_t k = 0; !done || k < 100; k++)
+    {
+      try
+      {
+        auto version = r.snapshot();
+        const size_t n = version.num_leaves() - version.min_index();
+        const size_t i = version.min_index() + (k * 7919) % n;
+        if (!version.path(i)->verify(version.root()))
+        {
+          num_failed++;
+        }
+      }
+      catch (const std::runtime_error&)
+      {
+        // No version is published yet.
+      }
+    }
+  });
+
+  size_t max_frozen_blocks = 0;
+  for (size_t k = 0; k < 200; k++)
+  {
+    tree.insert(leaves.subspan(100 * k, 100));
+    tree.publish();
+    if (tree.num_leaves() > 1000)
+    {
+      tree.flush_to(tree.num_leaves() - 1000);
+    }
+    max_frozen_blocks = std::max(max_frozen_blocks, tree.num_frozen_blocks());
+  }
+  done = true;
+  thread = {};
+  REQUIRE(num_failed == 0);
+
+  // Blocks of flushed leaves are released, and the rest stays frozen.
+  REQUIRE(max_frozen_blocks <= 20);
+  REQUIRE(tree.num_frozen_blocks() > 0);
+  REQUIRE_THROWS(tree.retract_to(tree.min_index() + 100));
+
+  merkle::Tree expected;
+  expected.insert(leaves);
+  auto version = tree.snapshot();
+  REQUIRE(version.root() == expected.root());
+  REQUIRE(*version.path(19500) == *expected.path(19500));
+}
+
+TEST_CASE("Readers recompute hashes of lean frozen blocks")
+{
+  const auto hashes = make_hashes(6000);
+  std::span<const merkle::Hash> leaves(hashes);
+
+  merkle::Tree tree;
+  tree.freezing.stride = 3;
+  tree.freezing.cache_size = 16;
+  tree.insert(leaves.first(4000));
+  tree.freeze_to(4000);
+  tree.publish();
+
+  // All readers recompute the hashes that the frozen blocks do not keep, at
+  // the same positions.
+  std::atomic<bool> done = false;
+  std::atomic<size_t> num_failed = 0;
+  std::vector<std::jthread> threads;
+  for (size_t t = 0; t < 3; t++)
+  {
+    threads.emplace_back([&, r = tree.reader()]() {
+      for (size_t k = 0; !done || k < 100; k++)
+      {
+        auto version = r.snapshot();
+        if (!version.path((k * 31) % 4000)->verify(version.root()))
+        {
+          num_failed++;
+        }
+      }
+    });
+  }
+  for (size_t k = 0; k < 20; k++)
+  {
+    tree.insert(leaves.subspan(4000 + 100 * k, 100));
+    tree.publish();
+    tree.path(k * 97);
+  }
+  done = true;
+  threads.clear();
+  REQUIRE(num_failed == 0);
+}
+
+TEST_CASE("Trees with snapshots or readers are moved safely")
+{
+  const auto hashes = make_hashes(100);
+  std::span<const merkle::Hash> leaves(hashes);
+
+  merkle::Tree tree;
+  tree.insert(leaves.first(50));
+  auto reader = tree.reader();
+  {
+    auto snapshot = tree.snapshot();
+    merkle::Tree other;
+    other.insert(leaves.first(10));
+    REQUIRE_THROWS(other = std::move(tree));
+    REQUIRE_THROWS(tree = std::move(other));
+    REQUIRE_THROWS(merkle::Tree(std::move(tree)));
+    REQUIRE(other.num_leaves() == 10);
+    REQUIRE(snapshot.root() == tree.root());
+  }
+
+  tree.publish();
+  merkle::Tree target;
+  REQUIRE_THROWS(target = std::move(tree));
+  REQUIRE_THROWS(merkle::Tree(std::move(tree)));
+  REQUIRE(reader.root() == tree.root());
+  tree.unpublish();
+
+  // Readers move with their tree, once no snapshot refers to it.
+  merkle::Tree moved(std::move(tree));
+  moved.insert(leaves.subspan(50));
+  moved.publish();
+  REQUIRE(reader.root() == moved.root());
+  REQUIRE(*reader.path(70) == *moved.path(70));
+  moved.unpublish();
+
+  // Assigning to a tree would leave its readers without a tree.
+  REQUIRE_THROWS(moved = std::move(target));
+  {
+    auto dropped = std::move(reader);
+  }
+  moved = std::move(target);
+  REQUIRE(moved.empty());
+}
+
+TEST_CASE("Rolling back to marks discards the leaves appended since")
+{
+  const auto hashes = make_hashes(3000);
+  std::span<const merkle::Hash> leaves(hashes);
+
+  auto check = [&](merkle::Tree& tree, size_t num_leaves) {
+    merkle::Tree expected;
+    expected.insert(leaves.first(num_leaves));
+    expected.flush_to(tree.min_index());
+    REQUIRE(tree.num_leaves() == num_leaves);
+    REQUIRE(tree.root() == expected.root());
+    for (size_t i = tree.min_index(); i <= tree.max_index(); i += 41)
+    {
+      REQUIRE(*tree.path(i) == *expected.path(i));
+    }
+  };
+
+  merkle::Tree tree;
+  auto empty = tree.mark();
+  tree.insert(leaves.first(1000));
+  tree.root();
+  auto first = tree.mark();
+  tree.insert(leaves.subspan(1000, 333));
+  auto second = tree.mark();
+  REQUIRE(second.num_leaves() == 1333);
+  tree.insert(leaves.subspan(1333, 500));
+  tree.root();
+  tree.insert(leaves.subspan(1833, 7));
+
+  // Rolling back to marks after appending leaves neither hashes them nor
+  // retracts the tree.
+  const size_t num_hash = tree.statistics.num_hash;
+  tree.rollback(second);
+  tree.rollback(first);
+  REQUIRE(tree.statistics.num_hash == num_hash);
+  REQUIRE(tree.statistics.num_rollback == 2);
+  REQUIRE(
+    tree.statistics.to_string().find(" num_rollback=2 ") != std::string::npos);
+  check(tree, 1000);
+  tree.insert(leaves.subspan(1000, 20));
+  tree.flush_to(900);
+  tree.rollback(first);
+  tree.rollback(second);
+  REQUIRE(tree.statistics.num_retract == 0);
+  check(tree, 1000);
+
+  // Marks with more leaves than a rollback fall back to retract_to().
+  tree.insert(leaves.subspan(1000, 500));
+  tree.rollback(second);
+  REQUIRE(tree.statistics.num_retract == 1);
+  check(tree, 1333);
+
+  auto third = tree.mark();
+  tree.insert(leaves.subspan(1333, 5));
+  tree.rollback(third);
+  check(tree, 1333);
+  tree.insert(leaves.subspan(1333, 100));
+  tree.root();
+  tree.retract_to(1399);
+  tree.rollback(third);
+  REQUIRE(tree.statistics.num_retract == 3);
+  check(tree, 1333);
+  REQUIRE_THROWS(tree.rollback(empty));
+
+  tree.freeze_to(1200);
+  REQUIRE_THROWS(tree.rollback(first));
+  auto fourth = tree.mark();
+  tree.insert(leaves.subspan(1333, 1000));
+  {
+    auto snapshot = tree.snapshot();
+    tree.rollback(fourth);
+    merkle::Tree expected;
+    expected.insert(leaves.first(2333));
+    REQUIRE(snapshot.root() == expected.root());
+    REQUIRE(*snapshot.path(2000) == *expected.path(2000));
+  }
+  check(tree, 1333);
+
+  merkle::Tree other;
+  other.insert(leaves.first(10));
+  auto mark = other.mark();
+  other.insert(leaves.subspan(10, 10));
+  merkle::Tree moved = std::move(other);
+  moved.rollback(mark);
+  check(moved, 10);
+  moved.rollback(moved.mark());
+  merkle::Tree empty_tree;
+  auto empty_mark = empty_tree.mark();
+  moved.rollback(empty_mark);
+  REQUIRE(moved.empty());
+  moved.insert(leaves.first(5));
+  check(moved, 5);
+}
+
+TEST_CASE("Bulk insertion matches per-leaf insertion")
+{
+  const auto hashes = make_hashes(400);
+
+  for (size_t existing : {0, 1, 2, 3, 7, 8, 100, 255, 256, 257})
+  {
+    for (size_t pending : {16, 17, 31, 32, 33, 100, 143})
+    {
+      for (bool flush : {false, true})
+      {
+        merkle::Tree per_leaf;
+        merkle::Tree bulk;
+        for (size_t i = 0; i < existing; i++)
+        {
+          per_leaf.insert(hashes[i]);
+          bulk.insert(hashes[i]);
+        }
+        if (flush && existing > 1)
+        {
+          per_leaf.flush_to(existing / 2);
+          bulk.flush_to(existing / 2);
+        }
+        for (size_t i = existing; i < existing + pending; i++)
+        {
+          per_leaf.insert(hashes[i]);
+          per_leaf.root();
+          bulk.insert(hashes[i]);
+        }
+        REQUIRE(bulk.num_leaves() == existing + pending);
+        REQUIRE(bulk.root() == per_leaf.root());
+        REQUIRE(bulk.invariant());
+        for (size_t i = bulk.min_index(); i <= bulk.max_index(); i += 7)
+        {
+          REQUIRE(bulk.path(i)->verify(per_leaf.root()));
+        }
+        bulk.retract_to(bulk.max_index() - pending / 2);
+        per_leaf.retract_to(per_leaf.max_index() - pending / 2);
+        REQUIRE(bulk.root() == per_leaf.root());
+      }
+    }
+  }
+}
+
+TEST_CASE("Span insertion matches per-leaf insertion")
+{
+  const auto hashes = make_hashes(300);
+  std::vector<uint8_t> buffer;
+  for (const auto& h : hashes)
+  {
+    buffer.insert(buffer.end(), h.bytes, h.bytes + 32);
+  }
+
+  merkle::Tree per_leaf;
+  merkle::Tree from_hashes;
+  merkle::Tree from_bytes;
+  for (const auto& h : hashes)
+  {
+    per_leaf.insert(h);
+  }
+  const std::span<const merkle::Hash> leaves(hashes);
+  from_hashes.insert(leaves.first(100));
+  from_hashes.root();
+  from_hashes.insert(leaves.subspan(100));
+  const std::span<const uint8_t> bytes(buffer);
+  from_bytes.insert_bytes(bytes.first(32 * 7));
+  from_bytes.insert_bytes(bytes.subspan(32 * 7));
+  REQUIRE(from_hashes.root() == per_leaf.root());
+  REQUIRE(from_bytes.root() == per_leaf.root());
+  REQUIRE(*from_bytes.path(123) == *per_leaf.path(123));
+
+  REQUIRE_THROWS(from_bytes.insert_bytes(bytes.first(33)));
+  REQUIRE(from_bytes.num_leaves() == hashes.size());
+  from_bytes.insert_bytes(bytes.first(0));
+  REQUIRE(from_bytes.num_leaves() == hashes.size());
+
+  // A vector of bytes still converts to a single hash.
+  merkle::Tree from_vector;
+  from_vector.insert(std::vector<uint8_t>(buffer.begin(), buffer.begin() + 32));
+  from_vector.insert(
+    std::vector<uint8_t>(buffer.begin() + 32, buffer.begin() + 64));
+  REQUIRE(from_vector.num_leaves() == 2);
+  REQUIRE(*from_vector.path(1) == *per_leaf.past_path(1, 1));
+}
+
+TEST_CASE("Tree nodes are allocated in slabs")
+{
+  merkle::detail::SlabAllocator<merkle::Hash> allocator;
+  const size_t per_slab = allocator.slab_size() / sizeof(merkle::Hash);
+  std::vector<void*> objects;
+  for (size_t i = 0; i < 3 * per_slab; i++)
+  {
+    objects.push_back(allocator.allocate());
+  }
+  REQUIRE(allocator.slab_count() == 4);
+
+  // Freed objects are reused before new slabs are allocated.
+  void* freed = objects[7];
+  allocator.deallocate(freed);
+  objects.erase(objects.begin() + 7);
+  void* reused = nullptr;
+  while (reused != freed && objects.size() < 4 * per_slab)
+  {
+    reused = allocator.allocate();
+    objects.push_back(reused);
+  }
+  REQUIRE(reused == freed);
+  REQUIRE(allocator.slab_count() == 4);
+
+  // Slabs without objects in use are released.
+  std::sort(objects.begin(), objects.end());
+  for (size_t i = 0; i < objects.size() / 2; i++)
+  {
+    allocator.deallocate(objects[i]);
+  }
+  REQUIRE(allocator.slab_count() < 4);
+  allocator.release();
+  REQUIRE(allocator.slab_count() == 0);
+
+  const auto hashes = make_hashes(100000);
+
+  merkle::Tree tree;
+  merkle::Tree huge;
+  huge.use_huge_pages();
+  tree.insert(hashes);
+  huge.insert(hashes);
+  REQUIRE(huge.root() == tree.root());
+  REQUIRE_THROWS(huge.use_huge_pages());
+
+  const size_t num_slabs = tree.num_node_slabs();
+  REQUIRE(num_slabs > 1);
+  tree.flush_to(hashes.size() - 10);
+  REQUIRE(tree.num_node_slabs() < num_slabs);
+  REQUIRE(tree.root() == huge.root());
+
+  merkle::Tree copy = tree;
+  merkle::Tree moved = std::move(tree);
+  REQUIRE(moved.root() == huge.root());
+  REQUIRE(copy.root() == huge.root());
+}
+
+#ifndef _WIN32
+TEST_CASE("Tree nodes can be kept in a node file")
+{
+  const auto hashes = make_hashes(100000);
+
+  const std::string directory = std::filesystem::temp_directory_path();
+  merkle::Tree tree;
+  merkle::Tree mapped;
+  mapped.use_node_file(directory);
+  REQUIRE_THROWS(mapped.use_huge_pages());
+  tree.insert(hashes);
+  for (const auto& h : hashes)
+  {
+    mapped.insert(h);
+  }
+  REQUIRE(mapped.root() == tree.root());
+  REQUIRE_THROWS(mapped.use_node_file(directory));
+  for (size_t i = 0; i < hashes.size(); i += 997)
+  {
+    REQUIRE(*mapped.path(i) == *tree.path(i));
+  }
+
+  // Flushed slabs are released and their file ranges reused.
+  const size_t num_slabs = mapped.num_node_slabs();
+  REQUIRE(num_slabs > 1);
+  mapped.flush_to(hashes.size() / 2);
+  REQUIRE(mapped.num_node_slabs() < num_slabs);
+  mapped.retract_to(hashes.size() - 1000);
+  tree.retract_to(hashes.size() - 1000);
+  for (size_t i = 0; i < 1000; i++)
+  {
+    mapped.insert(hashes[i]);
+    tree.insert(hashes[i]);
+  }
+  REQUIRE(mapped.root() == tree.root());
+
+  merkle::Tree moved = std::move(mapped);
+  REQUIRE(moved.root() == tree.root());
+
+  merkle::Tree empty;
+  REQUIRE_THROWS(empty.use_node_file(directory + "/missing/directory"));
+}
+#endif
+
+TEST_CASE("Frozen subtrees match pointer subtrees")
+{
+  const auto hashes = make_hashes(300);
+
+  for (size_t num_leaves : {1, 2, 5, 8, 64, 100, 255, 256, 300})
+  {
+    for (size_t flush : {0, 1, 3, 6, 37})
+    {
+      for (size_t freeze : {1, 2, 4, 7, 64, 99, 256, 300})
+      {
+        if (flush >= num_leaves || freeze > num_leaves)
+        {
+          continue;
+        }
+
+        merkle::Tree plain;
+        merkle::Tree frozen;
+        for (size_t i = 0; i < num_leaves; i++)
+        {
+          plain.insert(hashes[i]);
+          frozen.insert(hashes[i]);
+        }
+        plain.flush_to(flush);
+        frozen.flush_to(flush);
+
+        // Freezing in two steps merges the first blocks into larger ones.
+        frozen.freeze_to(freeze / 2);
+        frozen.freeze_to(freeze);
+        REQUIRE(frozen.invariant());
+        REQUIRE(frozen.root() == plain.root());
+
+        const auto last = plain.max_index();
+        for (size_t i = plain.min_index(); i <= last; i += 3)
+        {
+          REQUIRE(frozen.leaf(i) == plain.leaf(i));
+          REQUIRE(*frozen.path(i) == *plain.path(i));
+          REQUIRE(*frozen.past_path(i, last) == *plain.past_path(i, last));
+          REQUIRE(
+            *frozen.past_path(plain.min_index(), i) ==
+            *plain.past_path(plain.min_index(), i));
+        }
+        for (uint8_t level = 0; level < 9; level++)
+        {
+          for (size_t index = 0; (index << level) < num_leaves; index++)
+          {
+            REQUIRE(
+              frozen.subtree_root(level, index) ==
+              plain.subtree_root(level, index));
+          }
+        }
+
+        std::vector<uint8_t> plain_bytes;
+        std::vector<uint8_t> frozen_bytes;
+        plain.serialise(plain_bytes);
+        frozen.serialise(frozen_bytes);
+        REQUIRE(frozen_bytes == plain_bytes);
+        REQUIRE(frozen.serialised_size() == plain.serialised_size());
+        plain_bytes.clear();
+        frozen_bytes.clear();
+        plain.serialise(plain.min_index(), last, plain_bytes);
+        frozen.serialise(plain.min_index(), last, frozen_bytes);
+        REQUIRE(frozen_bytes == plain_bytes);
+
+        merkle::Tree copy;
+        copy = frozen;
+        REQUIRE(copy.num_leaves() == num_leaves);
+        REQUIRE(copy.root() == plain.root());
+        REQUIRE(*copy.path(last) == *plain.path(last));
+
+        // Frozen leaves cannot be retracted, later ones can.
+        if (freeze >= 4)
+        {
+          REQUIRE_THROWS(frozen.retract_to(freeze - 3));
+        }
+        const size_t retract = std::max(freeze, plain.min_index());
+        if (retract < last)
+        {
+          plain.retract_to(retract);
+          frozen.retract_to(retract);
+          REQUIRE(frozen.root() == plain.root());
+        }
+
+        for (size_t i = frozen.num_leaves(); i < hashes.size(); i++)
+        {
+          plain.insert(hashes[i]);
+          frozen.insert(hashes[i]);
+        }
+        frozen.flush_to(freeze / 2 + 3);
+        plain.flush_to(freeze / 2 + 3);
+        REQUIRE(frozen.root() == plain.root());
+        const auto first = plain.min_index();
+        REQUIRE(*frozen.path(first) == *plain.path(first));
+        plain_bytes.clear();
+        frozen_bytes.clear();
+        plain.serialise(plain_bytes);
+        frozen.serialise(frozen_bytes);
+        REQUIRE(frozen_bytes == plain_bytes);
+        copy = frozen;
+        REQUIRE(copy.root() == plain.root());
+        REQUIRE(*copy.path(first) == *plain.path(first));
+      }
+    }
+  }
+}
+
+TEST_CASE("Lean trees recompute frozen hashes")
+{
+  const auto hashes = make_hashes(700);
+
+  for (uint8_t stride : {1, 2, 3, 8})
+  {
+    for (size_t cache_size : {0, 5})
+    {
+      merkle::Tree plain;
+      merkle::Tree lean;
+      lean.freezing.stride = stride;
+      lean.freezing.automatic_height = 4;
+      lean.freezing.cache_size = cache_size;
+
+      for (size_t i = 0; i < 600; i++)
+      {
+        plain.insert(hashes[i]);
+        lean.insert(hashes[i]);
+        if (i % 37 == 0)
+        {
+          REQUIRE(lean.root() == plain.root());
+        }
+      }
+      REQUIRE(lean.root() == plain.root());
+      REQUIRE(lean.num_frozen_blocks() > 0);
+      REQUIRE_THROWS(lean.retract_to(500));
+
+      // Blocks frozen with another stride are merged into new ones.
+      lean.freezing.stride = stride == 1 ? 2 : 1;
+      for (size_t i = 600; i < hashes.size(); i++)
+      {
+        plain.insert(hashes[i]);
+        lean.insert(hashes[i]);
+      }
+      plain.flush_to(3);
+      lean.flush_to(3);
+      REQUIRE(lean.root() == plain.root());
+
+      const auto last = plain.max_index();
+      for (size_t i = plain.min_index(); i <= last; i += 5)
+      {
+        REQUIRE(*lean.path(i) == *plain.path(i));
+        const size_t as_of = (i + last) / 2;
+        REQUIRE(*lean.past_path(i, as_of) == *plain.past_path(i, as_of));
+        REQUIRE(*lean.past_root(i) == *plain.past_root(i));
+      }
+      for (uint8_t level = 1; level < 10; level++)
+      {
+        for (size_t index = 0; (index << level) < last; index += 3)
+        {
+          REQUIRE(
+            lean.subtree_root(level, index) ==
+            plain.subtree_root(level, index));
+        }
+      }
+
+      std::vector<uint8_t> plain_bytes;
+      std::vector<uint8_t> lean_bytes;
+      plain.serialise(plain_bytes);
+      lean.serialise(lean_bytes);
+      REQUIRE(lean_bytes == plain_bytes);
+    }
+  }
+
+  merkle::Tree tree;
+  tree.freezing.stride = 9;
+  tree.insert(hashes[0]);
+  tree.insert(hashes[1]);
+  REQUIRE_THROWS(tree.freeze_to(2));
+}
+
+TEST_CASE("Compact ranges match tree roots")
+{
+  const auto hashes = make_hashes(300);
+
+  merkle::Tree tree;
+  merkle::CompactRange range;
+  std::vector<merkle::Hash> roots;
+  REQUIRE_THROWS((void)range.root());
+  for (const auto& h : hashes)
+  {
+    tree.insert(h);
+    range.append(h);
+    REQUIRE(range.num_leaves() == tree.num_leaves());
+    REQUIRE(range.root() == tree.root());
+    REQUIRE(
+      range.hashes().size() ==
+      static_cast<size_t>(std::popcount(range.end())));
+    roots.push_back(range.root());
+  }
+
+  for (size_t begin : {0, 1, 3, 64, 100})
+  {
+    for (size_t end : {101, 128, 255, 300})
+    {
+      for (size_t split : {0, 1, 2, 5, 63, 64, 65, 99})
+      {
+        if (begin + split > end)
+        {
+          continue;
+        }
+        const std::span<const merkle::Hash> leaves(hashes);
+
+        // Bulk appends match single appends.
+        merkle::CompactRange first(begin);
+        first.append(leaves.subspan(begin, split));
+        merkle::CompactRange second(begin + split);
+        second.append(leaves.subspan(begin + split, end - begin - split));
+        merkle::CompactRange single(begin);
+        for (size_t i = begin; i < end; i++)
+        {
+          single.append(hashes[i]);
+        }
+
+        first.merge(second);
+        REQUIRE(first.begin() == begin);
+        REQUIRE(first.end() == end);
+        REQUIRE(std::ranges::equal(first.hashes(), single.hashes()));
+
+        // Only adjacent ranges can be merged, and only ranges from leaf 0
+        // have roots.
+        merkle::CompactRange prefix;
+        prefix.append(leaves.first(begin));
+        if (second.begin() != end)
+        {
+          REQUIRE_THROWS(first.merge(second));
+        }
+        if (split > 0)
+        {
+          REQUIRE_THROWS(prefix.merge(second));
+        }
+        if (begin > 0)
+        {
+          REQUIRE_THROWS((void)first.root());
+        }
+        prefix.merge(first);
+        REQUIRE(prefix.root() == roots[end - 1]);
+      }
+    }
+  }
+
+  merkle::Tree512 tree512;
+  merkle::CompactRange512 range512;
+  for (size_t i = 0; i < 100; i++)
+  {
+    merkle::Hash512 h;
+    h.bytes[0] = static_cast<uint8_t>(i);
+    tree512.insert(h);
+    range512.append(h);
+    REQUIRE(range512.root() == tree512.root());
+  }
+}
+
+TEST_CASE("Static trees match pointer trees")
+{
+  const auto hashes = make_hashes(300);
+
+  merkle::Tree tree;
+  auto stree = std::make_unique<merkle::StaticTree<300>>();
+  REQUIRE_THROWS((void)stree->root());
+  REQUIRE_THROWS(stree->path(0));
+  for (size_t i = 0; i < hashes.size(); i++)
+  {
+    tree.insert(hashes[i]);
+    stree->insert(hashes[i]);
+    REQUIRE(stree->num_leaves() == tree.num_leaves());
+    REQUIRE(stree->root() == tree.root());
+    for (size_t j = 0; j <= i; j += 1 + i / 8)
+    {
+      REQUIRE(*stree->path(j) == *tree.path(j));
+    }
+    REQUIRE(*stree->path(i) == *tree.path(i));
+  }
+  REQUIRE_THROWS(stree->insert(hashes[0]));
+
+  for (size_t as_of : {0, 1, 2, 63, 64, 100, 255})
+  {
+    REQUIRE(stree->past_root(as_of) == *tree.past_root(as_of));
+    for (size_t index : {size_t{0}, as_of / 2, as_of})
+    {
+      REQUIRE(*stree->past_path(index, as_of) == *tree.past_path(index, as_of));
+    }
+  }
+  REQUIRE_THROWS(stree->past_path(10, 9));
+
+  // Retracted trees keep their hashed subtrees and rehash new leaves.
+  tree.retract_to(99);
+  stree->retract_to(99);
+  REQUIRE(stree->root() == tree.root());
+  for (size_t i = 0; i < 50; i++)
+  {
+    tree.insert(hashes[i]);
+    stree->insert(hashes[i]);
+  }
+  REQUIRE(stree->root() == tree.root());
+  REQUIRE(*stree->path(120) == *tree.path(120));
+
+  merkle::StaticTree<64> bulk;
+  bulk.insert(std::span<const merkle::Hash>(hashes).first(50));
+  REQUIRE_THROWS(bulk.insert(std::span<const merkle::Hash>(hashes).first(20)));
+  REQUIRE(bulk.num_leaves() == 50);
+  REQUIRE(bulk.root() == stree->past_root(49));
+  bulk.clear();
+  REQUIRE(bulk.empty());
+
+  merkle::Tree384 tree384;
+  merkle::StaticTree384<7> stree384;
+  for (size_t i = 0; i < 7; i++)
+  {
+    merkle::Hash384 h;
+    h.bytes[0] = static_cast<uint8_t>(i);
+    tree384.insert(h);
+    stree384.insert(h);
+    REQUIRE(stree384.root() == tree384.root());
+    REQUIRE(*stree384.path(i / 2) == *tree384.path(i / 2));
+  }
+}
+
+TEST_CASE("Merkle tree hashes match tree roots")
+{
+  const auto hashes = make_hashes(3 * 4096 + 17);
+  const std::span<const merkle::Hash> leaves(hashes);
+  REQUIRE_THROWS(merkle::merkle_tree_hash(leaves.first(0)));
+
+  merkle::Tree tree;
+  for (size_t i = 0; i < 300; i++)
+  {
+    tree.insert(hashes[i]);
+    REQUIRE(merkle::merkle_tree_hash(leaves.first(i + 1)) == tree.root());
+  }
+  for (size_t i = 300; i < hashes.size(); i++)
+  {
+    tree.insert(hashes[i]);
+  }
+  for (size_t num_threads : {0, 1, 2, 3, 4, 8})
+  {
+    REQUIRE(merkle::merkle_tree_hash(leaves, num_threads) == tree.root());
+    REQUIRE(
+      merkle::merkle_tree_hash(leaves.first(8192), num_threads) ==
+      *tree.past_root(8191));
+  }
+
+  merkle::Tree512 tree512;
+  std::vector<merkle::Hash512> hashes512(100);
+  for (size_t i = 0; i < hashes512.size(); i++)
+  {
+    hashes512[i].bytes[0] = static_cast<uint8_t>(i);
+    tree512.insert(hashes512[i]);
+  }
+  REQUIRE(
+    merkle::merkle_tree_hash<64, merkle::sha512>(
+      std::span<const merkle::Hash512>(hashes512)) == tree512.root());
+}
+
+TEST_CASE("Batched Merkle tree hashes match tree roots")
+{
+  const auto hashes = make_hashes(1000);
+  const std::span<const merkle::Hash> leaves(hashes);
+
+  // Trees of many sizes, some overlapping in `hashes`.
+  std::vector<std::span<const merkle::Hash>> trees;
+  for (size_t i = 0; i < 200; i++)
+  {
+    const size_t size = 1 + (i * 37) % 97;
+    trees.push_back(leaves.subspan((i * 13) % 900, size));
+  }
+  trees.push_back(leaves);
+
+  const auto roots = merkle::merkle_tree_hashes(trees);
+  REQUIRE(roots.size() == trees.size());
+  for (size_t t = 0; t < trees.size(); t++)
+  {
+    merkle::Tree tree;
+    for (const auto& h : trees[t])
+    {
+      tree.insert(h);
+    }
+    REQUIRE(roots[t] == tree.root());
+  }
+
+  REQUIRE(merkle::merkle_tree_hashes({}).empty());
+  trees.emplace_back();
+  REQUIRE_THROWS(merkle::merkle_tree_hashes(trees));
+}
+
+TEST_CASE("Append queues assign leaf indices to concurrent producers")
+{
+  REQUIRE_THROWS(merkle::AppendQueue(0, 0));
+  REQUIRE_THROWS(merkle::AppendQueue(1, 0));
+  REQUIRE_THROWS(merkle::AppendQueue(12, 0));
+
+  merkle::Tree tree;
+  merkle::Hash first;
+  tree.insert(first);
+  merkle::AppendQueue queue(64, tree.num_leaves());
+
+  // A full queue rejects leaves until it is drained.
+  for (size_t i = 0; i < 64; i++)
+  {
+    REQUIRE(queue.try_push(first) == i + 1);
+  }
+  REQUIRE_FALSE(queue.try_push(first));
+  REQUIRE(queue.drain(tree, 10) == 10);
+  REQUIRE(queue.drain(tree) == 54);
+  REQUIRE(tree.num_leaves() == 65);
+
+  constexpr size_t num_producers = 4;
+  constexpr size_t per_producer = 2000;
+  std::vector<std::vector<size_t>> indices(num_producers);
+  {
+    std::vector<std::jthread> producers;
+    for (size_t p = 0; p < num_producers; p++)
+    {
+      producers.emplace_back([&queue, &indices, p]() {
+        for (size_t i = 0; i < per_producer; i++)
+        {
+          merkle::Hash h;
+          h.bytes[0] = static_cast<uint8_t>(p);
+          h.bytes[1] = static_cast<uint8_t>(i);
+          h.bytes[2] = static_cast<uint8_t>(i >> 8);
+          indices[p].push_back(queue.push(h));
+        }
+      });
+    }
+
+    // The owner keeps computing roots while it drains.
+    while (queue.num_drained() < 64 + num_producers * per_producer)
+    {
+      queue.drain(tree);
+      tree.root();
+    }
+  }
+  REQUIRE(tree.num_leaves() == 1 + 64 + num_producers * per_producer);
+
+  // Every leaf is at the index returned to its producer.
+  for (size_t p = 0; p < num_producers; p++)
+  {
+    for (size_t i = 0; i < per_producer; i++)
+    {
+      const auto& h = tree.leaf(indices[p][i]);
+      REQUIRE(h.bytes[0] == static_cast<uint8_t>(p));
+      REQUIRE(h.bytes[1] == static_cast<uint8_t>(i));
+      REQUIRE(h.bytes[2] == static_cast<uint8_t>(i >> 8));
+    }
+  }
+
+  tree.insert(first);
+  REQUIRE_THROWS(queue.drain(tree));
+}
+
 TEST_CASE("HashT constructors and error paths")
 {
   // Default constructor: all bytes zero